@@ -0,0 +1,114 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "attrtable.h"
+#include "log.h"
+
+namespace zutty {
+
+   constexpr const uint32_t AttrTable::capacity;
+   constexpr const uint16_t AttrTable::defaultId;
+   constexpr const uint16_t AttrTable::inverseId;
+   constexpr const uint16_t AttrTable::nFixed;
+   constexpr const uint32_t AttrTable::minNewBetweenCompacts;
+   constexpr const uint32_t AttrTable::cacheBits;
+
+   AttrTable::AttrTable ()
+   {
+      entries.reserve (64);
+      entries.push_back (Attrs ());
+      entries.push_back (Attrs ());
+      entries [inverseId].inverse = 1;
+      for (uint16_t id = 0; id < nFixed; ++id)
+         ids.emplace (entries [id].key (), id);
+      cache.fill (defaultId);
+   }
+
+   void
+   AttrTable::setFullHandler (const FullHandlerFn& onFull_)
+   {
+      onFull = onFull_;
+   }
+
+   uint16_t
+   AttrTable::intern (const Attrs& attrs)
+   {
+      const uint64_t key = attrs.key ();
+      uint16_t& cached = cache [cacheSlot (key)];
+      if (entries [cached].key () == key)
+         return cached;
+
+      const auto it = ids.find (key);
+      if (it != ids.end ())
+         return cached = it->second;
+
+      ++nNewSinceCompact;
+      if (entries.size () == capacity && onFull &&
+          nNewSinceCompact >= minNewBetweenCompacts)
+         onFull ();
+
+      if (entries.size () == capacity)
+      {
+         if (!warnedFull)
+         {
+            logW << "Attribute table full, using default attributes"
+                 << std::endl;
+            warnedFull = true;
+         }
+         return defaultId;
+      }
+
+      cached = entries.size ();
+      entries.push_back (attrs);
+      ids.emplace (key, cached);
+      return cached;
+   }
+
+   void
+   AttrTable::compact (const std::vector <uint8_t>& used,
+                       std::vector <uint16_t>& remap)
+   {
+      std::vector <Attrs> kept;
+      kept.reserve (entries.size ());
+      remap.assign (entries.size (), defaultId);
+      ids.clear ();
+      for (uint32_t id = 0; id < entries.size (); ++id)
+      {
+         if (id >= nFixed && !used [id])
+            continue;
+
+         remap [id] = kept.size ();
+         ids.emplace (entries [id].key (), kept.size ());
+         kept.push_back (entries [id]);
+      }
+      logT << "Attribute table compacted: " << kept.size () << " of "
+           << entries.size () << " entries in use" << std::endl;
+
+      entries.swap (kept);
+      ++generation;
+      cache.fill (defaultId);
+      nNewSinceCompact = 0;
+      warnedFull = false;
+   }
+
+   void
+   AttrTable::copyTo (AttrTable& dst) const
+   {
+      if (dst.generation != generation || dst.entries.size () > size ())
+         dst.entries = entries;
+      else
+         dst.entries.insert (dst.entries.end (),
+                             entries.begin () + dst.entries.size (),
+                             entries.end ());
+      dst.generation = generation;
+   }
+
+} // namespace zutty
@@ -0,0 +1,98 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include "cell.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace zutty {
+
+   /* Interned cell attributes: each distinct Attrs in use gets an ID,
+    * which is what a Cell holds. Entries are only ever appended, so a
+    * copy of the table (e.g., the one in a Frame handed to the Renderer)
+    * is brought up to date by copying the new ones.
+    *
+    * Once all IDs are taken, the handler set by setFullHandler () is
+    * called to find the entries still in use and compact () the table,
+    * renumbering them. That changes the meaning of IDs, so copies of the
+    * table are rewritten in full (and cells drawn with the old IDs must
+    * be redrawn), which the generation number serves to detect.
+    */
+   class AttrTable
+   {
+   public:
+      using Ptr = std::shared_ptr <AttrTable>;
+      using FullHandlerFn = std::function <void ()>;
+
+      constexpr const static uint32_t capacity = 1 << 14; // see Cell::attr
+
+      // Entries that are always present, with a fixed ID
+      constexpr const static uint16_t defaultId = 0; // default colors
+      constexpr const static uint16_t inverseId = 1; // the same, inverse
+      constexpr const static uint16_t nFixed = 2;
+
+      explicit AttrTable ();
+
+      void setFullHandler (const FullHandlerFn& onFull);
+
+      /* Return the ID of attrs, adding it as a new entry if needed. If
+       * there is no room even after compacting the table, the default
+       * attributes are used instead.
+       */
+      uint16_t intern (const Attrs& attrs);
+
+      const Attrs& operator [] (uint16_t id) const { return entries [id]; }
+      const Attrs* data () const { return entries.data (); }
+      uint32_t size () const { return entries.size (); }
+      uint32_t getGeneration () const { return generation; }
+
+      /* Drop the entries not flagged in used (indexed by ID), except the
+       * fixed ones, keeping the order of the rest. On return, remap holds
+       * the new ID of each entry kept, indexed by its old ID.
+       */
+      void compact (const std::vector <uint8_t>& used,
+                    std::vector <uint16_t>& remap);
+
+      /* Make dst a copy of this table, for looking up attributes only
+       * (the copy does not intern).
+       */
+      void copyTo (AttrTable& dst) const;
+
+   private:
+      std::vector <Attrs> entries;
+      std::unordered_map <uint64_t, uint16_t> ids; // Attrs::key () -> ID
+      uint32_t generation = 0;
+      // Recently interned IDs, indexed by a hash of their Attrs::key (),
+      // saving most lookups in ids (one per SGR sequence otherwise)
+      constexpr const static uint32_t cacheBits = 12;
+      std::array <uint16_t, 1 << cacheBits> cache;
+      FullHandlerFn onFull;
+      // Compacting a table with hardly any entries no longer in use does
+      // not help for long, so it is only done again after as many new
+      // attributes have been seen:
+      constexpr const static uint32_t minNewBetweenCompacts = capacity / 16;
+      uint32_t nNewSinceCompact = 0;
+      bool warnedFull = false;
+
+      static uint32_t cacheSlot (uint64_t key)
+      {
+         return (key * 0x9e3779b97f4a7c15ull) >> (64 - cacheBits);
+      }
+   };
+
+} // namespace zutty
@@ -0,0 +1,467 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "bench.h"
+#include "capture.h"
+#include "fontpack.h"
+#include "log.h"
+#include "options.h"
+#include "renderer.h"
+#include "vterm.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES3/gl31.h>
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+   using namespace zutty;
+
+   using Clock = std::chrono::steady_clock;
+
+   // Prefer the surfaceless platform (if available) so as not to depend
+   // on a display server; a pbuffer surface works with any of them.
+   EGLDisplay
+   getEglDisplay ()
+   {
+      const char* exts = eglQueryString (EGL_NO_DISPLAY, EGL_EXTENSIONS);
+      auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+         eglGetProcAddress ("eglGetPlatformDisplayEXT");
+      if (exts && strstr (exts, "EGL_MESA_platform_surfaceless") &&
+          getPlatformDisplay)
+      {
+         EGLDisplay dpy = getPlatformDisplay (EGL_PLATFORM_SURFACELESS_MESA,
+                                             EGL_DEFAULT_DISPLAY, nullptr);
+         if (dpy != EGL_NO_DISPLAY)
+            return dpy;
+      }
+      return eglGetDisplay (EGL_DEFAULT_DISPLAY);
+   }
+
+   double
+   toMs (Clock::duration d)
+   {
+      return std::chrono::duration <double, std::milli> (d).count ();
+   }
+
+   // Nearest-rank percentile of sorted values
+   double
+   percentile (const std::vector <double>& sorted, double p)
+   {
+      if (sorted.empty ())
+         return 0.0;
+      size_t rank = std::ceil (p * sorted.size ());
+      return sorted [std::max (rank, (size_t)1) - 1];
+   }
+
+   std::string
+   jsonString (const char* str)
+   {
+      std::ostringstream oss;
+      oss << '"';
+      for (const char* p = str; *p; ++p)
+      {
+         if (*p == '"' || *p == '\\')
+            oss << '\\' << *p;
+         else if ((unsigned char)*p < 0x20)
+            oss << "\\u00" << std::hex << std::setw (2)
+                << std::setfill ('0') << (int)*p << std::dec;
+         else
+            oss << *p;
+      }
+      oss << '"';
+      return oss.str ();
+   }
+
+   /* A pty with nothing running on the other end, for a Vterm to write
+    * its replies into and to resize. The slave is kept open (and leaked,
+    * as is the master) so that neither of that fails; what is written to
+    * the master just fills it up, and is then dropped.
+    */
+   int
+   openIdlePty ()
+   {
+      const int master = posix_openpt (O_RDWR | O_NOCTTY | O_CLOEXEC);
+      if (master < 0 || grantpt (master) < 0 || unlockpt (master) < 0)
+         return -1;
+      const char* name = ptsname (master);
+      const int slave = name ? open (name, O_RDWR | O_NOCTTY | O_CLOEXEC)
+                             : -1;
+      if (slave < 0)
+         return -1;
+
+      struct termios term;
+      if (tcgetattr (slave, &term) == 0)
+      {
+         cfmakeraw (&term);
+         tcsetattr (slave, TCSANOW, &term);
+      }
+      fcntl (master, F_SETFL, O_NONBLOCK);
+      return master;
+   }
+
+   // FNV-1a of the characters and attributes on screen, and the cursor
+   uint64_t
+   screenChecksum (Frame& frame)
+   {
+      uint64_t h = 0xcbf29ce484222325;
+      auto add = [&h] (uint32_t value)
+      {
+         for (int k = 0; k < 4; ++k, value >>= 8)
+            h = (h ^ (value & 0xff)) * 0x100000001b3;
+      };
+      auto color = [] (const Color& c)
+      {
+         return c.red | c.green << 8 | c.blue << 16;
+      };
+
+      if (!frame.attrTable)
+         return h;
+      for (uint16_t pY = 0; pY < frame.nRows; ++pY)
+         for (uint16_t pX = 0; pX < frame.nCols; ++pX)
+         {
+            const Cell& cell = frame.getCell (pY, pX);
+            const Attrs& attrs = (*frame.attrTable) [cell.attr];
+            add (toCodePoint (cell.uc_pt));
+            add (color (attrs.fg));
+            add (color (attrs.bg));
+            add (attrs.bold | attrs.italic << 1 | attrs.underline << 2 |
+                 attrs.inverse << 3);
+         }
+      add (frame.cursor.posX);
+      add (frame.cursor.posY);
+      return h;
+   }
+
+} // namespace
+
+namespace zutty {
+
+   int
+   runBench (const char* path)
+   {
+      std::ifstream ifs (path, std::ios::binary);
+      if (!ifs)
+      {
+         logE << "Can't open benchmark input: " << path << std::endl;
+         return 1;
+      }
+      const std::vector <unsigned char> input (
+         (std::istreambuf_iterator <char> (ifs)),
+         std::istreambuf_iterator <char> ());
+
+      EGLDisplay egl_dpy = getEglDisplay ();
+      if (egl_dpy == EGL_NO_DISPLAY ||
+          !eglInitialize (egl_dpy, nullptr, nullptr))
+      {
+         logE << "eglInitialize() failed" << std::endl;
+         return 1;
+      }
+
+      static const EGLint attribs[] = {
+         EGL_RED_SIZE, 8,
+         EGL_GREEN_SIZE, 8,
+         EGL_BLUE_SIZE, 8,
+         EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+         EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+         EGL_NONE
+      };
+      static const EGLint ctx_attribs[] = {
+         EGL_CONTEXT_CLIENT_VERSION, 2,
+         EGL_NONE
+      };
+
+      EGLConfig config;
+      EGLint num_configs;
+      if (!eglChooseConfig (egl_dpy, attribs, &config, 1, &num_configs) ||
+          num_configs < 1)
+      {
+         logE << "Couldn't get an EGL pbuffer config" << std::endl;
+         return 1;
+      }
+
+      Fontpack fontpk (opts.fontpath, opts.fontname);
+      const int win_width = 2 * opts.border + opts.nCols * fontpk.getPx ();
+      const int win_height = 2 * opts.border + opts.nRows * fontpk.getPy ();
+
+      const EGLint pb_attribs[] = {
+         EGL_WIDTH, win_width,
+         EGL_HEIGHT, win_height,
+         EGL_NONE
+      };
+      eglBindAPI (EGL_OPENGL_ES_API);
+      EGLContext egl_ctx = eglCreateContext (egl_dpy, config, EGL_NO_CONTEXT,
+                                             ctx_attribs);
+      EGLSurface egl_surf = eglCreatePbufferSurface (egl_dpy, config,
+                                                     pb_attribs);
+      if (!egl_ctx || !egl_surf)
+      {
+         logE << "Couldn't create EGL pbuffer context" << std::endl;
+         return 1;
+      }
+
+      /* The latency of a frame is measured from the first update it
+       * includes (that is, the one after the update taken for the
+       * previous frame) to the completion of its drawing. Each thread
+       * only logs its own timestamps, matched up in the end.
+       */
+      std::vector <Clock::time_point> updatedAt; // by seqNo - 1
+      std::vector <std::pair <uint64_t, Clock::time_point>> drawnAt;
+      std::atomic <uint64_t> drawnSeqNo {0};
+      std::unique_ptr <Renderer> renderer;
+
+      renderer = std::make_unique <Renderer> (
+         [egl_dpy, egl_surf, egl_ctx] ()
+         {
+            if (!eglMakeCurrent (egl_dpy, egl_surf, egl_surf, egl_ctx))
+               throw std::runtime_error ("Error: eglMakeCurrent() failed");
+            eglSwapInterval (egl_dpy, 0);
+         },
+         [egl_dpy, egl_surf, &renderer, &drawnAt, &drawnSeqNo] ()
+         {
+            eglSwapBuffers (egl_dpy, egl_surf);
+            glFinish (); // swapping a pbuffer does not wait for the GPU
+            const uint64_t seqNo = renderer->getTakenSeqNo ();
+            drawnAt.emplace_back (seqNo, Clock::now ());
+            drawnSeqNo = seqNo;
+         },
+         &fontpk);
+
+      const int devNull = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+      Vterm vt (fontpk.getPx (), fontpk.getPy (),
+                win_width, win_height, devNull);
+      vt.setRefreshHandler (
+         [&renderer, &updatedAt] (const Frame& f)
+         {
+            updatedAt.push_back (Clock::now ());
+            renderer->update (f);
+         });
+
+      auto waitForLastUpdate = [&updatedAt, &drawnSeqNo] ()
+      {
+         while (drawnSeqNo < updatedAt.size ())
+            std::this_thread::sleep_for (std::chrono::milliseconds (1));
+      };
+
+      // Draw the initial (blank) screen first, so that setting up the
+      // renderer is not part of the measurement.
+      vt.redraw ();
+      waitForLastUpdate ();
+      const size_t nSetupUpdates = updatedAt.size ();
+      const size_t nSetupFrames = drawnAt.size ();
+
+      // Log messages about the input (e.g., unimplemented sequences) would
+      // both add to the measured time and get mixed into the results.
+      const bool quiet = opts.quiet;
+      opts.quiet = true;
+
+      // Feed the input in chunks of the size readPty () would read at most
+      const Clock::time_point startAt = Clock::now ();
+      for (size_t pos = 0; pos < input.size (); pos += opts.readSize)
+      {
+         const size_t len = std::min ((size_t)opts.readSize,
+                                      input.size () - pos);
+         vt.processInput (input.data () + pos, len);
+      }
+      const Clock::time_point parsedAt = Clock::now ();
+
+      waitForLastUpdate ();
+      const Clock::time_point doneAt = Clock::now ();
+
+      renderer = nullptr; // ~Renderer () shuts down renderer thread
+      opts.quiet = quiet;
+      close (devNull);
+
+      std::vector <double> latencies;
+      uint64_t prevSeqNo = nSetupUpdates;
+      for (size_t k = nSetupFrames; k < drawnAt.size (); ++k)
+      {
+         const uint64_t seqNo = drawnAt [k].first;
+         if (seqNo > prevSeqNo)
+            latencies.push_back (toMs (drawnAt [k].second -
+                                       updatedAt [prevSeqNo]));
+         prevSeqNo = seqNo;
+      }
+      std::sort (latencies.begin (), latencies.end ());
+
+      const double parseSecs = toMs (parsedAt - startAt) / 1000.0;
+      std::cout << std::fixed << std::setprecision (3)
+                << "{\"file\": " << jsonString (path)
+                << ", \"bytes\": " << input.size ()
+                << ", \"cols\": " << opts.nCols
+                << ", \"rows\": " << opts.nRows
+                << ", \"backend\": \""
+                << (opts.backend == Backend::fragment ? "fragment"
+                                                      : "compute") << "\""
+                << ", \"parseSeconds\": " << parseSecs
+                << ", \"totalSeconds\": " << toMs (doneAt - startAt) / 1000.0
+                << ", \"mbPerSec\": "
+                << (parseSecs > 0 ? input.size () / parseSecs / 1e6 : 0.0)
+                << ", \"updates\": " << updatedAt.size () - nSetupUpdates
+                << ", \"frames\": " << drawnAt.size () - nSetupFrames
+                << ", \"frameLatencyMs\": {"
+                << "\"p50\": " << percentile (latencies, 0.5)
+                << ", \"p99\": " << percentile (latencies, 0.99)
+                << ", \"max\": " << percentile (latencies, 1.0)
+                << "}}" << std::endl;
+
+      eglMakeCurrent (egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                      EGL_NO_CONTEXT);
+      eglDestroyContext (egl_dpy, egl_ctx);
+      eglDestroySurface (egl_dpy, egl_surf);
+      eglTerminate (egl_dpy);
+      return 0;
+   }
+
+   int
+   runReplay (const char* path, bool realtime)
+   {
+      using capture::EventType;
+      using Osc = std::pair <int, std::string>;
+
+      std::unique_ptr <CaptureReader> reader;
+      try
+      {
+         reader = std::make_unique <CaptureReader> (path);
+      }
+      catch (const std::exception& e)
+      {
+         logE << "Can't replay: " << e.what () << std::endl;
+         return 1;
+      }
+      const capture::Header& header = reader->getHeader ();
+
+      const int ptyFd = openIdlePty ();
+      if (ptyFd < 0)
+      {
+         logE << "Can't open a pty: " << strerror (errno) << std::endl;
+         return 1;
+      }
+
+      // the grid is the one recorded only with the same border
+      opts.border = header.border;
+      Vterm vt (header.glyphPx, header.glyphPy, header.winPx, header.winPy,
+                ptyFd);
+      Frame lastFrame;
+      uint64_t nUpdates = 0;
+      vt.setRefreshHandler (
+         [&lastFrame, &nUpdates] (const Frame& f)
+         {
+            lastFrame = f;
+            ++nUpdates;
+         });
+      std::vector <Osc> oscs, oscsRecorded;
+      vt.setOscHandler (
+         [&oscs] (int cmd, const std::string& arg)
+         {
+            oscs.emplace_back (cmd, arg);
+         });
+
+      const bool quiet = opts.quiet;
+      opts.quiet = true;
+
+      capture::Event event;
+      std::vector <double> chunkCosts; // in microseconds
+      size_t outputBytes = 0;
+      size_t inputBytes = 0;
+      size_t nResizes = 0;
+      Clock::duration parseTime {0};
+      const Clock::time_point startAt = Clock::now ();
+      try
+      {
+         while (reader->next (event))
+         {
+            if (realtime)
+               std::this_thread::sleep_until (
+                  startAt + std::chrono::microseconds (event.atUs));
+
+            switch (event.type)
+            {
+            case EventType::Output:
+            {
+               const Clock::time_point parseAt = Clock::now ();
+               vt.processInput ((const unsigned char*)event.data.data (),
+                                event.data.size ());
+               const Clock::duration took = Clock::now () - parseAt;
+               parseTime += took;
+               chunkCosts.push_back (toMs (took) * 1000.0);
+               outputBytes += event.data.size ();
+               break;
+            }
+            case EventType::Input:
+               // the replies of the terminal are made again, and what
+               // was typed only shows up as far as the shell echoed it
+               inputBytes += event.data.size ();
+               break;
+            case EventType::Resize:
+               vt.resize (event.getWinPx (), event.getWinPy ());
+               ++nResizes;
+               break;
+            case EventType::Osc:
+               oscsRecorded.emplace_back (event.getOscCmd (),
+                                          event.getOscArg ());
+               break;
+            }
+         }
+      }
+      catch (const std::exception& e)
+      {
+         opts.quiet = quiet;
+         logE << "Can't replay: " << e.what () << std::endl;
+         return 1;
+      }
+      const Clock::time_point doneAt = Clock::now ();
+      opts.quiet = quiet;
+      std::sort (chunkCosts.begin (), chunkCosts.end ());
+
+      const double parseSecs = toMs (parseTime) / 1000.0;
+      std::cout << std::fixed << std::setprecision (3)
+                << "{\"file\": " << jsonString (path)
+                << ", \"outputBytes\": " << outputBytes
+                << ", \"inputBytes\": " << inputBytes
+                << ", \"resizes\": " << nResizes
+                << ", \"cols\": " << lastFrame.nCols
+                << ", \"rows\": " << lastFrame.nRows
+                << ", \"realtime\": " << (realtime ? "true" : "false")
+                << ", \"parseSeconds\": " << parseSecs
+                << ", \"totalSeconds\": " << toMs (doneAt - startAt) / 1000.0
+                << ", \"mbPerSec\": "
+                << (parseSecs > 0 ? outputBytes / parseSecs / 1e6 : 0.0)
+                << ", \"chunks\": " << chunkCosts.size ()
+                << ", \"chunkParseUs\": {"
+                << "\"p50\": " << percentile (chunkCosts, 0.5)
+                << ", \"p99\": " << percentile (chunkCosts, 0.99)
+                << ", \"max\": " << percentile (chunkCosts, 1.0)
+                << "}, \"updates\": " << nUpdates
+                << ", \"oscs\": " << oscsRecorded.size ()
+                << ", \"oscsMatch\": "
+                << (oscs == oscsRecorded ? "true" : "false")
+                << ", \"screenChecksum\": \"" << std::hex << std::setw (16)
+                << std::setfill ('0') << screenChecksum (lastFrame)
+                << std::dec << "\"}" << std::endl;
+      return 0;
+   }
+
+} // namespace zutty
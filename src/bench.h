@@ -0,0 +1,32 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+namespace zutty {
+
+   /* Benchmark mode: feed the content of a file (as if it were output by
+    * the shell) into a Vterm, render it offscreen into an EGL pbuffer,
+    * and print the throughput and frame latency on stdout as a JSON
+    * object. No X display is needed. Returns the exit status.
+    */
+   int runBench (const char* path);
+
+   /* Replay mode: feed the output of the shell recorded in a capture
+    * file (see CaptureWriter) into a Vterm, with the window size changes
+    * in between, and print the parse time of the output chunks and a
+    * checksum of the final screen on stdout as a JSON object. With
+    * realtime, the events are replayed with the timing recorded, else as
+    * fast as possible. Nothing is rendered. Returns the exit status.
+    */
+   int runReplay (const char* path, bool realtime);
+
+} // namespace zutty
@@ -0,0 +1,251 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "capture.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+   using namespace zutty::capture;
+
+   // The size of the Header in a file, with the magic before it
+   constexpr const size_t headerSize = 4 + 5 * 2;
+
+   constexpr const uint64_t maxEventSize = 1 << 24;
+
+   void
+   putLE (std::string& out, uint64_t value, int nBytes)
+   {
+      for (int k = 0; k < nBytes; ++k, value >>= 8)
+         out.push_back ((char)(value & 0xff));
+   }
+
+   uint64_t
+   getLE (const char* in, int nBytes)
+   {
+      uint64_t value = 0;
+      for (int k = nBytes - 1; k >= 0; --k)
+         value = (value << 8) | (uint8_t)in [k];
+      return value;
+   }
+
+   void
+   putVarint (std::string& out, uint64_t value)
+   {
+      while (value >= 0x80)
+      {
+         out.push_back ((char)((value & 0x7f) | 0x80));
+         value >>= 7;
+      }
+      out.push_back ((char)value);
+   }
+
+   // Decode a varint at pos in str, advancing pos past it
+   bool
+   getVarint (const std::string& str, size_t& pos, uint64_t& value)
+   {
+      value = 0;
+      for (int shift = 0; pos < str.size () && shift < 64; shift += 7)
+      {
+         const uint8_t byte = str [pos++];
+         value |= (uint64_t)(byte & 0x7f) << shift;
+         if (!(byte & 0x80))
+            return true;
+      }
+      return false;
+   }
+
+   // The same, reading from a stream; false at the end of it
+   bool
+   readVarint (std::istream& is, uint64_t& value)
+   {
+      value = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+         const int byte = is.get ();
+         if (byte == std::char_traits <char>::eof ())
+            return false;
+         value |= (uint64_t)(byte & 0x7f) << shift;
+         if (!(byte & 0x80))
+            return true;
+      }
+      return false;
+   }
+
+} // namespace
+
+namespace zutty {
+
+   namespace capture {
+
+      uint16_t
+      Event::getWinPx () const
+      {
+         return data.size () == 4 ? getLE (data.data (), 2) : 0;
+      }
+
+      uint16_t
+      Event::getWinPy () const
+      {
+         return data.size () == 4 ? getLE (data.data () + 2, 2) : 0;
+      }
+
+      int
+      Event::getOscCmd () const
+      {
+         size_t pos = 0;
+         uint64_t cmd = 0;
+         getVarint (data, pos, cmd);
+         return cmd;
+      }
+
+      std::string
+      Event::getOscArg () const
+      {
+         size_t pos = 0;
+         uint64_t cmd;
+         getVarint (data, pos, cmd);
+         return data.substr (pos);
+      }
+
+   } // namespace capture
+
+   CaptureWriter::CaptureWriter (const std::string& path_,
+                                 const capture::Header& header)
+      : path {path_}
+      , ofs {path, std::ios::binary | std::ios::trunc}
+      , startAt {Clock::now ()}
+   {
+      if (!ofs)
+         throw std::runtime_error ("cannot create " + path + ": " +
+                                   strerror (errno));
+
+      std::string hdr;
+      putLE (hdr, Header::magic, 4);
+      putLE (hdr, header.glyphPx, 2);
+      putLE (hdr, header.glyphPy, 2);
+      putLE (hdr, header.winPx, 2);
+      putLE (hdr, header.winPy, 2);
+      putLE (hdr, header.border, 2);
+      ofs.write (hdr.data (), hdr.size ());
+      logI << "Recording the session to " << path << std::endl;
+   }
+
+   void
+   CaptureWriter::output (const unsigned char* data, size_t len)
+   {
+      record (EventType::Output, (const char*)data, len);
+      ofs.flush (); // so a crash loses as little as possible
+   }
+
+   void
+   CaptureWriter::input (const char* data, size_t len)
+   {
+      record (EventType::Input, data, len);
+   }
+
+   void
+   CaptureWriter::resize (uint16_t winPx, uint16_t winPy)
+   {
+      std::string size;
+      putLE (size, winPx, 2);
+      putLE (size, winPy, 2);
+      record (EventType::Resize, size.data (), size.size ());
+   }
+
+   void
+   CaptureWriter::osc (int cmd, const std::string& arg)
+   {
+      std::string prefix;
+      putVarint (prefix, cmd);
+      record (EventType::Osc, arg.data (), arg.size (), prefix);
+   }
+
+   // private methods
+
+   void
+   CaptureWriter::record (EventType type, const char* data, size_t len,
+                          const std::string& prefix)
+   {
+      if (failed)
+         return;
+
+      using std::chrono::microseconds;
+      const uint64_t nowUs =
+         std::chrono::duration_cast <microseconds> (Clock::now () - startAt)
+         .count ();
+
+      std::string head;
+      head.push_back ((char)type);
+      putVarint (head, nowUs - lastUs);
+      putVarint (head, prefix.size () + len);
+      head.append (prefix);
+      ofs.write (head.data (), head.size ());
+      ofs.write (data, len);
+      lastUs = nowUs;
+
+      if (!ofs)
+      {
+         logE << "Recording stopped, cannot write " << path << std::endl;
+         failed = true;
+      }
+   }
+
+   CaptureReader::CaptureReader (const std::string& path_)
+      : path {path_}
+      , ifs {path, std::ios::binary}
+   {
+      if (!ifs)
+         throw std::runtime_error ("cannot open " + path + ": " +
+                                   strerror (errno));
+
+      char hdr [headerSize];
+      if (!ifs.read (hdr, sizeof (hdr)) ||
+          getLE (hdr, 4) != Header::magic)
+         throw std::runtime_error ("not a capture file: " + path);
+
+      header.glyphPx = getLE (hdr + 4, 2);
+      header.glyphPy = getLE (hdr + 6, 2);
+      header.winPx = getLE (hdr + 8, 2);
+      header.winPy = getLE (hdr + 10, 2);
+      header.border = getLE (hdr + 12, 2);
+      if (!header.glyphPx || !header.glyphPy)
+         throw std::runtime_error ("bad glyph size in capture: " + path);
+   }
+
+   bool
+   CaptureReader::next (Event& event)
+   {
+      const int type = ifs.get ();
+      if (type == std::char_traits <char>::eof ())
+         return false;
+
+      uint64_t deltaUs, len;
+      if (!readVarint (ifs, deltaUs) || !readVarint (ifs, len))
+         throw std::runtime_error ("capture cut short: " + path);
+      if (type < (int)EventType::Output || type > (int)EventType::Osc ||
+          len > maxEventSize)
+         throw std::runtime_error ("malformed capture: " + path);
+
+      atUs += deltaUs;
+      event.type = (EventType)type;
+      event.atUs = atUs;
+      event.data.resize (len);
+      if (!ifs.read (&event.data [0], len))
+         throw std::runtime_error ("capture cut short: " + path);
+      return true;
+   }
+
+} // namespace zutty
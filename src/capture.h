@@ -0,0 +1,113 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+namespace zutty {
+
+   /* Capture of a terminal session (zutty -record), to be replayed later
+    * (zutty -replay) to reproduce what the terminal went through: the
+    * output of the shell as read from the pty, the bytes written to the
+    * pty, the window size changes and the OSC commands handed on.
+    *
+    * A capture file starts with a Header, followed by the events, each
+    * of them made of the type byte, the time since the previous event in
+    * microseconds and the length of the payload (both as LEB128 varints),
+    * and the payload. All values are little endian, so a capture can be
+    * replayed on another host than it was recorded on.
+    */
+   namespace capture {
+
+      enum class EventType: uint8_t
+      {
+         Output = 1, // bytes processed as output of the shell
+         Input,      // bytes written to the pty
+         Resize,     // window size: winPx, winPy (uint16_t each)
+         Osc         // OSC command (as a varint) and its argument
+      };
+
+      struct Header
+      {
+         constexpr const static uint32_t magic = 0x3150435a; // "ZCP1"
+
+         uint16_t glyphPx;
+         uint16_t glyphPy;
+         uint16_t winPx; // window size at the start
+         uint16_t winPy;
+         uint16_t border;
+      };
+
+      struct Event
+      {
+         EventType type;
+         uint64_t atUs; // microseconds since the start of the capture
+         std::string data;
+
+         // Decoding the payload of Resize and Osc events
+         uint16_t getWinPx () const;
+         uint16_t getWinPy () const;
+         int getOscCmd () const;
+         std::string getOscArg () const;
+      };
+
+   } // namespace capture
+
+   class CaptureWriter
+   {
+   public:
+      // Throws std::runtime_error if the file cannot be created
+      explicit CaptureWriter (const std::string& path,
+                              const capture::Header& header);
+
+      void output (const unsigned char* data, size_t len);
+      void input (const char* data, size_t len);
+      void resize (uint16_t winPx, uint16_t winPy);
+      void osc (int cmd, const std::string& arg);
+
+   private:
+      using Clock = std::chrono::steady_clock;
+
+      void record (capture::EventType type, const char* data, size_t len,
+                   const std::string& prefix = std::string ());
+
+      std::string path;
+      std::ofstream ofs;
+      Clock::time_point startAt;
+      uint64_t lastUs = 0;
+      bool failed = false;
+   };
+
+   class CaptureReader
+   {
+   public:
+      // Throws std::runtime_error if the file is not a capture
+      explicit CaptureReader (const std::string& path);
+
+      const capture::Header& getHeader () const { return header; }
+
+      /* Read the next event; return false at the end of the capture.
+       * Throws std::runtime_error if it is cut short or malformed.
+       */
+      bool next (capture::Event& event);
+
+   private:
+      std::string path;
+      std::ifstream ifs;
+      capture::Header header;
+      uint64_t atUs = 0;
+   };
+
+} // namespace zutty
@@ -0,0 +1,105 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include "base.h"
+#include "options.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+namespace zutty {
+
+   /* The display attributes of a cell, as laid out in the attribute
+    * table of the CharVdev. A screen only ever shows a few dozen distinct
+    * combinations, so cells do not hold these themselves, but the ID of
+    * an entry of an AttrTable (see attrtable.h).
+    */
+   struct Attrs
+   {
+      Color fg;
+      uint8_t bold: 1;
+      uint8_t italic: 1;
+      uint8_t underline: 1;
+      uint8_t inverse: 1;
+      uint8_t _fill0: 4;
+      Color bg;
+      uint8_t _fill1;
+
+      Attrs ():
+         fg (opts.fg), bold (0), italic (0), underline (0), inverse (0),
+         _fill0 (0), bg (opts.bg), _fill1 (0)
+      {}
+
+      uint64_t key () const
+      {
+         uint64_t k;
+         memcpy (&k, this, sizeof (k));
+         return k;
+      }
+
+      bool operator == (const Attrs& rhs) const
+      {
+         return key () == rhs.key ();
+      }
+
+      bool operator != (const Attrs& rhs) const
+      {
+         return ! operator == (rhs);
+      }
+   };
+   static_assert (sizeof (Attrs) == 8, "Attrs size mismatch");
+
+   /* The character cell and cursor, as laid out in the "video memory" of
+    * the CharVdev. Kept apart from it, so that the Vterm and Frame can be
+    * built without any GL dependencies.
+    */
+   struct Cell
+   {
+      uint16_t uc_pt = ' '; // glyph ID, see toGlyphId ()
+      uint16_t attr: 14;    // ID of the Attrs in the AttrTable
+      uint16_t wrap: 1;
+      uint16_t dirty: 1;
+
+      Cell (): attr (0), wrap (0), dirty (0) {}
+
+      using Ptr = std::shared_ptr <Cell>;
+
+      bool operator == (const Cell& rhs) const
+      {
+         return memcmp (this, &rhs, sizeof (Cell)) == 0;
+      }
+
+      bool operator != (const Cell& rhs) const
+      {
+         return ! operator == (rhs);
+      }
+   };
+   static_assert (sizeof (Cell) == 4, "Cell size mismatch");
+
+   struct Cursor
+   {
+      Color color = {255, 255, 255};
+      uint16_t posX = 0;
+      uint16_t posY = 0;
+
+      enum class Style: uint8_t
+      {
+         hidden = 0,
+         filled_block = 1,
+         hollow_block = 2
+      };
+      Style style = Style::hidden;
+   };
+
+} // namespace zutty
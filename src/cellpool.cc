@@ -0,0 +1,191 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "cellpool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace zutty {
+
+   constexpr const size_t CellPool::nClasses;
+   constexpr const size_t CellPool::maxFreePerClass;
+   constexpr const size_t CellPool::hugePageSize;
+   constexpr const size_t CellPool::blockSize;
+
+   // Allocator of the control blocks of the shared pointers to buffers
+   template <typename T>
+   struct CellPool::BlockAllocator
+   {
+      using value_type = T;
+
+      explicit BlockAllocator (CellPool* pool_): pool (pool_) {}
+
+      template <typename U>
+      BlockAllocator (const BlockAllocator <U>& other): pool (other.pool) {}
+
+      T* allocate (size_t n)
+      {
+         return static_cast <T*> (pool->allocBlock (n * sizeof (T)));
+      }
+
+      void deallocate (T* p, size_t n)
+      {
+         pool->freeBlock (p, n * sizeof (T));
+      }
+
+      template <typename U>
+      bool operator == (const BlockAllocator <U>& other) const
+      {
+         return pool == other.pool;
+      }
+
+      template <typename U>
+      bool operator != (const BlockAllocator <U>& other) const
+      {
+         return pool != other.pool;
+      }
+
+      CellPool* pool;
+   };
+
+   struct CellPool::Deleter
+   {
+      void operator () (Cell* cells) const
+      {
+         pool->freeBuffer (cells, cls);
+      }
+
+      CellPool* pool;
+      size_t cls;
+   };
+
+   CellPool&
+   CellPool::instance ()
+   {
+      // Never destroyed, as buffers may still be given back on exit
+      static CellPool* pool = new CellPool ();
+      return * pool;
+   }
+
+   CellPool::CellPool ()
+      : pageSize (sysconf (_SC_PAGESIZE))
+   {
+      // so that giving a buffer back never allocates
+      for (auto& list: freeBuffers)
+         list.reserve (maxFreePerClass);
+   }
+
+   Cell::Ptr
+   CellPool::get (size_t nCells)
+   {
+      const size_t size = std::max (nCells, (size_t)1) * sizeof (Cell);
+      size_t cls = 0;
+      while ((pageSize << cls) < size)
+         if (++cls == nClasses)
+            throw std::bad_alloc ();
+
+      Cell* cells = static_cast <Cell*> (allocBuffer (cls));
+      std::uninitialized_fill_n (cells, nCells, Cell ());
+      return Cell::Ptr (cells, Deleter {this, cls},
+                        BlockAllocator <Cell> (this));
+   }
+
+   void*
+   CellPool::allocBuffer (size_t cls)
+   {
+      {
+         std::lock_guard <std::mutex> lock (mutex);
+         auto& list = freeBuffers [cls];
+         if (!list.empty ())
+         {
+            void* buf = list.back ();
+            list.pop_back ();
+            return buf;
+         }
+      }
+
+      const size_t size = pageSize << cls;
+      const size_t align = size < hugePageSize ? pageSize : hugePageSize;
+      // Map with room to spare for the alignment, and trim that off
+      const size_t mapSize = size + align - pageSize;
+      void* map = mmap (nullptr, mapSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (map == MAP_FAILED)
+         throw std::bad_alloc ();
+
+      char* start = static_cast <char*> (map);
+      char* buf = start + (align - (uintptr_t)start % align) % align;
+      if (buf > start)
+         munmap (start, buf - start);
+      if (buf + size < start + mapSize)
+         munmap (buf + size, start + mapSize - (buf + size));
+
+   #if defined(MADV_HUGEPAGE)
+      if (size >= hugePageSize)
+         madvise (buf, size, MADV_HUGEPAGE);
+   #endif
+      return buf;
+   }
+
+   void
+   CellPool::freeBuffer (void* buf, size_t cls)
+   {
+      {
+         std::lock_guard <std::mutex> lock (mutex);
+         auto& list = freeBuffers [cls];
+         if (list.size () < maxFreePerClass)
+         {
+            list.push_back (buf);
+            return;
+         }
+      }
+      munmap (buf, pageSize << cls);
+   }
+
+   void*
+   CellPool::allocBlock (size_t size)
+   {
+      if (size > blockSize)
+         return ::operator new (size);
+
+      {
+         std::lock_guard <std::mutex> lock (mutex);
+         if (freeBlocks)
+         {
+            Block* block = freeBlocks;
+            freeBlocks = block->next;
+            return block;
+         }
+      }
+      return ::operator new (blockSize);
+   }
+
+   void
+   CellPool::freeBlock (void* block, size_t size)
+   {
+      if (size > blockSize)
+      {
+         ::operator delete (block);
+         return;
+      }
+
+      std::lock_guard <std::mutex> lock (mutex);
+      Block* b = static_cast <Block*> (block);
+      b->next = freeBlocks;
+      freeBlocks = b;
+   }
+
+} // namespace zutty
@@ -0,0 +1,78 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include "cell.h"
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace zutty {
+
+   /* Cell storage for the Frames (and their snapshots) and the
+    * Scrollback. A full screen program flips between the screens all
+    * the time, and a window drag resizes them for every frame, so
+    * buffers given back are kept for reuse instead of being freed.
+    * Their sizes are rounded up to a power of two number of pages (the
+    * size class), and each class has a short free list. The control
+    * blocks of the shared pointers owning the buffers come from the
+    * pool as well, so in steady state nothing is left for the general
+    * allocator to do.
+    *
+    * Buffers are mapped anonymously, so they are page aligned; those of
+    * hugePageSize and up are aligned to that and offered huge pages.
+    * The last reference to a buffer may be dropped on any thread.
+    */
+   class CellPool
+   {
+   public:
+      static CellPool& instance ();
+
+      // A buffer of nCells blank cells
+      Cell::Ptr get (size_t nCells);
+
+   private:
+      explicit CellPool ();
+      CellPool (const CellPool&) = delete;
+      CellPool& operator = (const CellPool&) = delete;
+
+      constexpr const static size_t nClasses = 24;
+      constexpr const static size_t maxFreePerClass = 4;
+      constexpr const static size_t hugePageSize = 2 << 20;
+      constexpr const static size_t blockSize = 64; // for control blocks
+
+      template <typename T> struct BlockAllocator;
+      struct Deleter;
+
+      void* allocBuffer (size_t cls);
+      void freeBuffer (void* buf, size_t cls);
+      void* allocBlock (size_t size);
+      void freeBlock (void* block, size_t size);
+
+      const size_t pageSize;
+      std::mutex mutex;
+      std::vector <void*> freeBuffers [nClasses];
+      struct Block
+      {
+         Block* next;
+      };
+      Block* freeBlocks = nullptr;
+   };
+
+   inline Cell::Ptr
+   make_cells (uint16_t nCols, uint16_t nRows)
+   {
+      return CellPool::instance ().get ((size_t)nCols * nRows);
+   }
+
+} // namespace zutty
@@ -12,75 +12,116 @@
 #include "charvdev.h"
 #include "log.h"
 #include "options.h"
+#include "progcache.h"
+#include "stats.h"
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <vector>
 
 namespace {
 
-   static const char *computeShaderSource = R"(#version 310 es
-
-layout (local_size_x = 1, local_size_y = 1) in;
-layout (rgba32f, binding = 0) writeonly lowp uniform image2D imgOut;
+   // Entry points of GL_EXT_disjoint_timer_query, loaded on demand
+   struct
+   {
+      PFNGLGENQUERIESEXTPROC genQueries = nullptr;
+      PFNGLDELETEQUERIESEXTPROC deleteQueries = nullptr;
+      PFNGLBEGINQUERYEXTPROC beginQuery = nullptr;
+      PFNGLENDQUERYEXTPROC endQuery = nullptr;
+      PFNGLGETQUERYOBJECTUIVEXTPROC getQueryObjectuiv = nullptr;
+      PFNGLGETQUERYOBJECTUI64VEXTPROC getQueryObjectui64v = nullptr;
+   } timerExt;
+
+   /* Shader code common to both backends: decoding a cell into the
+    * style it is displayed with, and computing the pixels of a cell.
+    */
+   static const char *cellShaderSource = R"(
 layout (binding = 1) uniform lowp sampler2DArray atlas;
 layout (binding = 2) uniform lowp sampler2D atlasMap;
 uniform lowp ivec2 glyphPixels;
 uniform lowp ivec2 sizeChars;
 uniform lowp ivec3 cursorColor;
-uniform lowp ivec4 cursorPos; // .xy: current; .zw: previous
+uniform lowp ivec4 cursorPos; // .xy: current; .zw: previous, in storage
 uniform lowp int cursorStyle;
 uniform lowp ivec4 selectRect;
 uniform lowp int selectRectMode;
-uniform highp ivec2 selectDamage;
-uniform lowp int deltaFrame;
+uniform highp ivec3 scrollRegion; // marginTop, marginBottom, scrollHead
 
+// Bits 0-15: glyph ID; 16-29: attribute ID; 30: wrap; 31: dirty
 struct Cell
 {
    highp uint charData;
-   highp uint fg;
-   highp uint bg;
 };
 
-layout (std430, binding = 0) buffer CharVideoMem
+// Entries of the AttrTable: .x is fg (bits 0-23) and the flags (bold,
+// italic, underline, inverse from bit 24 up); .y is bg (bits 0-23).
+layout (std430, binding = 1) readonly buffer AttrTable
 {
-   Cell cells[];
-} vmem;
+   highp uvec2 attrs[];
+} atab;
 
-void main ()
+// Flags of a cell style
+const uint Draw = 1u;
+const uint Underline = 2u;
+const uint OutlineCursor = 4u;
+
+struct CellStyle
 {
-   ivec2 charPos = ivec2 (gl_GlobalInvocationID.xy);
-   int idx = sizeChars.x * charPos.y + charPos.x;
-   Cell cell = vmem.cells[idx];
+   uint flags;
+   uint fontIdx;
+   ivec2 atlasPos;
+   vec3 fg;
+   vec3 bg;
+   vec3 cursor;
+};
 
-   if (deltaFrame == 1)
-   {
-      uint dirty = bitfieldExtract (cell.charData, 21, 1);
-      if (dirty == 0u &&
-          charPos != cursorPos.xy && charPos != cursorPos.zw &&
-          (idx < selectDamage.x || idx >= selectDamage.y))
-         return;
-   }
-   vmem.cells[idx].charData = bitfieldInsert (cell.charData, 0u, 21, 1);
+/* The cells are stored in the row order of the Frame, which has a ring
+ * of rows for the scrolling region; map rows of the display to rows of
+ * storage and back.
+ */
+int storageRow (int row)
+{
+   if (row < scrollRegion.x || row >= scrollRegion.y)
+      return row;
+   row += scrollRegion.z - scrollRegion.x;
+   return row < scrollRegion.y ? row : row - (scrollRegion.y - scrollRegion.x);
+}
+
+int displayRow (int row)
+{
+   if (row < scrollRegion.x || row >= scrollRegion.y)
+      return row;
+   row -= scrollRegion.z - scrollRegion.x;
+   return row >= scrollRegion.x ? row : row + (scrollRegion.y - scrollRegion.x);
+}
 
+// Decode a cell displayed at charPos
+CellStyle styleCell (ivec2 charPos, Cell cell)
+{
    ivec2 charCode =
       ivec2 (bitfieldExtract (cell.charData, 0, 8),  // Lowest byte
              bitfieldExtract (cell.charData, 8, 8)); // Next-lowest byte
 
+   uvec2 attr = atab.attrs[bitfieldExtract (cell.charData, 16, 14)];
+
    // fontIdx == 0 -> Normal; 1 -> Bold; 2 -> Italic; 3 -> BoldItalic
-   uint fontIdx = bitfieldExtract (cell.charData, 16, 2);
-   uint underline = bitfieldExtract (cell.charData, 18, 1);
-   uint inverse = bitfieldExtract (cell.charData, 19, 1);
+   uint fontIdx = bitfieldExtract (attr.x, 24, 2);
+   uint underline = bitfieldExtract (attr.x, 26, 1);
+   uint inverse = bitfieldExtract (attr.x, 27, 1);
 
    ivec2 atlasPos = ivec2 (vec2 (256) * texelFetch (atlasMap, charCode, 0).zw);
 
-   vec3 fgColor = vec3 (float (bitfieldExtract (cell.fg, 0, 8)),
-                        float (bitfieldExtract (cell.fg, 8, 8)),
-                        float (bitfieldExtract (cell.fg, 16, 8))) / 255.0;
+   vec3 fgColor = vec3 (float (bitfieldExtract (attr.x, 0, 8)),
+                        float (bitfieldExtract (attr.x, 8, 8)),
+                        float (bitfieldExtract (attr.x, 16, 8))) / 255.0;
 
-   vec3 bgColor = vec3 (float (bitfieldExtract (cell.bg, 0, 8)),
-                        float (bitfieldExtract (cell.bg, 8, 8)),
-                        float (bitfieldExtract (cell.bg, 16, 8))) / 255.0;
+   vec3 bgColor = vec3 (float (bitfieldExtract (attr.y, 0, 8)),
+                        float (bitfieldExtract (attr.y, 8, 8)),
+                        float (bitfieldExtract (attr.y, 16, 8))) / 255.0;
 
    vec3 crColor = vec3 (cursorColor) / 255.0;
 
@@ -110,38 +151,129 @@ void main ()
       bgColor = crColor;
    }
 
-   for (int j = 0; j < glyphPixels.x; j++) {
-      for (int k = 0; k < glyphPixels.y; k++) {
-         ivec2 txCoords = atlasPos * glyphPixels + ivec2 (j, k);
-         ivec3 txc = ivec3 (txCoords, fontIdx);
-         float lumi = texelFetch (atlas, txc, 0).r;
-         vec4 pixel = vec4 (fgColor * lumi + bgColor * (1.0 - lumi), 1.0);
-         ivec2 pxCoords = charPos * glyphPixels + ivec2 (j, k);
-         imageStore (imgOut, pxCoords, pixel);
-      }
+   uint flags = Draw;
+   if (underline == uint (1))
+      flags |= Underline;
+   if (charPos == cursorPos.xy && cursorStyle == 2)
+      flags |= OutlineCursor;
+
+   return CellStyle (flags, fontIdx, atlasPos, fgColor, bgColor, crColor);
+}
+
+// Compute the pixel at glyphPos (relative to the top left of the cell)
+vec4 cellPixel (CellStyle style, ivec2 glyphPos)
+{
+   ivec2 lastPixel = glyphPixels - ivec2 (1);
+   if ((style.flags & OutlineCursor) != 0u &&
+       (glyphPos.x == 0 || glyphPos.y == 0 ||
+        glyphPos.x == lastPixel.x || glyphPos.y == lastPixel.y))
+      return vec4 (style.cursor, 1.0);
+
+   if ((style.flags & Underline) != 0u && glyphPos.y == lastPixel.y)
+      return vec4 (style.fg, 1.0);
+
+   ivec2 txCoords = style.atlasPos * glyphPixels + glyphPos;
+   ivec3 txc = ivec3 (txCoords, style.fontIdx);
+   float lumi = texelFetch (atlas, txc, 0).r;
+   return vec4 (style.fg * lumi + style.bg * (1.0 - lumi), 1.0);
+}
+)";
+
+   /* The compute shader renders a tile of TILE_COLS x TILE_ROWS cells
+    * per workgroup into the output image. The cells of the tile are
+    * first decoded into shared memory (one cell per invocation, as long
+    * as there are cells left), then the invocations split the pixels of
+    * the whole tile among each other. In a delta frame, tiles without
+    * any cell to redraw are left right after decoding.
+    *
+    * Tiles, like the output image, are laid out in the row order of
+    * cell storage: the image is mapped onto the display (by
+    * fragmentShaderSource) the same way as the cells, so scrolling only
+    * needs the newly exposed rows drawn.
+    *
+    * The workgroup size (LOCAL_SIZE_X, LOCAL_SIZE_Y) is chosen at runtime
+    * according to the limits of the GL implementation, see createShaders.
+    */
+   static const char *computeShaderSource = R"(
+layout (local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y) in;
+layout (rgba8, binding = 0) writeonly lowp uniform image2D imgOut;
+uniform highp ivec4 selectDamage; // cells [x, y) and [z, w)
+uniform lowp int deltaFrame;
+uniform highp int rowOffset;
+
+layout (std430, binding = 0) buffer CharVideoMem
+{
+   Cell cells[];
+} vmem;
+
+const int tileCells = TILE_COLS * TILE_ROWS;
+const uint localSize = uint (LOCAL_SIZE_X * LOCAL_SIZE_Y);
+
+shared uint tileDraw;
+shared CellStyle tileStyle[tileCells];
+
+void decodeCell (ivec2 cellPos, int i)
+{
+   tileStyle[i].flags = 0u;
+   if (cellPos.x >= sizeChars.x || cellPos.y >= sizeChars.y)
+      return;
+
+   int idx = sizeChars.x * cellPos.y + cellPos.x;
+   Cell cell = vmem.cells[idx];
+   ivec2 charPos = ivec2 (cellPos.x, displayRow (cellPos.y));
+
+   if (deltaFrame == 1)
+   {
+      uint dirty = bitfieldExtract (cell.charData, 31, 1);
+      int charIdx = sizeChars.x * charPos.y + charPos.x;
+      if (dirty == 0u &&
+          charPos != cursorPos.xy && cellPos != cursorPos.zw &&
+          (charIdx < selectDamage.x || charIdx >= selectDamage.y) &&
+          (charIdx < selectDamage.z || charIdx >= selectDamage.w))
+         return;
    }
+   vmem.cells[idx].charData = bitfieldInsert (cell.charData, 0u, 31, 1);
 
-   if (underline == uint (1)) {
-      for (int j = 0; j < glyphPixels.x; j++) {
-         vec4 pixel = vec4 (fgColor, 1.0);
-         ivec2 pxCoords = charPos * glyphPixels + ivec2 (j, glyphPixels.y - 1);
-         imageStore (imgOut, pxCoords, pixel);
-      }
+   tileStyle[i] = styleCell (charPos, cell);
+   tileDraw = 1u;
+}
+
+void main ()
+{
+   ivec2 tileOrigin = ivec2 (gl_WorkGroupID.xy) * ivec2 (TILE_COLS, TILE_ROWS)
+                    + ivec2 (0, rowOffset);
+
+   if (gl_LocalInvocationIndex == 0u)
+      tileDraw = 0u;
+   memoryBarrierShared ();
+   barrier ();
+
+   for (uint i = gl_LocalInvocationIndex; i < uint (tileCells); i += localSize)
+   {
+      ivec2 cellPos = ivec2 (int (i) % TILE_COLS, int (i) / TILE_COLS);
+      decodeCell (tileOrigin + cellPos, int (i));
    }
+   memoryBarrierShared ();
+   barrier ();
 
-   if (charPos == cursorPos.xy && cursorStyle == 2) {
-      vec4 pixel = vec4 (crColor, 1.0);
-      for (int j = 0; j < glyphPixels.x; j++) {
-         ivec2 pxCoords = charPos * glyphPixels + ivec2 (j, 0);
-         imageStore (imgOut, pxCoords, pixel);
-         pxCoords += ivec2 (0, glyphPixels.y - 1);
-         imageStore (imgOut, pxCoords, pixel);
-      }
-      for (int k = 1; k < glyphPixels.y - 1; k++) {
-         ivec2 pxCoords = charPos * glyphPixels + ivec2 (0, k);
-         imageStore (imgOut, pxCoords, pixel);
-         pxCoords += ivec2 (glyphPixels.x - 1, 0);
-         imageStore (imgOut, pxCoords, pixel);
+   if (tileDraw == 0u)
+      return;
+
+   ivec2 tilePixels = ivec2 (TILE_COLS, TILE_ROWS) * glyphPixels;
+   for (int y = int (gl_LocalInvocationID.y); y < tilePixels.y;
+        y += LOCAL_SIZE_Y)
+   {
+      for (int x = int (gl_LocalInvocationID.x); x < tilePixels.x;
+           x += LOCAL_SIZE_X)
+      {
+         ivec2 cellPos = ivec2 (x, y) / glyphPixels;
+         int i = TILE_COLS * cellPos.y + cellPos.x;
+         if (tileStyle[i].flags == 0u)
+            continue;
+
+         ivec2 glyphPos = ivec2 (x, y) - cellPos * glyphPixels;
+         ivec2 pxCoords = (tileOrigin + cellPos) * glyphPixels + glyphPos;
+         imageStore (imgOut, pxCoords, cellPixel (tileStyle[i], glyphPos));
       }
    }
 }
@@ -161,19 +293,57 @@ void main ()
 }
 )";
 
+   /* Draws the output image of the compute shader, with its rows
+    * mapped like those of the cells (scrollPixels is scrollRegion of
+    * the cell shaders in pixel rows).
+    */
    static const char *fragmentShaderSource = R"(#version 310 es
 
 in highp vec2 texCoord;
 
-layout (rgba32f, binding = 0) readonly lowp uniform image2D imgOut;
+layout (rgba8, binding = 0) readonly lowp uniform image2D imgOut;
 
 uniform highp vec2 viewPixels;
+uniform highp ivec3 scrollPixels;
 
 layout (location = 0) out lowp vec4 outColor;
 
 void main ()
 {
-   outColor = imageLoad (imgOut, ivec2 (texCoord * viewPixels));
+   highp ivec2 pxCoords = ivec2 (texCoord * viewPixels);
+   if (pxCoords.y >= scrollPixels.x && pxCoords.y < scrollPixels.y)
+   {
+      pxCoords.y += scrollPixels.z - scrollPixels.x;
+      if (pxCoords.y >= scrollPixels.y)
+         pxCoords.y -= scrollPixels.y - scrollPixels.x;
+   }
+   outColor = imageLoad (imgOut, pxCoords);
+}
+)";
+
+   /* Renders the cells directly (the fragment backend), computing each
+    * pixel on its own. This needs no output image, but always draws the
+    * whole view.
+    */
+   static const char *cellFragmentShaderSource = R"(
+in highp vec2 texCoord;
+
+uniform highp vec2 viewPixels;
+
+layout (std430, binding = 0) readonly buffer CharVideoMem
+{
+   Cell cells[];
+} vmem;
+
+layout (location = 0) out lowp vec4 outColor;
+
+void main ()
+{
+   ivec2 pxCoords = ivec2 (texCoord * viewPixels);
+   ivec2 charPos = pxCoords / glyphPixels;
+   Cell cell = vmem.cells[sizeChars.x * storageRow (charPos.y) + charPos.x];
+   outColor = cellPixel (styleCell (charPos, cell),
+                         pxCoords - charPos * glyphPixels);
 }
 )";
 
@@ -213,6 +383,50 @@ void main ()
       }
    }
 
+   struct ShaderSource
+   {
+      GLenum type;
+      const char* name;
+      std::string source;
+   };
+
+   /* Build the program name from the shaders, or load the binary of it
+    * cached in an earlier session (and cache it if there was none).
+    */
+   GLuint
+   makeProgram (const zutty::ProgramCache& cache, const char* name,
+                const std::vector <ShaderSource>& shaders)
+   {
+      std::string source;
+      for (const ShaderSource& shader: shaders)
+         source.append (shader.name).append (":\n").append (shader.source);
+
+      GLuint program = glCreateProgram ();
+      if (cache.load (name, source, program))
+         return program;
+
+      // start over, as the binary rejected might have left something
+      glDeleteProgram (program);
+      program = glCreateProgram ();
+      std::vector <GLuint> objects;
+      for (const ShaderSource& shader: shaders)
+      {
+         objects.push_back (createShader (shader.type, shader.source.c_str (),
+                                          shader.name));
+         glAttachShader (program, objects.back ());
+      }
+      cache.prepare (program);
+      linkProgram (program, name);
+      for (GLuint object: objects)
+      {
+         glDetachShader (program, object);
+         glDeleteShader (object);
+      }
+
+      cache.save (name, source, program);
+      return program;
+   }
+
    void
    setupTexture (GLuint target, GLenum type, GLuint& texture)
    {
@@ -230,20 +444,6 @@ void main ()
       glTexParameteri (type, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
    }
 
-   void
-   setupAtlasTexture (const zutty::Font& fnt, int idx)
-   {
-      glTexSubImage3D(GL_TEXTURE_2D_ARRAY,
-                      0,    // mipmap level, always zero
-                      0, 0, // X and Y offsets into texture area
-                      idx,  // layer index offset
-                      fnt.getPx () * fnt.getNx (),
-                      fnt.getPy () * fnt.getNy (),
-                      1,    // number of layers, i.e., fonts, loaded
-                      GL_RED, GL_UNSIGNED_BYTE, fnt.getAtlasData ());
-      glCheckError ();
-   }
-
    template <typename T> void
    setupStorageBuffer (GLuint index, GLuint& buffer, uint32_t n_items)
    {
@@ -257,11 +457,59 @@ void main ()
       std::size_t size = sizeof (T) * n_items;
       glBufferData (GL_SHADER_STORAGE_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
    }
+
+   // A range of display cell indices [start, end)
+   struct CellRange
+   {
+      uint32_t start = 0;
+      uint32_t end = 0;
+   };
+
+   // The range covered by a selection; all of its rows if rectangular
+   CellRange
+   selectionRange (const zutty::Rect& sel, uint16_t nCols)
+   {
+      const uint32_t n = nCols;
+      if (sel.empty ())
+         return CellRange ();
+      if (sel.rectangular)
+         return {n * sel.tl.y, n * (sel.br.y + 1u)};
+      return {n * sel.tl.y + sel.tl.x, n * sel.br.y + sel.br.x};
+   }
+
+   /* The cells that change their selection state from prev to sel, as
+    * (at most) two ranges. Dragging a linear selection only moves one of
+    * its ends, so much less than the whole selection needs redrawing.
+    */
+   void
+   selectionChange (const zutty::Rect& prev, const zutty::Rect& sel,
+                    uint16_t nCols, CellRange& r0, CellRange& r1)
+   {
+      const CellRange a = selectionRange (prev, nCols);
+      const CellRange b = selectionRange (sel, nCols);
+      r1 = CellRange ();
+      if (a.start == a.end)
+         r0 = b;
+      else if (b.start == b.end)
+         r0 = a;
+      else if (prev.rectangular != sel.rectangular ||
+               (sel.rectangular &&
+                (prev.tl.x != sel.tl.x || prev.br.x != sel.br.x)))
+         r0 = {std::min (a.start, b.start), std::max (a.end, b.end)};
+      else
+      {
+         r0 = {std::min (a.start, b.start), std::max (a.start, b.start)};
+         r1 = {std::min (a.end, b.end), std::max (a.end, b.end)};
+      }
+   }
 }
 
 namespace zutty {
 
-   CharVdev::CharVdev (const Fontpack* fontpk_)
+   constexpr const unsigned CharVdev::Shared::minAtlasSlots;
+   constexpr const unsigned CharVdev::Shared::maxAtlasSlots;
+
+   CharVdev::Shared::Shared (const Fontpack* fontpk_)
       : fontpk (* fontpk_)
    {
       createShaders ();
@@ -296,81 +544,134 @@ namespace zutty {
       glCheckError ();
 
       /*
-       * Setup compute program
+       * Setup program rendering the cells
        */
-      glUseProgram (P_compute);
-      glUniform2i (compU_glyphPixels, fontpk.getPx (), fontpk.getPy ());
-      glUniform2i (compU_sizeChars, nCols, nRows);
+      glUseProgram (P_cells);
+      glUniform2i (cellU_glyphPixels, fontpk.getPx (), fontpk.getPy ());
 
       // Setup atlas texture
-      setupTexture (GL_TEXTURE1, GL_TEXTURE_2D_ARRAY, T_atlas);
       const Font& reg = fontpk.getRegular ();
+      layerFonts [0] = &reg;
+      layerFonts [1] = fontpk.hasBold () ? &fontpk.getBold () : &reg;
+      layerFonts [2] = fontpk.hasItalic () ? &fontpk.getItalic () : &reg;
+      layerFonts [3] = fontpk.hasBoldItalic () ? &fontpk.getBoldItalic ()
+                     : fontpk.hasItalic () ? &fontpk.getItalic ()
+                     : fontpk.hasBold () ? &fontpk.getBold ()
+                     : &reg;
+
+      setupAtlasGeometry ();
+      setupTexture (GL_TEXTURE1, GL_TEXTURE_2D_ARRAY, T_atlas);
       glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_R8,
-                     reg.getPx () * reg.getNx (),
-                     reg.getPy () * reg.getNy (),
+                     fontpk.getPx () * atlasNx,
+                     fontpk.getPy () * atlasNy,
                      4); // number of layers
       glCheckError ();
 
-      setupAtlasTexture (reg, 0);
-
-      if (fontpk.hasBold ())
-         setupAtlasTexture (fontpk.getBold (), 1);
-      else
-         setupAtlasTexture (fontpk.getRegular (), 1);
-
-      if (fontpk.hasItalic ())
-         setupAtlasTexture (fontpk.getItalic (), 2);
-      else
-         setupAtlasTexture (fontpk.getRegular (), 2);
-
-      if (fontpk.hasBoldItalic ())
-         setupAtlasTexture (fontpk.getBoldItalic (), 3);
-      else if (fontpk.hasItalic ())
-         setupAtlasTexture (fontpk.getItalic (), 3);
-      else if (fontpk.hasBold ())
-         setupAtlasTexture (fontpk.getBold (), 3);
-      else
-         setupAtlasTexture (fontpk.getRegular (), 3);
+      // Slot 0 holds a blank glyph
+      glyphBuf.assign (fontpk.getPx () * fontpk.getPy (), 0);
+      for (int layer = 0; layer < 4; ++layer)
+         uploadGlyph (0, layer);
 
-      // Setup atlas mapping texture
+      // Setup atlas mapping texture, to be filled as glyphs are loaded
       auto atlasMap = std::vector <uint8_t> ();
       atlasMap.resize (2 * 256 * 256, 0);
-
-      // Pre-fill the mapping texture with references to "missing glyph"
-      // and "replacement character" glyphs, if available in the font atlas.
-      const auto itEnd = reg.getAtlasMap ().end ();
-      auto rcIt = reg.getAtlasMap ().find (Unicode_Replacement_Character);
-      if (rcIt == itEnd)
-         rcIt = reg.getAtlasMap ().find (' ');
-      assert (rcIt != itEnd);
-      auto mgIt = reg.getAtlasMap ().find (Missing_Glyph_Marker);
-      if (mgIt == itEnd)
-         mgIt = reg.getAtlasMap ().find (' ');
-      assert (mgIt != itEnd);
-      for (int k = 0; k < 256 * 256; ++k)
-      {
-         const auto& apos =
-            ((k >= 0xd800 && k < 0xe000) || k >= 0xfffe)
-            ? rcIt->second
-            : mgIt->second;
-         atlasMap [2 * k] = apos.x;
-         atlasMap [2 * k + 1] = apos.y;
-      }
-
-      // Fill the mapping texture with supported characters
-      auto it = reg.getAtlasMap ().begin ();
-      for (; it != itEnd; ++it)
-      {
-         atlasMap [2 * it->first] = it->second.x;
-         atlasMap [2 * it->first + 1] = it->second.y;
-      }
       setupTexture (GL_TEXTURE2, GL_TEXTURE_2D, T_atlasMap);
       glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, 256, 256, 0,
                    GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, atlasMap.data ());
+
+      // Load the "missing glyph" and "replacement character" glyphs, if
+      // available in the font, and printable ASCII up front. These will
+      // never be evicted from the atlas.
+      glyphSlot.assign (256 * 256, 0);
+      astralGens.assign (Astral_Glyph_Count, 0);
+      nSlotsUsed = 1;
+      loadGlyph (' ');
+      if (loadGlyph (Missing_Glyph_Marker) &&
+          glyphSlot [Missing_Glyph_Marker] != noSlot)
+         missingGlyphPos = slotPos (glyphSlot [Missing_Glyph_Marker]);
+      if (loadGlyph (Unicode_Replacement_Character) &&
+          glyphSlot [Unicode_Replacement_Character] != noSlot)
+         replacementPos = slotPos (glyphSlot [Unicode_Replacement_Character]);
+      for (uint16_t cp = '!'; cp < 0x7f; ++cp)
+         loadGlyph (cp);
+      nPinned = nSlotsUsed;
+      logT << "Atlas: " << nPinned << " glyphs loaded up front" << std::endl;
+   }
+
+   CharVdev::Shared::~Shared ()
+   {
+      glDeleteTextures (1, &T_atlas);
+      glDeleteTextures (1, &T_atlasMap);
+      if (P_compute)
+         glDeleteProgram (P_compute);
+      glDeleteProgram (P_draw);
+   }
+
+   CharVdev::CharVdev (Shared& shared_)
+      : shared (shared_)
+   {
+      // Setup attribute table, to be filled by setAttrTable ()
+      setupStorageBuffer <Attrs> (1, B_attrs, AttrTable::capacity);
+
+      if (opts.stats)
+         setupTimers ();
+
+      shared.users.push_back (this);
    }
 
    CharVdev::~CharVdev ()
    {
+      for (GLsync& fence: stagingFence)
+         if (fence)
+            glDeleteSync (fence);
+      if (hasTimers)
+         timerExt.deleteQueries (2 * nTimerFrames, &timerQueries [0][0]);
+      glDeleteBuffers (1, &B_staging);
+      glDeleteBuffers (1, &B_text);
+      glDeleteBuffers (1, &B_attrs);
+      glDeleteTextures (1, &T_output);
+
+      auto& users = shared.users;
+      users.erase (std::remove (users.begin (), users.end (), this),
+                   users.end ());
+      if (shared.active == this)
+         shared.active = nullptr;
+   }
+
+   void
+   CharVdev::activate ()
+   {
+      if (shared.active == this)
+         return;
+      shared.active = this;
+
+      glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 0, B_text);
+      glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 1, B_attrs);
+      glBindBuffer (GL_COPY_READ_BUFFER, B_staging);
+      glBindBuffer (GL_COPY_WRITE_BUFFER, B_text);
+      if (shared.P_compute && T_output)
+         glBindImageTexture (0, T_output, 0, GL_FALSE, 0, GL_WRITE_ONLY,
+                             GL_RGBA8);
+
+      const uint16_t px = shared.fontpk.getPx ();
+      const uint16_t py = shared.fontpk.getPy ();
+      const GLint viewWidth = nCols * px;
+      const GLint viewHeight = nRows * py;
+      glViewport (opts.border, pxHeight - viewHeight - opts.border,
+                  viewWidth, viewHeight);
+
+      glUseProgram (shared.P_draw);
+      glUniform2f (shared.drawU_viewPixels,
+                   (GLfloat)viewWidth, (GLfloat)viewHeight);
+      if (shared.P_compute)
+         glUniform3i (shared.drawU_scrollPixels, py * marginTop,
+                      py * marginBottom, py * scrollHead);
+
+      glUseProgram (shared.P_cells);
+      glUniform2i (shared.cellU_sizeChars, nCols, nRows);
+      glUniform3i (shared.cellU_scrollRegion, marginTop, marginBottom,
+                   scrollHead);
+      glCheckError ();
    }
 
    bool
@@ -383,33 +684,30 @@ namespace zutty {
 
       pxWidth = pxWidth_;
       pxHeight = pxHeight_;
-      nCols = (pxWidth - (2 * opts.border)) / fontpk.getPx ();
-      nRows = (pxHeight - (2 * opts.border)) / fontpk.getPy ();
+      nCols = (pxWidth - (2 * opts.border)) / shared.fontpk.getPx ();
+      nRows = (pxHeight - (2 * opts.border)) / shared.fontpk.getPy ();
 
       logI << "Resize to " << pxWidth << " x " << pxHeight
            << " pixels, " << nCols << " x " << nRows << " chars"
            << std::endl;
 
-      GLint viewWidth = nCols * fontpk.getPx ();
-      GLint viewHeight = nRows * fontpk.getPy ();
-      glViewport (opts.border, pxHeight - viewHeight - opts.border,
-                  viewWidth, viewHeight);
-
-      glUseProgram (P_draw);
-
-      glUniform2f (drawU_viewPixels, (GLfloat)viewWidth, (GLfloat)viewHeight);
-
-      glUseProgram (P_compute);
-
-      glUniform2i (compU_sizeChars, nCols, nRows);
-
-      setupTexture (GL_TEXTURE0, GL_TEXTURE_2D, T_output);
-      glTexStorage2D (GL_TEXTURE_2D, 1, GL_RGBA32F, viewWidth, viewHeight);
-      glBindImageTexture (0, T_output, 0, GL_FALSE, 0, GL_WRITE_ONLY,
-                          GL_RGBA32F);
+      if (shared.P_compute)
+      {
+         setupTexture (GL_TEXTURE0, GL_TEXTURE_2D, T_output);
+         glTexStorage2D (GL_TEXTURE_2D, 1, GL_RGBA8,
+                         nCols * shared.fontpk.getPx (),
+                         nRows * shared.fontpk.getPy ());
+      }
       glCheckError ();
 
       setupStorageBuffer <Cell> (0, B_text, nRows * nCols);
+      dirtyRows.assign (nRows, 0);
+      shadowCells.assign (nRows * nCols, Cell ());
+      setupStagingBuffer ();
+
+      // set up the new geometry (and bind the new objects)
+      shared.active = nullptr;
+      activate ();
 
       return true;
    }
@@ -417,38 +715,105 @@ namespace zutty {
    void
    CharVdev::setCursor (const Cursor& cursor)
    {
-      static uint16_t prevPosX = 0;
-      static uint16_t prevPosY = 0;
-
-      glUseProgram (P_compute);
-      glUniform3i (compU_cursorColor,
+      // The previous cursor is still drawn where its cell is in storage,
+      // wherever that is displayed now.
+      glUseProgram (shared.P_cells);
+      glUniform3i (shared.cellU_cursorColor,
                    cursor.color.red, cursor.color.green, cursor.color.blue);
-      glUniform4i (compU_cursorPos, cursor.posX, cursor.posY, prevPosX, prevPosY);
-      prevPosX = cursor.posX;
-      prevPosY = cursor.posY;
-      glUniform1i (compU_cursorStyle, static_cast <uint8_t> (cursor.style));
+      glUniform4i (shared.cellU_cursorPos, cursor.posX, cursor.posY,
+                   prevCursorX, prevCursorRow);
+      markDirtyRows (cursor.posY, cursor.posY + 1);
+      if (prevCursorRow < nRows)
+         dirtyRows [prevCursorRow] = 1;
+      prevCursorX = cursor.posX;
+      prevCursorRow = cursor.posY < nRows ? storageRow (cursor.posY)
+                                          : cursor.posY;
+      glUniform1i (shared.cellU_cursorStyle,
+                   static_cast <uint8_t> (cursor.style));
    }
 
    void
    CharVdev::setSelection (const Rect& sel)
    {
-      static Rect prev;
-      Rect damage (std::min (sel.tl, prev.tl), std::max (sel.br, prev.br));
-      uint32_t damageStart = nCols * damage.tl.y + damage.tl.x;
-      uint32_t damageEnd = nCols * damage.br.y + damage.br.x + 1;
-      prev = sel;
-
-      glUseProgram (P_compute);
-      glUniform4i (compU_selectRect, sel.tl.x, sel.tl.y, sel.br.x, sel.br.y);
-      glUniform1i (compU_selectRectMode, static_cast <int> (sel.rectangular));
-      glUniform2i (compU_selectDamage, damageStart, damageEnd);
+      const Rect& prev = prevSelection;
+      CellRange damage [2];
+      selectionChange (prev, sel, nCols, damage [0], damage [1]);
+      if (rowMapChanged && !(sel.empty () && prev.empty ()))
+      {
+         // the previous selection was drawn with the previous row mapping
+         damage [0] = {0, (uint32_t)nRows * nCols};
+         damage [1] = CellRange ();
+      }
+      for (const CellRange& r: damage)
+         if (r.start < r.end)
+            markDirtyRows (r.start / nCols, (r.end - 1) / nCols + 1);
+      prevSelection = sel;
+
+      glUseProgram (shared.P_cells);
+      glUniform4i (shared.cellU_selectRect,
+                   sel.tl.x, sel.tl.y, sel.br.x, sel.br.y);
+      glUniform1i (shared.cellU_selectRectMode,
+                   static_cast <int> (sel.rectangular));
+      if (shared.P_compute)
+         glUniform4i (shared.compU_selectDamage,
+                      damage [0].start, damage [0].end,
+                      damage [1].start, damage [1].end);
    }
 
    void
    CharVdev::setDeltaFrame (bool delta)
    {
-      glUseProgram (P_compute);
-      glUniform1i (compU_deltaFrame, delta ? 1 : 0);
+      deltaFrame = delta;
+      if (shared.P_compute)
+      {
+         glUseProgram (shared.P_compute);
+         glUniform1i (shared.compU_deltaFrame, delta ? 1 : 0);
+      }
+   }
+
+   bool
+   CharVdev::setAttrTable (const AttrTable& table)
+   {
+      const bool compacted = table.getGeneration () != attrGeneration;
+      const uint32_t first = compacted ? 0 : nAttrsUploaded;
+      if (first < table.size ())
+      {
+         Stats::Probe probe (Stats::Upload);
+         glBindBuffer (GL_SHADER_STORAGE_BUFFER, B_attrs);
+         glBufferSubData (GL_SHADER_STORAGE_BUFFER, sizeof (Attrs) * first,
+                          sizeof (Attrs) * (table.size () - first),
+                          table.data () + first);
+         glCheckError ();
+      }
+      attrGeneration = table.getGeneration ();
+      nAttrsUploaded = table.size ();
+      return compacted;
+   }
+
+   void
+   CharVdev::setScrollRegion (uint16_t marginTop_, uint16_t marginBottom_,
+                              uint16_t scrollHead_)
+   {
+      rowMapChanged = marginTop != marginTop_ ||
+                      marginBottom != marginBottom_ ||
+                      scrollHead != scrollHead_;
+      if (!rowMapChanged)
+         return;
+
+      marginTop = marginTop_;
+      marginBottom = marginBottom_;
+      scrollHead = scrollHead_;
+
+      glUseProgram (shared.P_cells);
+      glUniform3i (shared.cellU_scrollRegion,
+                   marginTop, marginBottom, scrollHead);
+      if (shared.P_compute)
+      {
+         const GLint py = shared.fontpk.getPy ();
+         glUseProgram (shared.P_draw);
+         glUniform3i (shared.drawU_scrollPixels, py * marginTop,
+                      py * marginBottom, py * scrollHead);
+      }
    }
 
    void
@@ -456,20 +821,27 @@ namespace zutty {
    {
       assert (cells == nullptr); // no mapping in place
 
-      glUseProgram (P_compute);
-      glActiveTexture (GL_TEXTURE0);
-      glBindTexture (GL_TEXTURE_2D, T_output);
       glActiveTexture (GL_TEXTURE1);
-      glBindTexture (GL_TEXTURE_2D_ARRAY, T_atlas);
+      glBindTexture (GL_TEXTURE_2D_ARRAY, shared.T_atlas);
       glActiveTexture (GL_TEXTURE2);
-      glBindTexture (GL_TEXTURE_2D, T_atlasMap);
+      glBindTexture (GL_TEXTURE_2D, shared.T_atlasMap);
       glCheckError ();
 
-      glDispatchCompute (nCols, nRows, 1);
-      glMemoryBarrier (GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-      glCheckError ();
+      if (hasTimers)
+         collectTimers ();
 
-      glUseProgram (P_draw);
+      if (shared.P_compute)
+      {
+         Stats::Probe probe (Stats::Dispatch);
+         beginTimer (0);
+         dispatchCompute ();
+         endTimer (0);
+      }
+      std::fill (dirtyRows.begin (), dirtyRows.end (), 0);
+
+      Stats::Probe probe (Stats::Draw);
+      beginTimer (1);
+      glUseProgram (shared.P_draw);
       glClearColor (opts.bg.red / 255.0, opts.bg.green / 255.0,
                     opts.bg.blue / 255.0, 1.0);
       glClear (GL_COLOR_BUFFER_BIT);
@@ -477,15 +849,22 @@ namespace zutty {
       glActiveTexture (GL_TEXTURE0);
       glBindTexture (GL_TEXTURE_2D, T_output);
 
-      glEnableVertexAttribArray (A_pos);
-      glEnableVertexAttribArray (A_vertexTexCoord);
+      glEnableVertexAttribArray (shared.A_pos);
+      glEnableVertexAttribArray (shared.A_vertexTexCoord);
       glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+      endTimer (1);
+      timerFrame = (timerFrame + 1) % nTimerFrames;
+      ++timerFrameNo;
    }
 
-   CharVdev::Mapping::Mapping (uint16_t nCols_, uint16_t nRows_, Cell *& cells_)
-      : nCols (nCols_)
+   CharVdev::Mapping::Mapping (CharVdev& owner_,
+                               uint16_t nCols_, uint16_t nRows_,
+                               Cell *& cells_, uint8_t* dirtyRows_)
+      : owner (owner_)
+      , nCols (nCols_)
       , nRows (nRows_)
       , cells (cells_)
+      , dirtyRows (dirtyRows_)
    {
    };
 
@@ -493,7 +872,9 @@ namespace zutty {
    {
       assert (cells != nullptr); // mapping in place
 
-      glUnmapBuffer (GL_SHADER_STORAGE_BUFFER);
+      Stats::Probe probe (Stats::Upload);
+      owner.loadGlyphs ();
+      owner.uploadCells ();
       cells = nullptr;
    };
 
@@ -501,69 +882,624 @@ namespace zutty {
    {
       assert (cells == nullptr); // no mapping in place
 
-      cells = reinterpret_cast <Cell *> (
-                 glMapBufferRange (GL_SHADER_STORAGE_BUFFER,
-                                   0, sizeof (Cell) * nRows * nCols,
-                                   GL_MAP_READ_BIT | GL_MAP_WRITE_BIT));
+      cells = shadowCells.data ();
 
-      return CharVdev::Mapping (nCols, nRows, cells);
+      return CharVdev::Mapping (*this, nCols, nRows, cells, dirtyRows.data ());
    };
 
    // private methods
 
    void
-   CharVdev::createShaders ()
-   {
-      GLuint S_compute, S_fragment, S_vertex;
-
-      S_compute =
-         createShader (GL_COMPUTE_SHADER, computeShaderSource, "compute");
-      S_fragment =
-         createShader (GL_FRAGMENT_SHADER, fragmentShaderSource, "fragment");
-      S_vertex =
-         createShader (GL_VERTEX_SHADER, vertexShaderSource, "vertex");
-
-      P_compute = glCreateProgram ();
-      glAttachShader (P_compute, S_compute);
-      linkProgram (P_compute, "compute");
-      glUseProgram (P_compute);
-
-      compU_glyphPixels = glGetUniformLocation (P_compute, "glyphPixels");
-      compU_sizeChars = glGetUniformLocation (P_compute, "sizeChars");
-      compU_cursorColor = glGetUniformLocation (P_compute, "cursorColor");
-      compU_cursorPos = glGetUniformLocation (P_compute, "cursorPos");
-      compU_cursorStyle = glGetUniformLocation (P_compute, "cursorStyle");
-      compU_selectRect = glGetUniformLocation (P_compute, "selectRect");
-      compU_selectRectMode = glGetUniformLocation (P_compute, "selectRectMode");
-      compU_selectDamage = glGetUniformLocation (P_compute, "selectDamage");
-      compU_deltaFrame = glGetUniformLocation (P_compute, "deltaFrame");
-
-      logT << "compute program:"
-           << " uniform glyphPixels=" << compU_glyphPixels
-           << " sizeChars=" << compU_sizeChars
-           << " cursorColor=" << compU_cursorColor
-           << " cursorPos=" << compU_cursorPos
-           << " cursorStyle=" << compU_cursorStyle
-           << " selectRect=" << compU_selectRect
-           << " selectRectMode=" << compU_selectRectMode
-           << " selectDamage=" << compU_selectDamage
-           << " deltaFrame=" << compU_deltaFrame
+   CharVdev::Shared::setupAtlasGeometry ()
+   {
+      const uint16_t px = fontpk.getPx ();
+      const uint16_t py = fontpk.getPy ();
+      GLint maxTexSize;
+      glGetIntegerv (GL_MAX_TEXTURE_SIZE, &maxTexSize);
+      // atlas positions are stored as bytes in the mapping texture
+      const unsigned maxNx = std::min (255, maxTexSize / px);
+      const unsigned maxNy = std::min (255, maxTexSize / py);
+
+      unsigned n = fontpk.getRegular ().getNumGlyphs () + 1;
+      n = std::max (minAtlasSlots, std::min (maxAtlasSlots, n));
+      n = std::min (n, maxNx * maxNy);
+
+      /* Aim for a roughly square atlas, as that is what GL
+       * implementations handle best.
+       */
+      const double side = sqrt (n * px * py);
+      unsigned nx = std::min <unsigned> (maxNx, std::max (1.0, side / px));
+      unsigned ny = std::min <unsigned> (maxNy, std::max (1.0, side / py));
+      while (nx * ny < n)
+      {
+         if ((px * nx < py * ny && nx < maxNx) || ny == maxNy)
+            ++nx;
+         else
+            ++ny;
+      }
+
+      atlasNx = nx;
+      atlasNy = ny;
+      nSlots = nx * ny;
+      slotGlyph.assign (nSlots, 0);
+      slotLastUse.assign (nSlots, 0);
+      evictable.clear ();
+      evictable.reserve (nSlots);
+      logT << "Atlas: " << nSlots << " slots (" << nx << " x " << ny
+           << " glyphs, " << nx * px << " x " << ny * py << " pixels)"
+           << std::endl;
+   }
+
+   void
+   CharVdev::Shared::uploadGlyph (uint16_t slot, int layer)
+   {
+      const Font::AtlasPos apos = slotPos (slot);
+      glActiveTexture (GL_TEXTURE1);
+      glBindTexture (GL_TEXTURE_2D_ARRAY, T_atlas);
+      glTexSubImage3D (GL_TEXTURE_2D_ARRAY, 0,
+                       apos.x * fontpk.getPx (), apos.y * fontpk.getPy (),
+                       layer, fontpk.getPx (), fontpk.getPy (), 1,
+                       GL_RED, GL_UNSIGNED_BYTE, glyphBuf.data ());
+   }
+
+   void
+   CharVdev::Shared::setAtlasMap (uint16_t id, const Font::AtlasPos& apos)
+   {
+      const uint8_t texel [2] = {apos.x, apos.y};
+      glActiveTexture (GL_TEXTURE2);
+      glBindTexture (GL_TEXTURE_2D, T_atlasMap);
+      glTexSubImage2D (GL_TEXTURE_2D, 0, id & 0xff, id >> 8, 1, 1,
+                       GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, texel);
+   }
+
+   /* Return a slot to rasterize a new glyph into, or 0 if there is none:
+    * all slots are taken by pinned glyphs or glyphs currently in use.
+    */
+   uint16_t
+   CharVdev::Shared::allocSlot ()
+   {
+      if (nSlotsUsed < nSlots)
+         return nSlotsUsed++;
+
+      if (!nPinned) // loading the pinned glyphs
+         return 0;
+
+      if (evictFrameNo != glyphFrameNo)
+         collectEvictable ();
+      if (evictable.empty ())
+         return 0;
+
+      const uint16_t slot = evictable.back ();
+      evictable.pop_back ();
+      const uint16_t id = slotGlyph [slot];
+      if (id != noGlyph)
+      {
+         glyphSlot [id] = 0;
+         setAtlasMap (id, missingGlyphPos);
+      }
+      return slot;
+   }
+
+   /* Collect the slots that may be evicted in the current frame. Any
+    * glyph present in a cell buffer is in use, even if its cells are not
+    * redrawn in this frame, so mark those first. (The cells of a mapped
+    * CharVdev are its shadowCells, the others' are those last uploaded.)
+    */
+   void
+   CharVdev::Shared::collectEvictable ()
+   {
+      evictFrameNo = glyphFrameNo;
+      for (const CharVdev* user: users)
+         for (const Cell& cell: user->shadowCells)
+         {
+            const uint16_t slot = glyphSlot [cell.uc_pt];
+            if (slot != noSlot)
+               slotLastUse [slot] = glyphFrameNo;
+         }
+
+      evictable.clear ();
+      for (uint16_t slot = nPinned; slot < nSlots; ++slot)
+         if (slotLastUse [slot] != glyphFrameNo)
+            evictable.push_back (slot);
+      std::sort (evictable.begin (), evictable.end (),
+                 [this] (uint16_t a, uint16_t b)
+                 {
+                    return slotLastUse [a] > slotLastUse [b];
+                 });
+   }
+
+   /* Make glyph ID id displayable: rasterize its glyph into a slot of
+    * the atlas (in all layers) and point the mapping texture to it.
+    * Return false if the atlas has no room for it; it is then shown as
+    * missing for now, and loading is retried when its cells are redrawn.
+    */
+   bool
+   CharVdev::Shared::loadGlyph (uint16_t id)
+   {
+      if (isAstralGlyph (id)) // before its code point, see internAstralGlyph
+         astralGens [id - Astral_Glyph_Base] = astralGlyphGeneration (id);
+      const uint32_t cp = toCodePoint (id);
+      const Font& reg = * layerFonts [0];
+      if (cp == 0xfffe || cp == 0xffff)
+      {
+         glyphSlot [id] = noSlot;
+         setAtlasMap (id, replacementPos);
+         return true;
+      }
+      if (!reg.hasGlyph (cp))
+      {
+         glyphSlot [id] = noSlot;
+         setAtlasMap (id, missingGlyphPos);
+         return true;
+      }
+
+      const uint16_t slot = allocSlot ();
+      if (!slot)
+      {
+         setAtlasMap (id, missingGlyphPos);
+         return false;
+      }
+
+      const Font* prevFont = nullptr;
+      for (int layer = 0; layer < 4; ++layer)
+      {
+         const Font* font = layerFonts [layer];
+         if (font != &reg && !font->hasGlyph (cp))
+            font = &reg;
+         if (font != prevFont)
+         {
+            std::fill (glyphBuf.begin (), glyphBuf.end (), 0);
+            font->rasterize (cp, glyphBuf.data (), fontpk.getPx ());
+            prevFont = font;
+         }
+         uploadGlyph (slot, layer);
+      }
+
+      glyphSlot [id] = slot;
+      slotGlyph [slot] = id;
+      slotLastUse [slot] = glyphFrameNo;
+      setAtlasMap (id, slotPos (slot));
+      return true;
+   }
+
+   /* Forget the glyph loaded for id (reassigned to another code point),
+    * leaving its slot (if any) to be evicted first.
+    */
+   void
+   CharVdev::Shared::unloadGlyph (uint16_t id)
+   {
+      const uint16_t slot = glyphSlot [id];
+      if (slot && slot != noSlot)
+      {
+         slotGlyph [slot] = noGlyph;
+         slotLastUse [slot] = 0;
+      }
+      glyphSlot [id] = 0;
+   }
+
+   /* Called with the cell buffer mapped, after it has been updated for
+    * the next frame: load any glyphs not yet in the atlas, and note the
+    * use of those already there. In a delta frame only the dirty cells
+    * can hold new glyphs.
+    */
+   void
+   CharVdev::loadGlyphs ()
+   {
+      const uint32_t frameNo = ++shared.glyphFrameNo;
+      for (uint16_t y = 0; y < nRows; ++y)
+      {
+         if (deltaFrame && !dirtyRows [y])
+            continue;
+
+         const Cell* row = cells + y * nCols;
+         for (uint16_t x = 0; x < nCols; ++x)
+         {
+            if (deltaFrame && !row [x].dirty)
+               continue;
+
+            const uint16_t id = row [x].uc_pt;
+            uint16_t slot = shared.glyphSlot [id];
+            if (slot && shared.isReassigned (id))
+            {
+               shared.unloadGlyph (id);
+               slot = 0;
+            }
+            if (slot == Shared::noSlot)
+               continue;
+            else if (slot)
+               shared.slotLastUse [slot] = frameNo;
+            else
+               shared.loadGlyph (id);
+         }
+      }
+      glCheckError ();
+   }
+
+   void
+   CharVdev::setupStagingBuffer ()
+   {
+      for (GLsync& fence: stagingFence)
+         if (fence)
+         {
+            glDeleteSync (fence);
+            fence = nullptr;
+         }
+      stagingRegion = 0;
+      stagingMap = nullptr;
+      if (B_staging)
+         glDeleteBuffers (1, &B_staging);
+
+      glGenBuffers (1, &B_staging);
+      glBindBuffer (GL_COPY_READ_BUFFER, B_staging);
+      glBindBuffer (GL_COPY_WRITE_BUFFER, B_text);
+      const GLsizeiptr size = nStagingRegions * sizeof (Cell) * nRows * nCols;
+
+      static const auto bufferStorage =
+         reinterpret_cast <PFNGLBUFFERSTORAGEEXTPROC> (
+            strstr ((const char*) glGetString (GL_EXTENSIONS),
+                    "GL_EXT_buffer_storage")
+            ? eglGetProcAddress ("glBufferStorageEXT") : nullptr);
+      if (bufferStorage)
+      {
+         const GLbitfield flags = GL_MAP_WRITE_BIT |
+                                  GL_MAP_PERSISTENT_BIT_EXT |
+                                  GL_MAP_COHERENT_BIT_EXT;
+         bufferStorage (GL_COPY_READ_BUFFER, size, nullptr, flags);
+         stagingMap = reinterpret_cast <uint8_t*> (
+            glMapBufferRange (GL_COPY_READ_BUFFER, 0, size, flags));
+      }
+      if (!stagingMap)
+         glBufferData (GL_COPY_READ_BUFFER, size, nullptr, GL_STREAM_DRAW);
+      glCheckError ();
+
+      logT << "Staging buffer: " << nStagingRegions << " x "
+           << size / nStagingRegions << " bytes, "
+           << (stagingMap ? "persistently mapped" : "mapped per frame")
            << std::endl;
+   }
 
-      P_draw = glCreateProgram ();
-      glAttachShader (P_draw, S_fragment);
-      glAttachShader (P_draw, S_vertex);
-      linkProgram (P_draw, "draw");
+   /* Upload the cells changed in this frame (all of them, if not a delta
+    * frame) from shadowCells into B_text, by way of a staging region.
+    */
+   void
+   CharVdev::uploadCells ()
+   {
+      const uint32_t nCells = nRows * nCols;
+      uploadSpans.clear ();
+      uint32_t nUpload = 0;
+      if (deltaFrame)
+      {
+         for (uint16_t y = 0; y < nRows; ++y)
+         {
+            if (!dirtyRows [y])
+               continue;
+
+            const uint32_t rowStart = y * nCols;
+            uint32_t k = rowStart;
+            while (k < rowStart + nCols)
+            {
+               if (!shadowCells [k].dirty)
+               {
+                  ++k;
+                  continue;
+               }
+               const uint32_t start = k;
+               while (k < rowStart + nCols && shadowCells [k].dirty)
+                  shadowCells [k++].dirty = 0;
+               if (!uploadSpans.empty () &&
+                   uploadSpans.back ().start + uploadSpans.back ().count
+                   == start)
+                  uploadSpans.back ().count += k - start;
+               else
+                  uploadSpans.push_back ({start, k - start});
+               nUpload += k - start;
+            }
+         }
+      }
+      else
+      {
+         uploadSpans.push_back ({0, nCells});
+         nUpload = nCells;
+      }
+      if (!nUpload)
+         return;
+
+      GLsync& fence = stagingFence [stagingRegion];
+      if (fence)
+      {
+         // only blocks if the GPU is more than nStagingRegions frames behind
+         glClientWaitSync (fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                           GL_TIMEOUT_IGNORED);
+         glDeleteSync (fence);
+         fence = nullptr;
+      }
+
+      const size_t regionOffset = stagingRegion * sizeof (Cell) * nCells;
+      const size_t uploadSize = sizeof (Cell) * nUpload;
+      Cell* staging = reinterpret_cast <Cell*> (
+         stagingMap
+         ? stagingMap + regionOffset
+         : glMapBufferRange (GL_COPY_READ_BUFFER, regionOffset, uploadSize,
+                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                             GL_MAP_UNSYNCHRONIZED_BIT));
+      Cell* dst = staging;
+      for (const CellSpan& span: uploadSpans)
+      {
+         memcpy (dst, &shadowCells [span.start], sizeof (Cell) * span.count);
+         if (deltaFrame) // the copy in B_text is flagged for redraw
+            for (uint32_t k = 0; k < span.count; ++k)
+               dst [k].dirty = 1;
+         dst += span.count;
+      }
+      if (!stagingMap)
+         glUnmapBuffer (GL_COPY_READ_BUFFER);
+
+      size_t srcOffset = regionOffset;
+      for (const CellSpan& span: uploadSpans)
+      {
+         glCopyBufferSubData (GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                              srcOffset, sizeof (Cell) * span.start,
+                              sizeof (Cell) * span.count);
+         srcOffset += sizeof (Cell) * span.count;
+      }
+      fence = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      stagingRegion = (stagingRegion + 1) % nStagingRegions;
+      glCheckError ();
+   }
+
+   void
+   CharVdev::setupTimers ()
+   {
+      if (!strstr ((const char*) glGetString (GL_EXTENSIONS),
+                   "GL_EXT_disjoint_timer_query"))
+      {
+         logI << "GL_EXT_disjoint_timer_query not supported, "
+              << "no GPU timing in stats" << std::endl;
+         return;
+      }
+
+      timerExt.genQueries = reinterpret_cast <PFNGLGENQUERIESEXTPROC> (
+         eglGetProcAddress ("glGenQueriesEXT"));
+      timerExt.deleteQueries = reinterpret_cast <PFNGLDELETEQUERIESEXTPROC> (
+         eglGetProcAddress ("glDeleteQueriesEXT"));
+      timerExt.beginQuery = reinterpret_cast <PFNGLBEGINQUERYEXTPROC> (
+         eglGetProcAddress ("glBeginQueryEXT"));
+      timerExt.endQuery = reinterpret_cast <PFNGLENDQUERYEXTPROC> (
+         eglGetProcAddress ("glEndQueryEXT"));
+      timerExt.getQueryObjectuiv =
+         reinterpret_cast <PFNGLGETQUERYOBJECTUIVEXTPROC> (
+            eglGetProcAddress ("glGetQueryObjectuivEXT"));
+      timerExt.getQueryObjectui64v =
+         reinterpret_cast <PFNGLGETQUERYOBJECTUI64VEXTPROC> (
+            eglGetProcAddress ("glGetQueryObjectui64vEXT"));
+      if (!timerExt.genQueries || !timerExt.deleteQueries ||
+          !timerExt.beginQuery || !timerExt.endQuery ||
+          !timerExt.getQueryObjectuiv || !timerExt.getQueryObjectui64v)
+         return;
+
+      timerExt.genQueries (2 * nTimerFrames, &timerQueries [0][0]);
+      // reading the flag clears it, so start with a clean slate
+      GLint disjoint;
+      glGetIntegerv (GL_GPU_DISJOINT_EXT, &disjoint);
+      glCheckError ();
+      hasTimers = true;
+   }
+
+   void
+   CharVdev::beginTimer (int pass)
+   {
+      if (hasTimers)
+         timerExt.beginQuery (GL_TIME_ELAPSED_EXT,
+                              timerQueries [timerFrame][pass]);
+   }
+
+   void
+   CharVdev::endTimer (int pass)
+   {
+      if (hasTimers)
+      {
+         timerExt.endQuery (GL_TIME_ELAPSED_EXT);
+         // Some drivers (e.g. llvmpipe) return garbage for the timers of
+         // the first frame of a context, so those are never read.
+         timerPending [timerFrame][pass] = timerFrameNo > 0;
+      }
+   }
+
+   void
+   CharVdev::collectTimers ()
+   {
+      // Results of a period the GPU was disjoint in (e.g. changed its
+      // clock) are meaningless; drop all of them, not just this frame.
+      GLint disjoint = 0;
+      glGetIntegerv (GL_GPU_DISJOINT_EXT, &disjoint);
+      for (int frame = 0; frame < nTimerFrames; ++frame)
+         for (int pass = 0; pass < 2; ++pass)
+         {
+            if (!timerPending [frame][pass])
+               continue;
+
+            // Never wait for a result: if that of the pair about to be
+            // reused is still not available, it is dropped.
+            const GLuint query = timerQueries [frame][pass];
+            GLuint available = 0;
+            timerExt.getQueryObjectuiv (query, GL_QUERY_RESULT_AVAILABLE_EXT,
+                                        &available);
+            if (!available && frame != timerFrame)
+               continue;
+            timerPending [frame][pass] = false;
+            if (!available || disjoint)
+               continue;
+
+            GLuint64 ns = 0;
+            timerExt.getQueryObjectui64v (query, GL_QUERY_RESULT_EXT, &ns);
+            stats.add (pass ? Stats::GpuDraw : Stats::GpuCompute, ns);
+         }
+      glCheckError ();
+   }
+
+   void
+   CharVdev::dispatchCompute ()
+   {
+      glUseProgram (shared.P_compute);
+      glActiveTexture (GL_TEXTURE0);
+      glBindTexture (GL_TEXTURE_2D, T_output);
+
+      const uint16_t nTileCols = (nCols + tileCols - 1) / tileCols;
+      const uint16_t nTileRows = (nRows + tileRows - 1) / tileRows;
+      auto tileRowDirty =
+         [this] (uint16_t ty)
+         {
+            const uint16_t top = ty * tileRows;
+            const uint16_t bottom = std::min <uint16_t> (top + tileRows, nRows);
+            return std::any_of (&dirtyRows [top], &dirtyRows [bottom],
+                                [] (uint8_t dirty) { return dirty != 0; });
+         };
+
+      if (deltaFrame)
+      {
+         // dispatch each run of consecutive tile rows with dirty rows
+         uint16_t ty = 0;
+         while (ty < nTileRows)
+         {
+            if (!tileRowDirty (ty))
+            {
+               ++ty;
+               continue;
+            }
+            const uint16_t top = ty;
+            while (ty < nTileRows && tileRowDirty (ty))
+               ++ty;
+            glUniform1i (shared.compU_rowOffset, top * tileRows);
+            glDispatchCompute (nTileCols, ty - top, 1);
+         }
+      }
+      else
+      {
+         glUniform1i (shared.compU_rowOffset, 0);
+         glDispatchCompute (nTileCols, nTileRows, 1);
+      }
+      // the shader clears dirty bits in B_text, ahead of the next upload
+      glMemoryBarrier (GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                       GL_BUFFER_UPDATE_BARRIER_BIT);
+      glCheckError ();
+   }
+
+   void
+   CharVdev::markDirtyRows (uint16_t top, uint16_t bottom)
+   {
+      bottom = std::min (bottom, nRows);
+      for (uint16_t y = top; y < bottom; ++y)
+         dirtyRows [storageRow (y)] = 1;
+   }
+
+   void
+   CharVdev::Shared::createShaders ()
+   {
+      /* The fragment backend reads the cells and attributes from SSBOs
+       * in the fragment shader, which GLES 3.1 does not require to be
+       * supported.
+       */
+      GLint maxFragmentBlocks = 0;
+      glGetIntegerv (GL_MAX_FRAGMENT_SHADER_STORAGE_BLOCKS, &maxFragmentBlocks);
+      bool fragmentBackend = opts.backend == Backend::fragment;
+      if (fragmentBackend && maxFragmentBlocks < 2)
+      {
+         logW << "No storage blocks in fragment shaders, "
+              << "falling back to the compute backend" << std::endl;
+         fragmentBackend = false;
+      }
+      logI << "Rendering with the "
+           << (fragmentBackend ? "fragment" : "compute") << " backend"
+           << std::endl;
+
+      const ProgramCache cache;
+      const ShaderSource vertex = {GL_VERTEX_SHADER, "vertex",
+                                   vertexShaderSource};
+      ShaderSource fragment = {GL_FRAGMENT_SHADER, "fragment",
+                               fragmentShaderSource};
+
+      if (fragmentBackend)
+      {
+         fragment.source =
+            std::string ("#version 310 es\n"
+                         "precision highp float;\n"
+                         "precision highp int;\n")
+            + cellShaderSource + cellFragmentShaderSource;
+         P_compute = 0;
+      }
+      else
+      {
+         /* Aim for workgroups of 16 x 4 invocations, well within the
+          * limits guaranteed by GLES 3.1, but go by the actual limits
+          * anyway.
+          */
+         GLint maxSizeX, maxSizeY, maxInvocations;
+         glGetIntegeri_v (GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxSizeX);
+         glGetIntegeri_v (GL_MAX_COMPUTE_WORK_GROUP_SIZE, 1, &maxSizeY);
+         glGetIntegerv (GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS,
+                        &maxInvocations);
+         localSizeX = std::max (1, std::min (16, std::min (maxSizeX,
+                                                            maxInvocations)));
+         localSizeY = std::max (1, std::min (4, std::min (maxSizeY,
+                                             maxInvocations / localSizeX)));
+         logT << "compute workgroup: " << localSizeX << " x " << localSizeY
+              << " invocations for " << tileCols << " x " << tileRows
+              << " cells" << std::endl;
+
+         std::ostringstream oss;
+         oss << "#version 310 es\n"
+             << "#define LOCAL_SIZE_X " << localSizeX << "\n"
+             << "#define LOCAL_SIZE_Y " << localSizeY << "\n"
+             << "#define TILE_COLS " << tileCols << "\n"
+             << "#define TILE_ROWS " << tileRows << "\n"
+             << cellShaderSource << computeShaderSource;
+
+         P_compute = makeProgram (cache, "compute",
+                                  {{GL_COMPUTE_SHADER, "compute", oss.str ()}});
+      }
+
+      P_draw = makeProgram (cache, "draw", {fragment, vertex});
       glUseProgram (P_draw);
 
       A_pos = glGetAttribLocation (P_draw, "pos");
       A_vertexTexCoord = glGetAttribLocation (P_draw, "vertexTexCoord");
       drawU_viewPixels = glGetUniformLocation (P_draw, "viewPixels");
+      drawU_scrollPixels = glGetUniformLocation (P_draw, "scrollPixels");
 
       logT << "draw program:"
            << " attrib pos=" << A_pos
            << " vertexTexCoord=" << A_vertexTexCoord
            << " uniform viewPixels=" << drawU_viewPixels
+           << " scrollPixels=" << drawU_scrollPixels
+           << std::endl;
+
+      P_cells = P_compute ? P_compute : P_draw;
+      glUseProgram (P_cells);
+
+      cellU_glyphPixels = glGetUniformLocation (P_cells, "glyphPixels");
+      cellU_sizeChars = glGetUniformLocation (P_cells, "sizeChars");
+      cellU_cursorColor = glGetUniformLocation (P_cells, "cursorColor");
+      cellU_cursorPos = glGetUniformLocation (P_cells, "cursorPos");
+      cellU_cursorStyle = glGetUniformLocation (P_cells, "cursorStyle");
+      cellU_selectRect = glGetUniformLocation (P_cells, "selectRect");
+      cellU_selectRectMode = glGetUniformLocation (P_cells, "selectRectMode");
+      cellU_scrollRegion = glGetUniformLocation (P_cells, "scrollRegion");
+      compU_selectDamage = glGetUniformLocation (P_cells, "selectDamage");
+      compU_deltaFrame = glGetUniformLocation (P_cells, "deltaFrame");
+      compU_rowOffset = glGetUniformLocation (P_cells, "rowOffset");
+
+      logT << "cell program:"
+           << " uniform glyphPixels=" << cellU_glyphPixels
+           << " sizeChars=" << cellU_sizeChars
+           << " cursorColor=" << cellU_cursorColor
+           << " cursorPos=" << cellU_cursorPos
+           << " cursorStyle=" << cellU_cursorStyle
+           << " selectRect=" << cellU_selectRect
+           << " selectRectMode=" << cellU_selectRectMode
+           << " scrollRegion=" << cellU_scrollRegion
+           << " selectDamage=" << compU_selectDamage
+           << " deltaFrame=" << compU_deltaFrame
+           << " rowOffset=" << compU_rowOffset
            << std::endl;
    }
 
@@ -11,7 +11,9 @@
 
 #pragma once
 
+#include "attrtable.h"
 #include "base.h"
+#include "cell.h"
 #include "fontpack.h"
 #include "gl.h"
 #include "options.h"
@@ -20,114 +22,249 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace zutty {
 
    class CharVdev
    {
    public:
-      explicit CharVdev (const Fontpack* fontpk);
+      /* The GL objects that do not depend on the window drawn into: the
+       * shader programs and the glyph atlas. All CharVdevs of a GL
+       * context share these (e.g., those of the windows of a server), so
+       * the shaders are compiled and each glyph is rasterized and stored
+       * only once. Create it, and the CharVdevs using it, with the
+       * context current, and only use them on the thread it is current
+       * on.
+       */
+      class Shared
+      {
+      public:
+         explicit Shared (const Fontpack* fontpk);
 
-      ~CharVdev ();
+         ~Shared ();
 
-      bool resize (uint16_t pxWidth_, uint16_t pxHeight_);
-      void draw ();
+      private:
+         friend class CharVdev;
 
-      struct Cell
-      {
-         uint16_t uc_pt = ' ';
-         uint8_t bold: 1;
-         uint8_t italic: 1;
-         uint8_t underline: 1;
-         uint8_t inverse: 1;
-         uint8_t wrap: 1;
-         uint8_t dirty: 1;
-         uint16_t _fill0: 10;
-         Color fg;
-         uint8_t _fill1;
-         Color bg;
-         uint8_t _fill2;
-
-         Cell ():
-            bold (0), italic (0), underline (0), inverse (0), wrap (0),
-            dirty (0), fg (opts.fg), bg (opts.bg)
-         {}
-
-         using Ptr = std::shared_ptr <Cell>;
-
-         bool operator == (const Cell& rhs) const
+         const Fontpack& fontpk;
+
+         // GL ids of programs, attributes and uniforms: P_compute is 0
+         // with the fragment backend, which renders the cells in P_draw;
+         // P_cells is the one of the two rendering the cells.
+         GLuint P_compute, P_draw, P_cells;
+         GLint A_pos, A_vertexTexCoord;
+         GLint cellU_glyphPixels, cellU_sizeChars, cellU_cursorColor;
+         GLint cellU_cursorPos, cellU_cursorStyle;
+         GLint cellU_selectRect, cellU_selectRectMode, cellU_scrollRegion;
+         GLint compU_selectDamage, compU_deltaFrame, compU_rowOffset;
+         GLint drawU_viewPixels, drawU_scrollPixels;
+
+         GLint localSizeX = 1; // compute workgroup size
+         GLint localSizeY = 1;
+
+         // The CharVdevs using this, and the one the GL state (buffer
+         // bindings, uniforms, viewport) is currently set up for
+         std::vector <const CharVdev*> users;
+         const CharVdev* active = nullptr;
+
+         /* Glyphs are rasterized into the atlas on demand, as they first
+          * appear in a cell buffer. The atlas has a fixed number of slots
+          * of one glyph each (in all four layers); slot 0 is blank. Slots
+          * below nPinned (printable ASCII and the fallback glyphs) are
+          * loaded up front and never evicted; once all slots are in use,
+          * the least recently used glyph that is not present in the cell
+          * buffer of any user gives up its slot. Astral glyph IDs may be
+          * reassigned to other code points, so their glyphs are loaded
+          * anew once the generation of the ID changed.
+          */
+         constexpr const static uint16_t noSlot = 0xffff;
+         constexpr const static uint16_t noGlyph = 0xffff; // never loaded
+         constexpr const static unsigned minAtlasSlots = 256;
+         constexpr const static unsigned maxAtlasSlots = 4096;
+         GLuint T_atlas = 0;
+         GLuint T_atlasMap = 0;
+         const Font* layerFonts [4]; // regular, bold, italic, bold-italic
+         uint16_t atlasNx = 0; // atlas size in glyphs
+         uint16_t atlasNy = 0;
+         uint16_t nSlots = 0;
+         uint16_t nSlotsUsed = 0;
+         uint16_t nPinned = 0;
+         // glyph ID -> slot; 0 if not yet loaded, noSlot if displayed
+         // with one of the fallback glyphs
+         std::vector <uint16_t> glyphSlot;
+         std::vector <uint16_t> slotGlyph; // slot -> glyph ID
+         std::vector <uint32_t> astralGens; // astral ID -> generation loaded
+         std::vector <uint32_t> slotLastUse; // slot -> glyphFrameNo last seen
+         std::vector <uint16_t> evictable; // least recently used last
+         uint32_t glyphFrameNo = 0;
+         uint32_t evictFrameNo = 0;
+         std::vector <uint8_t> glyphBuf; // staging area for rasterization
+         Font::AtlasPos missingGlyphPos = {0, 0};
+         Font::AtlasPos replacementPos = {0, 0};
+
+         void setupAtlasGeometry ();
+         Font::AtlasPos slotPos (uint16_t slot) const
          {
-            return memcmp (this, &rhs, sizeof (Cell)) == 0;
+            return {(uint8_t)(slot % atlasNx), (uint8_t)(slot / atlasNx)};
          }
-
-         bool operator != (const Cell& rhs) const
+         void uploadGlyph (uint16_t slot, int layer);
+         void setAtlasMap (uint16_t id, const Font::AtlasPos& apos);
+         uint16_t allocSlot ();
+         void collectEvictable ();
+         bool loadGlyph (uint16_t id);
+         bool isReassigned (uint16_t id) const
          {
-            return ! operator == (rhs);
+            return isAstralGlyph (id) &&
+                   astralGens [id - Astral_Glyph_Base] !=
+                      astralGlyphGeneration (id);
          }
+         void unloadGlyph (uint16_t id);
+         void createShaders ();
       };
-      static_assert (sizeof (Cell) == 12, "Cell size mismatch");
 
-      static Cell::Ptr make_cells (uint16_t nCols, uint16_t nRows)
-      {
-         return std::shared_ptr <Cell> (new Cell [nRows * nCols],
-                                        std::default_delete <Cell []> ());
-      }
+      explicit CharVdev (Shared& shared);
+
+      ~CharVdev ();
+
+      /* Set up the GL state for drawing with this CharVdev, unless it is
+       * already: as the programs are shared, their uniforms are too, and
+       * those not set on each frame are restored here. Call this first
+       * on each frame.
+       */
+      void activate ();
+
+      bool resize (uint16_t pxWidth_, uint16_t pxHeight_);
+      void draw ();
+
+      using Cell = zutty::Cell;
 
       struct Mapping
       {
-         explicit Mapping (uint16_t nCols_, uint16_t nRows_, Cell *& cells_);
+         explicit Mapping (CharVdev& owner_, uint16_t nCols_, uint16_t nRows_,
+                           Cell *& cells_, uint8_t* dirtyRows_);
          ~Mapping ();
 
+         CharVdev& owner;
          uint16_t nCols;
          uint16_t nRows;
          Cell *& cells;
+         uint8_t* dirtyRows; // set dirtyRows [y] if row y has dirty cells
       };
 
       Mapping getMapping ();
 
-      struct Cursor
-      {
-         Color color = {255, 255, 255};
-         uint16_t posX = 0;
-         uint16_t posY = 0;
-
-         enum class Style: uint8_t
-         {
-            hidden = 0,
-            filled_block = 1,
-            hollow_block = 2
-         };
-         Style style = Style::hidden;
-      };
+      using Cursor = zutty::Cursor;
 
       void setCursor (const Cursor& cursor);
       void setSelection (const Rect& selection);
       void setDeltaFrame (bool delta);
 
+      /* Upload the entries of the table that the cells refer to, as far
+       * as they are new. Return true if the table was compacted since
+       * the last call: cells may then look different with the same
+       * attribute ID, so the frame must not be a delta frame.
+       */
+      bool setAttrTable (const AttrTable& table);
+
+      /* The cells (and dirtyRows) of the Mapping are laid out like the
+       * cell storage of the Frame, with the rows of the scrolling region
+       * [marginTop, marginBottom) forming a ring that starts at
+       * scrollHead. The cursor and selection are in display positions,
+       * so set this before them.
+       */
+      void setScrollRegion (uint16_t marginTop, uint16_t marginBottom,
+                            uint16_t scrollHead);
+
    private:
-      uint16_t nCols;
-      uint16_t nRows;
-      uint16_t pxWidth;
-      uint16_t pxHeight;
+      Shared& shared;
 
-      // GL ids of programs, buffers, textures, attributes and uniforms:
-      GLuint P_compute, P_draw;
+      uint16_t nCols = 0;
+      uint16_t nRows = 0;
+      uint16_t pxWidth = 0;
+      uint16_t pxHeight = 0;
+
+      // GL ids of buffers and textures
       GLuint B_text = 0;
-      GLuint T_atlas = 0;
-      GLuint T_atlasMap = 0;
+      GLuint B_attrs = 0;
       GLuint T_output = 0;
-      GLint A_pos, A_vertexTexCoord;
-      GLint compU_glyphPixels, compU_sizeChars, compU_cursorColor;
-      GLint compU_cursorPos, compU_cursorStyle;
-      GLint compU_selectRect, compU_selectRectMode, compU_selectDamage;
-      GLint compU_deltaFrame;
-      GLint drawU_viewPixels;
 
-      const Fontpack& fontpk;
+      // Each compute workgroup renders a tile of cells
+      constexpr const static uint16_t tileCols = 8;
+      constexpr const static uint16_t tileRows = 2;
 
       Cell * cells = nullptr; // valid pointer if mapped, else nullptr
 
-      void createShaders ();
+      /* The Mapping hands out a CPU side copy of the cells last uploaded
+       * to B_text, so comparing against them never reads GPU memory.
+       * On unmapping, the cells changed in the frame are packed into the
+       * next region of a ring in B_staging, and copied from there into
+       * B_text by the GPU. Each region is guarded by a fence, so it is
+       * only rewritten once the GPU is done copying from it. B_staging
+       * stays mapped if the implementation supports persistent mapping.
+       */
+      std::vector <Cell> shadowCells;
+      GLuint B_staging = 0;
+      constexpr const static int nStagingRegions = 3;
+      GLsync stagingFence [nStagingRegions] = {};
+      int stagingRegion = 0;
+      uint8_t* stagingMap = nullptr; // persistent mapping of B_staging
+      struct CellSpan
+      {
+         uint32_t start; // index of first cell
+         uint32_t count;
+      };
+      std::vector <CellSpan> uploadSpans;
+
+      // The AttrTable, as far as uploaded to B_attrs
+      uint32_t attrGeneration = 0;
+      uint32_t nAttrsUploaded = 0;
+
+      // In a delta frame, only the rows flagged here are dispatched to
+      // the compute shader (rows with dirty cells, plus those touched by
+      // a change of the cursor or the selection).
+      std::vector <uint8_t> dirtyRows;
+      bool deltaFrame = false;
+
+      uint16_t marginTop = 0;
+      uint16_t marginBottom = 0;
+      uint16_t scrollHead = 0;
+      bool rowMapChanged = false; // by the last setScrollRegion ()
+
+      // Where the previous cursor and selection were drawn
+      uint16_t prevCursorX = 0;
+      uint16_t prevCursorRow = 0; // in storage
+      Rect prevSelection;
+
+      /* GPU timer queries (with -stats, if GL_EXT_disjoint_timer_query is
+       * supported) around the compute pass and drawing the window. Each
+       * frame uses its own pair of a small ring, and the results of a
+       * pair are read back just before it is reused, by which time they
+       * are normally available without waiting for the GPU.
+       */
+      constexpr const static int nTimerFrames = 4;
+      GLuint timerQueries [nTimerFrames][2] = {};
+      bool timerPending [nTimerFrames][2] = {};
+      int timerFrame = 0;
+      uint32_t timerFrameNo = 0;
+      bool hasTimers = false;
+
+      uint16_t storageRow (uint16_t y) const
+      {
+         if (y < marginTop || y >= marginBottom)
+            return y;
+         y += scrollHead - marginTop;
+         return y < marginBottom ? y : y - (marginBottom - marginTop);
+      }
+      void markDirtyRows (uint16_t top, uint16_t bottom); // display rows
+      void loadGlyphs ();
+      void dispatchCompute ();
+      void setupTimers ();
+      void beginTimer (int pass);
+      void endTimer (int pass);
+      void collectTimers ();
+      void setupStagingBuffer ();
+      void uploadCells ();
    };
 
 } // namespace zutty
@@ -0,0 +1,71 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "cmdqueue.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace zutty {
+
+   CommandQueue::CommandQueue ()
+   {
+      if (pipe (pipeFd) < 0)
+         SYS_ERROR ("can't create command queue: pipe()");
+      for (int fd: pipeFd)
+      {
+         fcntl (fd, F_SETFD, FD_CLOEXEC);
+         fcntl (fd, F_SETFL, O_NONBLOCK);
+      }
+   }
+
+   CommandQueue::~CommandQueue ()
+   {
+      close (pipeFd [0]);
+      close (pipeFd [1]);
+   }
+
+   void
+   CommandQueue::post (Command&& cmd)
+   {
+      queue.push (std::move (cmd));
+      // only the first command since the last run () needs a wakeup
+      if (!signalled.exchange (true))
+      {
+         const char ch = 0;
+         if (write (pipeFd [1], &ch, 1) < 0 && errno != EAGAIN)
+         {
+            logE << "Command queue: write: " << strerror (errno)
+                 << std::endl;
+         }
+      }
+   }
+
+   void
+   CommandQueue::run ()
+   {
+      // Clear the wakeup first, so a command posted from here on gets a
+      // new one, even if it is also picked up below.
+      signalled.exchange (false);
+      char buf [64];
+      while (read (pipeFd [0], buf, sizeof (buf)) > 0)
+         ;
+
+      Command cmd;
+      while (queue.pop (cmd))
+         cmd ();
+   }
+
+} // namespace zutty
@@ -0,0 +1,103 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <utility>
+
+namespace zutty {
+
+   /* Unbounded lock-free queue between a single producer and a single
+    * consumer thread: a linked list of nodes, with the consumer holding
+    * a dummy node in front of the first item. Pushing never fails (in
+    * particular, it never waits for the consumer), so two threads may
+    * post to each other without the risk of a deadlock.
+    */
+   template <typename T>
+   class SpscQueue
+   {
+   public:
+      explicit SpscQueue (): head (new Node), tail (head) {}
+
+      SpscQueue (const SpscQueue&) = delete;
+      SpscQueue& operator = (const SpscQueue&) = delete;
+
+      ~SpscQueue ()
+      {
+         while (head)
+         {
+            Node* next = head->next.load (std::memory_order_relaxed);
+            delete head;
+            head = next;
+         }
+      }
+
+      // Called by the producer only
+      void push (T&& item)
+      {
+         Node* node = new Node;
+         node->item = std::move (item);
+         tail->next.store (node, std::memory_order_release);
+         tail = node;
+      }
+
+      // Called by the consumer only; return false if empty
+      bool pop (T& item)
+      {
+         Node* next = head->next.load (std::memory_order_acquire);
+         if (!next)
+            return false;
+
+         item = std::move (next->item);
+         delete head;
+         head = next;
+         return true;
+      }
+
+   private:
+      struct Node
+      {
+         T item;
+         std::atomic <Node*> next {nullptr};
+      };
+      Node* head; // owned by the consumer
+      Node* tail; // owned by the producer
+   };
+
+   /* Commands to be run by the thread owning the queue, posted by one
+    * other thread. The owner polls fd () for input, and calls run ()
+    * once it is readable.
+    */
+   class CommandQueue
+   {
+   public:
+      using Command = std::function <void ()>;
+
+      explicit CommandQueue ();
+
+      CommandQueue (const CommandQueue&) = delete;
+      CommandQueue& operator = (const CommandQueue&) = delete;
+
+      ~CommandQueue ();
+
+      void post (Command&& cmd);
+      int fd () const { return pipeFd [0]; }
+      void run ();
+
+   private:
+      SpscQueue <Command> queue;
+      int pipeFd [2];
+      std::atomic <bool> signalled {false}; // a wakeup is pending
+   };
+
+} // namespace zutty
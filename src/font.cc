@@ -15,6 +15,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -34,28 +35,115 @@ namespace zutty {
       , px (priFont.getPx ())
       , py (priFont.getPy ())
       , baseline (priFont.getBaseline ())
-      , nx (priFont.getNx ())
-      , ny (priFont.getNy ())
-      , atlasBuf (priFont.getAtlas ())
-      , atlasMap (priFont.getAtlasMap ())
    {
       load ();
    }
 
+   Font::~Font ()
+   {
+      FT_Done_Face (face);
+      FT_Done_FreeType (ft);
+   }
+
+   bool
+   Font::rasterize (uint32_t c, uint8_t* dst, int pitch) const
+   {
+      if (cache->get (c, dst, pitch))
+         return true;
+
+      if (!render (c, dst, pitch))
+         return false;
+
+      cache->put (c, dst, pitch);
+      return true;
+   }
+
    // private methods
 
-   void Font::load ()
+   bool
+   Font::render (uint32_t c, uint8_t* dst, int pitch) const
    {
-      FT_Library ft;
-      FT_Face face;
+      if (FT_Load_Char (face, c, FT_LOAD_RENDER))
+      {
+         logW << "FreeType: Failed to load glyph for char " << c << std::endl;
+         return false;
+      }
+
+      if (FT_Render_Glyph (face->glyph, FT_RENDER_MODE_NORMAL))
+      {
+         logW << "FreeType: Failed to render glyph for char " << c
+              << std::endl;
+         return false;
+      }
+
+      // destination pixel offset
+      const unsigned int dx = face->glyph->bitmap_left > 0
+                            ? face->glyph->bitmap_left : 0;
+      const unsigned int dy = baseline && baseline > face->glyph->bitmap_top
+                            ? baseline - face->glyph->bitmap_top : 0;
+
+      // raw/rasterized bitmap dimensions
+      const unsigned int bh = std::min (face->glyph->bitmap.rows, py - dy);
+      const unsigned int bw = std::min (face->glyph->bitmap.width, px - dx);
+
+      uint8_t* const dst_origin = dst + pitch * dy + dx;
+
+      /* Load bitmap into the destination area. Each row in the bitmap
+       * occupies bitmap.pitch bytes (with padding); this is the
+       * increment in the input bitmap array per row.
+       *
+       * Interpretation of bytes within the bitmap rows is subject to
+       * bitmap.pixel_mode, essentially either 8 bits (256-scale gray)
+       * per pixel, or 1 bit (mono) per pixel. Leftmost pixel is MSB.
+       *
+       */
+      const auto& bmp = face->glyph->bitmap;
+      const uint8_t* bmp_src_row;
+      uint8_t* dst_row;
+      switch (bmp.pixel_mode)
+      {
+      case FT_PIXEL_MODE_MONO:
+         for (unsigned int j = 0; j < bh; ++j) {
+            bmp_src_row = bmp.buffer + j * bmp.pitch;
+            dst_row = dst_origin + j * pitch;
+            uint8_t byte = 0;
+            for (unsigned int k = 0; k < bw; ++k) {
+               if (k % 8 == 0) {
+                  byte = *bmp_src_row++;
+               }
+               *dst_row++ = (byte & 0x80) ? 0xFF : 0;
+               byte <<= 1;
+            }
+         }
+         break;
+      case FT_PIXEL_MODE_GRAY:
+         for (unsigned int j = 0; j < bh; ++j) {
+            bmp_src_row = bmp.buffer + j * bmp.pitch;
+            dst_row = dst_origin + j * pitch;
+            for (unsigned int k = 0; k < bw; ++k) {
+               *dst_row++ = *bmp_src_row++;
+            }
+         }
+         break;
+      default:
+         logW << "Unhandled pixel_type=" << bmp.pixel_mode << std::endl;
+         return false;
+      }
+      return true;
+   }
 
+   void Font::load ()
+   {
       if (FT_Init_FreeType (&ft))
          throw std::runtime_error ("Could not initialize FreeType library");
       logI << "Loading " << filename << " as "
            << (overlay ? "overlay" : "primary") << std::endl;
       if (FT_New_Face (ft, filename.c_str (), 0, &face))
+      {
+         FT_Done_FreeType (ft);
          throw std::runtime_error (std::string ("Failed to load font ") +
                                    filename);
+      }
 
       logT << "Family: " << face->family_name
            << "; Style: " << face->style_name
@@ -63,84 +151,24 @@ namespace zutty {
            << "; Glyphs: " << face->num_glyphs
            << std::endl;
 
-      if (face->num_fixed_sizes > 0)
-         loadFixed (face);
-      else
-         loadScaled (face);
-
-      /* Given that we have face->num_glyphs glyphs to load, with each
-       * individual glyph having a size of px * py, compute nx and ny so
-       * that the resulting atlas texture geometry is closest to a square.
-       * We use one extra glyph space to guarantee a blank glyph at (0,0).
-       */
-      /* TODO we must guarantee that the atlas will be addressable by
-       * one byte in each dimension, i.e., 256x256 max, even if this
-       * means that its pixel size won't be as close to a square as
-       * otherwise possible.
-       */
-      if (!overlay)
+      try
       {
-         unsigned n_glyphs = face->num_glyphs + 1;
-         unsigned long total_pixels = n_glyphs * px * py;
-         double side = sqrt (total_pixels);
-         nx = side / px;
-         ny = side / py;
-         while ((unsigned) nx * ny < n_glyphs)
-         {
-            if (px * nx < py * ny)
-               ++nx;
-            else
-               ++ny;
-         }
-         logT << "Atlas texture geometry: " << nx << "x" << ny
-              << " glyphs of " << px << "x" << py << " each, "
-              << "yielding pixel size " << nx*px << "x" << ny*py << "."
-              << std::endl;
-         logT << "Atlas holds space for " << nx*ny << " glyphs, "
-              << n_glyphs << " will be used, empty: "
-              << nx*ny - n_glyphs << " ("
-              << 100.0 * (nx*ny - n_glyphs) / (nx*ny)
-              << "%)" << std::endl;
-
-         size_t atlas_bytes = nx * px * ny * py;
-         logT << "Allocating " << atlas_bytes << " bytes for atlas buffer"
-              << std::endl;
-         atlasBuf.resize (atlas_bytes, 0);
-      }
-
-      FT_UInt gindex;
-      FT_ULong charcode = FT_Get_First_Char (face, &gindex);
-      while (gindex != 0)
-      {
-         if (overlay)
-         {
-            const auto& it = atlasMap.find (charcode);
-            if (it != atlasMap.end ())
-            {
-               loadFace (face, charcode, it->second);
-            }
-         }
+         if (face->num_fixed_sizes > 0)
+            loadFixed ();
          else
-         {
-            loadFace (face, charcode);
-         }
-         charcode = FT_Get_Next_Char (face, charcode, &gindex);
+            loadScaled ();
+         cache = std::make_unique <GlyphCache> (filename, opts.fontsize,
+                                                px, py, baseline);
       }
-
-      if (loadSkipCount)
+      catch (...)
       {
-         logI << "Skipped loading " << loadSkipCount << " code point(s) "
-              << "outside the Basic Multilingual Plane"
-              << std::endl;
+         FT_Done_Face (face);
+         FT_Done_FreeType (ft);
+         throw;
       }
-
-      FT_Done_Face (face);
-      FT_Done_FreeType (ft);
-
-      setupSupportedCodes ();
    }
 
-   void Font::loadFixed (const FT_Face& face)
+   void Font::loadFixed ()
    {
       int bestIdx = -1;
       int bestHeightDiff = std::numeric_limits<int>::max ();
@@ -172,7 +200,7 @@ namespace zutty {
       {
          logT << "Size mismatch too large, fallback to rendering outlines."
               << std::endl;
-         loadScaled (face);
+         loadScaled ();
          return;
       }
 
@@ -208,7 +236,7 @@ namespace zutty {
       }
    }
 
-   void Font::loadScaled (const FT_Face& face)
+   void Font::loadScaled ()
    {
       logI << "Pixel size " << (int)opts.fontsize << std::endl;
       if (FT_Set_Pixel_Sizes (face, opts.fontsize, opts.fontsize))
@@ -224,122 +252,4 @@ namespace zutty {
       logI << "Glyph size " << px << "x" << py << std::endl;
    }
 
-   void Font::loadFace (const FT_Face& face, FT_ULong c)
-   {
-      const uint8_t atlas_row = atlas_seq / nx;
-      const uint8_t atlas_col = atlas_seq - nx * atlas_row;
-      const AtlasPos apos = {atlas_col, atlas_row};
-
-      loadFace (face, c, apos);
-      atlasMap [c] = apos;
-      ++atlas_seq;
-   }
-
-   void Font::loadFace (const FT_Face& face, FT_ULong c, const AtlasPos& apos)
-   {
-      if (c > std::numeric_limits<uint16_t>::max ())
-      {
-        #ifdef DEBUG
-         logT << "Skip loading code point 0x" << std::hex << c << std::dec
-              << " outside the Basic Multilingual Plane" << std::endl;
-        #endif
-         ++loadSkipCount;
-         return;
-      }
-
-      if (FT_Load_Char (face, c, FT_LOAD_RENDER))
-      {
-         throw std::runtime_error (
-            std::string ("FreeType: Failed to load glyph for char ") +
-            std::to_string (c));
-      }
-
-      if (FT_Render_Glyph (face->glyph, FT_RENDER_MODE_NORMAL))
-         throw std::runtime_error (
-            std::string ("FreeType: Failed to render glyph for char ") +
-            std::to_string (c));
-
-
-      // destination pixel offset
-      const unsigned int dx = face->glyph->bitmap_left > 0
-                            ? face->glyph->bitmap_left : 0;
-      const unsigned int dy = baseline && baseline > face->glyph->bitmap_top
-                            ? baseline - face->glyph->bitmap_top : 0;
-
-      // raw/rasterized bitmap dimensions
-      const unsigned int bh = std::min (face->glyph->bitmap.rows, py - dy);
-      const unsigned int bw = std::min (face->glyph->bitmap.width, px - dx);
-
-      const int atlas_row_offset = nx * px * py;
-      const int atlas_glyph_offset = apos.y * atlas_row_offset + apos.x * px;
-      const int atlas_write_offset = atlas_glyph_offset + nx * px * dy + dx;
-
-      if (overlay) // clear glyph area, as we are overwriting an existing glyph
-      {
-         for (unsigned int j = 0; j < bh; ++j) {
-            uint8_t* atl_dst_row =
-               atlasBuf.data () + atlas_glyph_offset + j * nx * px;
-            for (unsigned int k = 0; k < bw; ++k) {
-               *atl_dst_row++ = 0;
-            }
-         }
-      }
-
-      /* Load bitmap into atlas buffer area. Each row in the bitmap
-       * occupies bitmap.pitch bytes (with padding); this is the
-       * increment in the input bitmap array per row.
-       *
-       * Interpretation of bytes within the bitmap rows is subject to
-       * bitmap.pixel_mode, essentially either 8 bits (256-scale gray)
-       * per pixel, or 1 bit (mono) per pixel. Leftmost pixel is MSB.
-       *
-       */
-      const auto& bmp = face->glyph->bitmap;
-      const uint8_t* bmp_src_row;
-      uint8_t* atl_dst_row;
-      switch (bmp.pixel_mode)
-      {
-      case FT_PIXEL_MODE_MONO:
-         for (unsigned int j = 0; j < bh; ++j) {
-            bmp_src_row = bmp.buffer + j * bmp.pitch;
-            atl_dst_row = atlasBuf.data () + atlas_write_offset + j * nx * px;
-            uint8_t byte = 0;
-            for (unsigned int k = 0; k < bw; ++k) {
-               if (k % 8 == 0) {
-                  byte = *bmp_src_row++;
-               }
-               *atl_dst_row++ = (byte & 0x80) ? 0xFF : 0;
-               byte <<= 1;
-            }
-         }
-         break;
-      case FT_PIXEL_MODE_GRAY:
-         for (unsigned int j = 0; j < bh; ++j) {
-            bmp_src_row = bmp.buffer + j * bmp.pitch;
-            atl_dst_row = atlasBuf.data () + atlas_write_offset + j * nx * px;
-            for (unsigned int k = 0; k < bw; ++k) {
-               *atl_dst_row++ = *bmp_src_row++;
-            }
-         }
-         break;
-      default:
-         throw std::runtime_error (
-            std::string ("Unhandled pixel_type=") +
-            std::to_string (bmp.pixel_mode));
-      }
-   }
-
-   void
-   Font::setupSupportedCodes ()
-   {
-      supportedCodes.reserve (atlasMap.size ());
-      auto it = atlasMap.begin ();
-      const auto itEnd = atlasMap.end ();
-      for ( ; it != itEnd; ++it)
-      {
-         supportedCodes.push_back (it->first);
-      }
-      std::sort (supportedCodes.begin (), supportedCodes.end ());
-   }
-
 } // namespace zutty
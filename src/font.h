@@ -11,56 +11,59 @@
 
 #pragma once
 
+#include "glyphcache.h"
+
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
 #include <cstdint>
+#include <memory>
 #include <string>
-#include <vector>
-#include <map>
 
 namespace zutty {
 
    class Font {
    public:
-      /* Load a primary font, determining the atlas geometry and setting up
-       * a mapping from unicode code points to atlas grid positions.
+      /* Load a primary font, determining the glyph geometry.
+       * Glyphs are not rasterized up front, but on demand by rasterize ().
        */
       explicit Font (const std::string& filename);
 
       /* Load an alternate font based on an already loaded primary font,
-       * conforming to the same atlas geometry (incl. position mapping)
-       * and starting with a copy of the atlas texture data.
+       * conforming to the same glyph geometry.
        * It is an error if the alternate font has different geometry.
-       * Any code point not having a glyph in the alternate font will
-       * have the glyph of the primary font (if any) in its atlas.
-       * Any code point not having a glyph in the primary font will be
-       * discarded.
+       * Any code point not having a glyph in the alternate font is meant
+       * to be displayed with the glyph of the primary font (if any).
        */
       explicit Font (const std::string& filename, const Font& priFont);
 
-      ~Font () = default;
+      Font (const Font&) = delete;
+      Font& operator = (const Font&) = delete;
+
+      ~Font ();
 
       uint16_t getPx () const { return px; };
       uint16_t getPy () const { return py; };
       uint16_t getBaseline () const { return baseline; };
-      uint16_t getNx () const { return nx; };
-      uint16_t getNy () const { return ny; };
-
-      const std::vector <uint8_t>& getAtlas () const { return atlasBuf; };
-      const uint8_t* getAtlasData () const { return atlasBuf.data (); };
+      uint32_t getNumGlyphs () const { return face->num_glyphs; };
 
-      const std::vector <uint16_t> & getSupportedCodes () const
+      bool hasGlyph (uint32_t cp) const
       {
-         return supportedCodes;
-      };
+         return FT_Get_Char_Index (face, cp) != 0;
+      }
+
+      /* Rasterize the glyph for code point cp into the px * py area at
+       * dst, with rows pitch bytes apart. The area is expected to be
+       * cleared. Return false (leaving the area blank) on failure.
+       * Glyphs rasterized in earlier sessions are taken from the
+       * on-disk glyph cache.
+       */
+      bool rasterize (uint32_t cp, uint8_t* dst, int pitch) const;
 
       struct AtlasPos {
          uint8_t x;
          uint8_t y;
       };
-      using AtlasMap = std::map <uint16_t, AtlasPos>;
-      const AtlasMap& getAtlasMap () const { return atlasMap; };
 
    private:
       std::string filename;
@@ -68,36 +71,14 @@ namespace zutty {
       uint16_t px; // glyph width in pixels
       uint16_t py; // glyph height in pixels
       uint16_t baseline; // number of pixels above baseline
-      uint16_t nx; // number of glyphs in atlas texture per row
-      uint16_t ny; // number of rows in atlas texture
-      std::vector <uint8_t> atlasBuf; // loaded atlas data
-      AtlasMap atlasMap; // unicode -> atlas position
-      std::vector <uint16_t> supportedCodes; // list of unicodes with glyphs
-
-      /* Start with 1 so as to leave a blank glyph at (0,0).
-       * That blank will get referenced for any out-of-bounds text position
-       * lookup in the shader, and guarantees that no fractional glyphs will
-       * be shown at the right and bottom edges.
-       * Also, any glyph mapping lookup that results in (0,0) means that the
-       * character code does not exist in the atlas.
-       */
-      uint16_t atlas_seq = 1;
-
-      int loadSkipCount = 0;
+      FT_Library ft;
+      FT_Face face;
+      std::unique_ptr <GlyphCache> cache;
 
-      /* Load font from glyph bitmaps rasterized by FreeType.
-       * Store the bitmaps into an atlas bitmap stored in atlasBuf.
-       */
       void load ();
-      void loadFixed (const FT_Face& face);
-      void loadScaled (const FT_Face& face);
-      void loadFace (const FT_Face& face, FT_ULong c);
-      void loadFace (const FT_Face& face, FT_ULong c, const AtlasPos& apos);
-
-      /* Fill the supportedCodes vector with the list of unicode points
-       * that have glyphs in the loaded font.
-       */
-      void setupSupportedCodes ();
+      void loadFixed ();
+      void loadScaled ();
+      bool render (uint32_t cp, uint8_t* dst, int pitch) const;
    };
 
 } // namespace zutty
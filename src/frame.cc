@@ -9,27 +9,46 @@
  * See the file LICENSE for the full license.
  */
 
+#include "cellpool.h"
 #include "frame.h"
 
+#include <algorithm>
+#include <cstring>
+
 namespace zutty {
 
    Frame::Frame () {}
 
    Frame::Frame (uint16_t winPx_, uint16_t winPy_,
                  uint16_t nCols_, uint16_t nRows_)
-      : winPx (winPx_)
-      , winPy (winPy_)
-      , nCols (nCols_)
-      , nRows (nRows_)
-      , scrollHead (0)
-      , marginTop (0)
-      , marginBottom (nRows)
-      , cells (CharVdev::make_cells (nCols, nRows))
-   {}
+   {
+      reset (winPx_, winPy_, nCols_, nRows_);
+   }
+
+   void
+   Frame::reset (uint16_t winPx_, uint16_t winPy_,
+                 uint16_t nCols_, uint16_t nRows_)
+   {
+      winPx = winPx_;
+      winPy = winPy_;
+      nCols = nCols_;
+      nRows = nRows_;
+      cursor = Cursor ();
+      selection = Rect ();
+      attrTable = nullptr;
+      scrollHead = 0;
+      marginTop = 0;
+      marginBottom = nRows;
+      cells = nullptr; // back to the pool first, to be taken right away
+      cells = make_cells (nCols, nRows);
+      damage.setup (nCols, nRows);
+   }
 
    void
    Frame::resize (uint16_t winPx_, uint16_t winPy_,
-                  uint16_t nCols_, uint16_t nRows_)
+                  uint16_t nCols_, uint16_t nRows_,
+                  uint16_t& pY, uint16_t& pX,
+                  const ScrollOutFn& onScrollOut)
    {
       if (winPx == winPx_ && winPy == winPy_)
          return;
@@ -40,16 +59,114 @@ namespace zutty {
       if (nCols == nCols_ && nRows == nRows_)
          return;
 
-      linearizeCellStorage ();
-      const CharVdev::Cell* src = cells.get ();
-      auto newCells = CharVdev::make_cells (nCols_, nRows_);
-      CharVdev::Cell* dst = newCells.get ();
+      const Cell blank;
+      auto row = [this] (uint16_t y) -> const Cell*
+                 { return &getCell (y, 0); };
+
+      // Rows below the cursor that are blank are not carried over
+      uint16_t nUsed = std::min (pY + 1, (int)nRows);
+      for (uint16_t y = nRows; y > nUsed; --y)
+      {
+         const Cell* r = row (y - 1);
+         if (std::any_of (r, r + nCols,
+                          [&blank] (const Cell& c) { return c != blank; }))
+         {
+            nUsed = y;
+            break;
+         }
+      }
+
+      // Find the lines and the number of rows each takes at the new width
+      struct Line
+      {
+         uint16_t y;        // first row of it
+         uint32_t len;      // cells, without trailing blanks
+         uint32_t nNewRows;
+      };
+      std::vector <Line> lines;
+      lines.reserve (nUsed);
+      uint32_t nNewRows = 0;
+      uint32_t curY = 0;
+      uint16_t curX = 0;
+      for (uint16_t y = 0; y < nUsed; )
+      {
+         uint16_t end = y + 1;
+         while (end < nUsed && row (end - 1) [nCols - 1].wrap)
+            ++end;
+
+         const Cell* last = row (end - 1);
+         uint16_t n = nCols;
+         while (n > 0 && last [n - 1] == blank)
+            --n;
+         Line line = {y, (uint32_t)(end - 1 - y) * nCols + n, 1};
+         line.nNewRows = std::max (1u, (line.len + nCols_ - 1) / nCols_);
+
+         if (pY >= y && pY < end)
+         {
+            const uint32_t off = (pY - y) * nCols + std::min (pX, nCols);
+            uint32_t newY;
+            // a pending wrap stays pending, and a cursor just past the
+            // end of the text at the end of a row gets to be one
+            if (off && (pX >= nCols ||
+                        (off == line.len && off % nCols_ == 0)))
+            {
+               newY = (off - 1) / nCols_;
+               curX = (off - 1) % nCols_ + 1;
+            }
+            else
+            {
+               newY = off / nCols_;
+               curX = off % nCols_;
+            }
+            curY = nNewRows + newY;
+            line.nNewRows = std::max (line.nNewRows, newY + 1);
+         }
+
+         lines.push_back (line);
+         nNewRows += line.nNewRows;
+         y = end;
+      }
+
+      // Drop rows off the top to make room, but never the cursor row;
+      // if that is not enough, what is left at the bottom is cut off.
+      const uint32_t drop = nNewRows > nRows_
+                          ? std::min (nNewRows - nRows_, curY)
+                          : 0;
+
+      auto newCells = make_cells (nCols_, nRows_);
+      std::vector <Cell> spill (drop ? nCols_ : 0);
+      uint32_t out = 0;
+      for (const Line& line: lines)
+      {
+         for (uint32_t j = 0; j < line.nNewRows && out < drop + nRows_;
+              ++j, ++out)
+         {
+            Cell* dst = out < drop
+                      ? spill.data ()
+                      : newCells.get () + (out - drop) * nCols_;
+            if (out < drop)
+               std::fill (spill.begin (), spill.end (), blank);
 
-      const int nRowsToCopy = std::min (nRows, nRows_);
-      const int rowLen = std::min (nCols, nCols_);
-      for (int k = 0; k < nRowsToCopy; ++k)
-         memcpy (dst + k * nCols_, src + k * nCols,
-                 rowLen * sizeof (CharVdev::Cell));
+            // the cells of the line for this row may span several old rows
+            const uint32_t begin = j * nCols_;
+            const uint32_t end = std::min (line.len, begin + nCols_);
+            for (uint32_t k = begin; k < end; )
+            {
+               const uint16_t y = line.y + k / nCols;
+               const uint16_t x = k % nCols;
+               const uint32_t n = std::min (end - k, (uint32_t)(nCols - x));
+               memcpy (dst + k - begin, row (y) + x, n * sizeof (Cell));
+               k += n;
+            }
+            for (uint32_t k = begin; k < end; ++k)
+               dst [k - begin].wrap = 0;
+            if (j + 1 < line.nNewRows)
+               dst [nCols_ - 1].wrap = 1;
+
+            if (out < drop && onScrollOut)
+               onScrollOut (dst, nCols_);
+         }
+      }
 
       cells = std::move (newCells);
       nCols = nCols_;
@@ -57,87 +174,138 @@ namespace zutty {
       scrollHead = 0;
       marginTop = 0;
       marginBottom = nRows;
+      damage.setup (nCols, nRows);
+      pY = curY - drop;
+      pX = curX;
    }
 
    void
-   Frame::copyCells (CharVdev::Cell * const dst)
+   Frame::snapshotTo (Frame& dst) const
    {
-      constexpr const size_t cellSize = sizeof (CharVdev::Cell);
-
-      CharVdev::Cell* p = dst;
-      CharVdev::Cell* s = cells.get ();
-      uint32_t n = marginTop * nCols;
-      memcpy (p, s, n * cellSize);
+      const size_t nCells = nRows * nCols;
+      Cell::Ptr storage = std::move (dst.cells);
+      if (!storage || storage.use_count () > 1 ||
+          (size_t)dst.nRows * dst.nCols != nCells)
+         storage = make_cells (nCols, nRows);
 
-      p += n;
-      n = (marginBottom - scrollHead) * nCols;
-      memcpy (p, s + scrollHead * nCols, n * cellSize);
-
-      p += n;
-      n = (scrollHead - marginTop) * nCols;
-      memcpy (p, s + marginTop * nCols, n * cellSize);
+      AttrTable::Ptr dstAttrs = std::move (dst.attrTable);
+      if (attrTable && (!dstAttrs || dstAttrs.use_count () > 1))
+         dstAttrs = std::make_shared <AttrTable> ();
 
-      p += n;
-      n = (nRows - marginBottom) * nCols;
-      memcpy (p, s + marginBottom * nCols, n * cellSize);
+      dst = * this;
+      memcpy (storage.get (), cells.get (), nCells * sizeof (Cell));
+      dst.cells = std::move (storage);
+      if (attrTable)
+      {
+         attrTable->copyTo (* dstAttrs);
+         dst.attrTable = std::move (dstAttrs);
+      }
    }
 
-   inline void
-   Frame::damageDeltaCopy (CharVdev::Cell* dst, uint32_t start, uint32_t end)
+   void
+   Frame::copyCells (Cell * const dst) const
    {
-      if (damage.end <= start || end <= damage.start)
-         return; // no intersection
+      memcpy (dst, cells.get (), nRows * nCols * sizeof (Cell));
+   }
 
-      if (start < damage.start)
+   void
+   Frame::deltaCopyCells (Cell * const dst,
+                          uint8_t * const dirtyRows) const
+   {
+      for (uint16_t row = damage.top; row < damage.bottom; ++row)
       {
-         dst += (damage.start - start);
-         start = damage.start;
-      }
+         const Damage::Span& span = damage.rows [row];
+         if (span.start == span.end)
+            continue;
 
-      if (end > damage.end)
-      {
-         end = damage.end;
-      }
-
-      CharVdev::Cell* const src = cells.get ();
-
-      for (size_t i = 0, j = start; j < end; ++i, ++j)
-      {
-         if (dst [i] != src [j])
+         const Cell* src = cells.get () + row * nCols;
+         Cell* out = dst + row * nCols;
+         for (uint16_t x = span.start; x < span.end; ++x)
          {
-            dst [i] = src [j];
-            dst [i].dirty = 1;
+            if (out [x] != src [x])
+            {
+               out [x] = src [x];
+               out [x].dirty = 1;
+               dirtyRows [row] = 1;
+            }
          }
       }
    }
 
    void
-   Frame::deltaCopyCells (CharVdev::Cell * const dst)
+   Frame::linearizeCellStorage ()
    {
-      CharVdev::Cell* p = dst;
+      constexpr const size_t cellSize = sizeof (Cell);
+
+      // copy the areas in logical order (1)(2)(3)(4), see HACKING.org
+      auto newCells = make_cells (nCols, nRows);
+      Cell* p = newCells.get ();
+      Cell* s = cells.get ();
       uint32_t n = marginTop * nCols;
-      damageDeltaCopy (p, 0, n);
+      memcpy (p, s, n * cellSize);
 
       p += n;
       n = (marginBottom - scrollHead) * nCols;
-      damageDeltaCopy (p, scrollHead * nCols, marginBottom * nCols);
+      memcpy (p, s + scrollHead * nCols, n * cellSize);
 
       p += n;
       n = (scrollHead - marginTop) * nCols;
-      damageDeltaCopy (p, marginTop * nCols, scrollHead * nCols);
+      memcpy (p, s + marginTop * nCols, n * cellSize);
 
       p += n;
       n = (nRows - marginBottom) * nCols;
-      damageDeltaCopy (p, marginBottom * nCols, nRows * nCols);
+      memcpy (p, s + marginBottom * nCols, n * cellSize);
+
+      cells = std::move (newCells);
+      scrollHead = marginTop;
+
+      // Damage is tracked by storage index, and cells have moved
+      damage.add (0, nRows * nCols);
    }
 
    void
-   Frame::linearizeCellStorage ()
+   Frame::Damage::setup (uint16_t nCols_, uint16_t nRows_)
    {
-      auto newCells = CharVdev::make_cells (nCols, nRows);
-      copyCells (newCells.get ());
-      cells = std::move (newCells);
-      scrollHead = marginTop;
+      nCols = nCols_;
+      top = 0;
+      bottom = 0;
+      rows.assign (nRows_, Span ());
+   }
+
+   void
+   Frame::Damage::reset ()
+   {
+      for (uint16_t row = top; row < bottom; ++row)
+         rows [row] = Span ();
+      top = 0;
+      bottom = 0;
+   }
+
+   uint32_t
+   Frame::Damage::count () const
+   {
+      uint32_t n = 0;
+      for (uint16_t row = top; row < bottom; ++row)
+         n += rows [row].end - rows [row].start;
+      return n;
+   }
+
+   void
+   Frame::Damage::add (const Damage& other)
+   {
+      if (other.nCols != nCols || other.rows.size () != rows.size ())
+      {
+         // of a different geometry, so damage everything
+         add (0, rows.size () * nCols);
+         return;
+      }
+
+      for (uint16_t row = other.top; row < other.bottom; ++row)
+      {
+         const Span& span = other.rows [row];
+         if (span.start != span.end)
+            addSpan (row, span.start, span.end);
+      }
    }
 
 } // namespace zutty
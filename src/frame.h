@@ -11,7 +11,11 @@
 
 #pragma once
 
-#include "charvdev.h"
+#include "attrtable.h"
+#include "cell.h"
+
+#include <functional>
+#include <vector>
 
 namespace zutty {
 
@@ -23,67 +27,98 @@ namespace zutty {
       explicit Frame (uint16_t winPx_, uint16_t winPy_,
                       uint16_t nCols_, uint16_t nRows_);
 
+      // Start over as a blank frame (as if newly constructed), keeping
+      // what storage can be kept
+      void reset (uint16_t winPx_, uint16_t winPy_,
+                  uint16_t nCols_, uint16_t nRows_);
+
+      /* Lay the content out again for a new size. Rows ending in a cell
+       * with the wrap flag set are taken together with the next as one
+       * line, and lines are split into rows anew at the new width. If
+       * they do not fit, rows are dropped off the top (passed on to
+       * onScrollOut, oldest first) as far as the cursor position pY, pX
+       * allows, which moves along with the text at it.
+       */
+      using ScrollOutFn = std::function <void (const Cell* row,
+                                               uint16_t nCols)>;
       void resize (uint16_t winPx_, uint16_t winPy_,
-                   uint16_t nCols_, uint16_t nRows_);
+                   uint16_t nCols_, uint16_t nRows_,
+                   uint16_t& pY, uint16_t& pX,
+                   const ScrollOutFn& onScrollOut = nullptr);
 
       void linearizeCellStorage ();
-      void copyCells (CharVdev::Cell * const dest);
-      void deltaCopyCells (CharVdev::Cell * const dest);
-      void damageDeltaCopy (CharVdev::Cell* dst, uint32_t start, uint32_t end);
+      void snapshotTo (Frame& dest) const;
+
+      /* Copy the cells to the CharVdev as they are laid out in storage
+       * (not in display order), so scrolling does not move any of them.
+       */
+      void copyCells (Cell * const dest) const;
+      void deltaCopyCells (Cell * const dest,
+                           uint8_t * const dirtyRows) const;
       operator bool () const { return cells != nullptr; }
       void freeCells () { cells = nullptr; }
 
       uint32_t getIdx (uint16_t pY, uint16_t pX);
-      CharVdev::Cell & getCell (uint16_t pY, uint16_t pX);
-      CharVdev::Cell & operator [] (uint32_t idx);
+      Cell & getCell (uint16_t pY, uint16_t pX);
+      Cell & operator [] (uint32_t idx);
 
       void copyCells (uint32_t dstIx, uint32_t srcIx, uint32_t count);
       void moveCells (uint32_t dstIx, uint32_t srcIx, uint32_t count);
-
-      uint64_t seqNo = 0; // update counter (used by Renderer)
+      void fillCells (uint32_t dstIx, const Cell& cell, uint32_t count);
 
       uint16_t winPx = 0;
       uint16_t winPy = 0;
       uint16_t nCols = 0;
       uint16_t nRows = 0;
 
-      CharVdev::Cursor cursor;
+      Cursor cursor;
       Rect selection;
 
+      /* The attributes of the cells, shared with the Vterm producing
+       * them. A snapshot gets a copy of its own, so it stays valid while
+       * the Vterm carries on.
+       */
+      AttrTable::Ptr attrTable;
+
       // Ideally, these should be private, but they are closely coupled to Vterm
       uint16_t scrollHead;   // scrolling area row offset of logical top row
       uint16_t marginTop;    // current margin top (number of rows above)
       uint16_t marginBottom; // current margin bottom (number of rows above + 1)
 
+      /* Damage is kept per row of cell storage (not per displayed row,
+       * as scrolling only changes scrollHead): each row has a span of
+       * columns [start, end) that changed since the last refresh. The
+       * rows with changes are bounded by [top, bottom), so that a few
+       * changes far apart (e.g., a status line and the cursor line) do
+       * not damage everything in between.
+       */
       struct Damage
       {
-         uint32_t start = 0;
-         uint32_t end = 0;
-
-         void reset ()
-         {
-            start = 0;
-            end = 0;
-         }
-
-         void add (uint32_t start_, uint32_t end_)
+         struct Span
          {
-            if (start == end) // null state
-            {
-               start = start_;
-               end = end_;
-            }
-            else
-            {
-               start = std::min (start, start_);
-               end = std::max (end, end_);
-            }
-         }
+            uint16_t start = 0;
+            uint16_t end = 0;
+         };
+
+         void setup (uint16_t nCols_, uint16_t nRows_);
+         void reset ();
+         void add (uint32_t start_, uint32_t end_); // cell storage indices
+         void add (const Damage& other);
+         bool empty () const { return top >= bottom; }
+         uint32_t count () const; // number of damaged cells
+
+         uint16_t nCols = 0;
+         uint16_t top = 0;
+         uint16_t bottom = 0;
+         std::vector <Span> rows;
+
+      private:
+         void addSpan (uint16_t row, uint16_t start_, uint16_t end_);
       };
       Damage damage;
 
    private:
-      CharVdev::Cell::Ptr cells = nullptr;
+      Cell::Ptr cells = nullptr;
    };
 
 } // namespace zutty
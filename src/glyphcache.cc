@@ -0,0 +1,297 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "glyphcache.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+/* Layout of a cache file (in native byte order, as it never leaves the
+ * host it was made on):
+ *
+ *   Header
+ *   <key> padded with zeros to a multiple of 4 bytes
+ *   uint32_t codes [nGlyphs], sorted ascending
+ *   uint8_t glyphs [nGlyphs][py][px]
+ */
+namespace {
+
+   constexpr const uint32_t Magic = 0x5a474331; // "ZGC1"
+
+   struct Header
+   {
+      uint32_t magic;
+      uint32_t keyLen;
+      uint32_t nGlyphs;
+      uint16_t px;
+      uint16_t py;
+   };
+
+   inline size_t
+   padded (size_t len)
+   {
+      return (len + 3) & ~3;
+   }
+
+   bool
+   makeDir (const std::string& dir)
+   {
+      const size_t slash = dir.rfind ('/');
+      if (slash && slash != std::string::npos)
+      {
+         struct stat st;
+         const std::string parent = dir.substr (0, slash);
+         if (stat (parent.c_str (), &st) < 0 && !makeDir (parent))
+            return false;
+      }
+      return mkdir (dir.c_str (), 0700) == 0 || errno == EEXIST;
+   }
+
+   bool
+   writeAll (int fd, const uint8_t* buf, size_t len)
+   {
+      while (len)
+      {
+         const ssize_t n = write (fd, buf, len);
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n <= 0)
+            return false;
+         buf += n;
+         len -= n;
+      }
+      return true;
+   }
+
+} // namespace
+
+namespace zutty {
+
+   std::string
+   cacheDir ()
+   {
+      const char* xdg = getenv ("XDG_CACHE_HOME");
+      if (xdg && xdg [0] == '/')
+         return std::string (xdg) + "/zutty";
+      const char* home = getenv ("HOME");
+      if (home && home [0] == '/')
+         return std::string (home) + "/.cache/zutty";
+      return "";
+   }
+
+   bool
+   replaceFile (const std::string& path, const uint8_t* buf, size_t len)
+   {
+      const size_t slash = path.rfind ('/');
+      if (slash != std::string::npos && !makeDir (path.substr (0, slash)))
+         return false;
+
+      std::string tmpPath = path + ".XXXXXX";
+      const int fd = mkstemp (&tmpPath [0]);
+      if (fd < 0)
+         return false;
+      const bool ok = writeAll (fd, buf, len);
+      if (close (fd) < 0 || !ok ||
+          rename (tmpPath.c_str (), path.c_str ()) < 0)
+      {
+         const int err = errno;
+         unlink (tmpPath.c_str ());
+         errno = err;
+         return false;
+      }
+      return true;
+   }
+
+   GlyphCache::GlyphCache (const std::string& fontFile, uint8_t fontsize,
+                           uint16_t px_, uint16_t py_, uint16_t baseline)
+      : px (px_)
+      , py (py_)
+   {
+      struct stat st;
+      const std::string dir = cacheDir ();
+      if (dir.empty () || stat (fontFile.c_str (), &st) < 0)
+         return;
+
+      std::ostringstream oss;
+      oss << fontFile << '\n' << st.st_size << ' ' << st.st_mtim.tv_sec
+          << '.' << st.st_mtim.tv_nsec << '\n' << (int)fontsize << ' '
+          << px << 'x' << py << '+' << baseline << '\n' << ZUTTY_VERSION;
+      key = oss.str ();
+
+      uint64_t hash = 0xcbf29ce484222325; // FNV-1a
+      for (char ch: key)
+         hash = (hash ^ (uint8_t)ch) * 0x100000001b3;
+
+      oss.str ("");
+      oss << dir << "/glyphs-" << std::hex << std::setw (16)
+          << std::setfill ('0') << hash;
+      path = oss.str ();
+
+      open ();
+   }
+
+   GlyphCache::~GlyphCache ()
+   {
+      if (!added.empty ())
+         save ();
+      if (map)
+         munmap ((void*)map, mapSize);
+   }
+
+   bool
+   GlyphCache::get (uint32_t cp, uint8_t* dst, int pitch) const
+   {
+      const uint8_t* glyph = nullptr;
+      const uint32_t* it =
+         std::lower_bound (mappedCodes, mappedCodes + nMapped, cp);
+      if (it != mappedCodes + nMapped && *it == cp)
+      {
+         glyph = mappedGlyphs + (size_t)(it - mappedCodes) * px * py;
+      }
+      else
+      {
+         const auto ait = added.find (cp);
+         if (ait == added.end ())
+            return false;
+         glyph = ait->second.data ();
+      }
+
+      for (uint16_t y = 0; y < py; ++y)
+         memcpy (dst + y * pitch, glyph + y * px, px);
+      return true;
+   }
+
+   void
+   GlyphCache::put (uint32_t cp, const uint8_t* src, int pitch)
+   {
+      if (path.empty ())
+         return;
+
+      std::vector <uint8_t>& glyph = added [cp];
+      glyph.resize (px * py);
+      for (uint16_t y = 0; y < py; ++y)
+         memcpy (glyph.data () + y * px, src + y * pitch, px);
+   }
+
+   // private methods
+
+   void
+   GlyphCache::open ()
+   {
+      const int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+      {
+         logT << "Glyph cache: " << path << " not found" << std::endl;
+         return;
+      }
+
+      struct stat st;
+      if (fstat (fd, &st) == 0 && (size_t)st.st_size >= sizeof (Header))
+      {
+         void* addr = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE,
+                            fd, 0);
+         if (addr != MAP_FAILED)
+         {
+            map = static_cast <const uint8_t*> (addr);
+            mapSize = st.st_size;
+         }
+      }
+      close (fd);
+      if (!map)
+         return;
+
+      Header hdr;
+      memcpy (&hdr, map, sizeof (Header));
+      const size_t keyOffset = sizeof (Header);
+      const size_t codesOffset = keyOffset + padded (hdr.keyLen);
+      const size_t glyphsOffset = codesOffset + 4 * (size_t)hdr.nGlyphs;
+      if (hdr.magic != Magic || hdr.px != px || hdr.py != py ||
+          hdr.keyLen != key.size () || codesOffset > mapSize ||
+          mapSize != glyphsOffset + (size_t)hdr.nGlyphs * px * py ||
+          memcmp (map + keyOffset, key.data (), key.size ()) != 0)
+      {
+         logT << "Glyph cache: ignoring stale " << path << std::endl;
+         munmap ((void*)map, mapSize);
+         map = nullptr;
+         mapSize = 0;
+         return;
+      }
+
+      nMapped = hdr.nGlyphs;
+      mappedCodes = reinterpret_cast <const uint32_t*> (map + codesOffset);
+      mappedGlyphs = map + glyphsOffset;
+      logT << "Glyph cache: " << nMapped << " glyphs in " << path
+           << std::endl;
+   }
+
+   void
+   GlyphCache::save () const
+   {
+      // merge the mapped and added glyphs, keeping codes sorted
+      std::vector <uint32_t> codes;
+      std::vector <const uint8_t*> glyphs;
+      codes.reserve (nMapped + added.size ());
+      glyphs.reserve (nMapped + added.size ());
+      const size_t glyphSize = px * py;
+      uint32_t k = 0;
+      auto ait = added.begin ();
+      while (k < nMapped || ait != added.end ())
+      {
+         if (ait == added.end () ||
+             (k < nMapped && mappedCodes [k] < ait->first))
+         {
+            codes.push_back (mappedCodes [k]);
+            glyphs.push_back (mappedGlyphs + k * glyphSize);
+            ++k;
+         }
+         else
+         {
+            if (k < nMapped && mappedCodes [k] == ait->first)
+               ++k;
+            codes.push_back (ait->first);
+            glyphs.push_back (ait->second.data ());
+            ++ait;
+         }
+      }
+
+      const Header hdr = {Magic, (uint32_t)key.size (),
+                          (uint32_t)codes.size (), px, py};
+      std::vector <uint8_t> buf (sizeof (Header) + padded (key.size ()), 0);
+      memcpy (buf.data (), &hdr, sizeof (Header));
+      memcpy (buf.data () + sizeof (Header), key.data (), key.size ());
+      const uint8_t* codesBuf =
+         reinterpret_cast <const uint8_t*> (codes.data ());
+      buf.insert (buf.end (), codesBuf, codesBuf + 4 * codes.size ());
+      buf.reserve (buf.size () + glyphs.size () * glyphSize);
+      for (const uint8_t* glyph: glyphs)
+         buf.insert (buf.end (), glyph, glyph + glyphSize);
+
+      if (!replaceFile (path, buf.data (), buf.size ()))
+      {
+         logW << "Glyph cache: cannot write " << path
+              << ": " << strerror (errno) << std::endl;
+         return;
+      }
+      logT << "Glyph cache: saved " << codes.size () << " glyphs to " << path
+           << std::endl;
+   }
+
+} // namespace zutty
@@ -0,0 +1,85 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace zutty {
+
+   // The directory of the persistent caches ($XDG_CACHE_HOME/zutty or
+   // ~/.cache/zutty), or empty if there is none
+   std::string cacheDir ();
+
+   /* Replace the file at path with len bytes at buf atomically (a
+    * temporary file is renamed into place), creating its directory if
+    * need be. Return false (with errno set) if that fails.
+    */
+   bool replaceFile (const std::string& path, const uint8_t* buf, size_t len);
+
+   /* Persistent cache of rasterized glyphs of a font, so the glyphs
+    * displayed in earlier sessions need not be rasterized again.
+    *
+    * There is one cache file per font file and glyph geometry under
+    * $XDG_CACHE_HOME/zutty (or ~/.cache/zutty). The file is identified
+    * by a key made of the font path, its size and mtime, the font size,
+    * the glyph geometry and the Zutty version; a file with a different
+    * key is ignored (and eventually replaced). Parts of the file are only paged
+    * in as glyphs are looked up in the read-only mapping of it.
+    *
+    * Glyphs added during the session are written back, merged with the
+    * ones read, when the cache is destroyed. The file is replaced
+    * atomically, so concurrent instances never see a partial file; when
+    * several of them add glyphs, the last one to exit wins.
+    */
+   class GlyphCache
+   {
+   public:
+      explicit GlyphCache (const std::string& fontFile, uint8_t fontsize,
+                           uint16_t px, uint16_t py, uint16_t baseline);
+
+      GlyphCache (const GlyphCache&) = delete;
+      GlyphCache& operator = (const GlyphCache&) = delete;
+
+      ~GlyphCache ();
+
+      /* Copy the cached glyph for code point cp into the px * py area
+       * at dst, with rows pitch bytes apart. Return false if not cached.
+       */
+      bool get (uint32_t cp, uint8_t* dst, int pitch) const;
+
+      // Add the glyph for code point cp, taken from an area as above
+      void put (uint32_t cp, const uint8_t* src, int pitch);
+
+   private:
+      uint16_t px;
+      uint16_t py;
+      std::string key;
+      std::string path; // empty if the cache is disabled
+
+      // read-only mapping of the cache file, if valid
+      const uint8_t* map = nullptr;
+      size_t mapSize = 0;
+      uint32_t nMapped = 0;
+      const uint32_t* mappedCodes = nullptr; // sorted
+      const uint8_t* mappedGlyphs = nullptr;
+
+      std::map <uint32_t, std::vector <uint8_t>> added;
+
+      void open ();
+      void save () const;
+   };
+
+} // namespace zutty
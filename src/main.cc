@@ -16,15 +16,23 @@
 #include <X11/Xmu/Error.h>
 
 #include "base64.h"
+#include "bench.h"
+#include "cmdqueue.h"
 #include "fontpack.h"
 #include "options.h"
 #include "pty.h"
 #include "renderer.h"
 #include "selmgr.h"
+#include "server.h"
+#include "stats.h"
 #include "vterm.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <fcntl.h>
 #include <langinfo.h>
+#include <map>
 #include <memory>
 #include <poll.h>
 #include <pwd.h>
@@ -35,9 +43,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
+
+extern char** environ;
 
 using zutty::CharVdev;
+using zutty::CommandQueue;
 using zutty::Fontpack;
 using zutty::MouseTrackingState;
 using zutty::MouseTrackingMode;
@@ -45,20 +58,119 @@ using zutty::MouseTrackingEnc;
 using zutty::Vterm;
 using zutty::VtKey;
 using zutty::VtModifier;
+using zutty::RenderThread;
 using zutty::Renderer;
+using zutty::SelectedText;
+using zutty::SelectionManager;
 
+/* Shared by all the windows (there are several in server mode): the
+ * display, the one GL context they are all drawn with on renderThread,
+ * the input method, and the fonts.
+ */
+static Display* xDpy = nullptr;
+static EGLDisplay eglDpy;
+static EGLConfig eglConfig;
+static XVisualInfo* xVisual = nullptr;
+static EGLContext eglCtx;
+static XIM xim = nullptr;
+static XIMStyle ximStyle = 0;
 static std::unique_ptr <Fontpack> fontpk = nullptr;
-static std::unique_ptr <Renderer> renderer = nullptr;
-static std::unique_ptr <Vterm> vt = nullptr;
-static std::unique_ptr <zutty::SelectionManager> selMgr = nullptr;
-
+static std::unique_ptr <RenderThread> renderThread = nullptr;
+static bool x11Done = false;    // owned by the main thread
 static Atom wmDeleteMessage;
 
+// Data shared between mouse event handlers (run on the parser thread)
+struct MouseContext
+{
+   // cycle selection SnapTo behaviour based on double/triple clicks
+   constexpr const static int Multi_Click_Threshold_Ms = 250;
+   Time lastButtonReleasedAt = 0;
+   unsigned int lastButtonReleased = 0;
+   bool selectionOngoing = false;
+   uint16_t lastCx = 65535;
+   uint16_t lastCy = 65535;
+};
+
+/* A window with a shell running in it. The Vterm is owned by the parser
+ * thread of the terminal, which reads the pty and runs the commands
+ * posted to parserQueue. The main thread handles X11 events (and owns
+ * selMgr), and runs the commands posted to x11Queue.
+ */
+class Terminal
+{
+public:
+   Terminal (const char* const argv[], const char* title,
+             const std::string& cwd, const std::vector <std::string>* env);
+
+   // Only once finished (the parser thread has ended)
+   ~Terminal ();
+
+   bool x11Event (XEvent& event); // returns true to close the window
+   void requestClose () { onParser ([this] { parserDone = true; }); }
+
+   Window win;
+   pid_t pid;
+   std::unique_ptr <SelectionManager> selMgr;
+   CommandQueue x11Queue;
+   bool finished = false;          // owned by the main thread
+   bool destroyed = false;         // owned by the main thread
+
+private:
+   void onParser (CommandQueue::Command&& cmd)
+   {
+      parserQueue.post (std::move (cmd));
+   }
+
+   void onX11 (CommandQueue::Command&& cmd)
+   {
+      x11Queue.post (std::move (cmd));
+   }
+
+   void pasteSelection (Time time);
+   bool onKeyPress (XEvent& event);
+   bool isMouseProtocol (unsigned int state,
+                         const MouseTrackingState& mouseTrk);
+   void mouseProtoSend (MouseTrackingEnc enc, int eventType,
+                        unsigned int modstate, int button, int cx, int cy);
+   void onButtonPressMouseProto (XButtonEvent& xbevt,
+                                 const MouseTrackingState& mouseTrk);
+   void onButtonReleaseMouseProto (XButtonEvent& xbevt,
+                                   const MouseTrackingState& mouseTrk);
+   void onMotionNotifyMouseProto (XMotionEvent& xmoevt,
+                                  const MouseTrackingState& mouseTrk);
+   void onButtonPress (XButtonEvent& xbevt);
+   void onButtonRelease (XButtonEvent& xbevt);
+   void onMotionNotify (XMotionEvent& xmoevt);
+   void handleOsc (int cmd, const std::string& arg);
+   void parserLoop ();
+
+   XIC xic = nullptr;
+   EGLSurface eglSurf;
+   int ptyFd;
+   std::unique_ptr <Renderer> renderer;
+   std::unique_ptr <Vterm> vt;
+   CommandQueue parserQueue;
+   std::thread parser;
+   bool parserDone = false;        // owned by the parser thread
+   bool holdPtyIn = false;         // owned by the parser thread
+   bool exposed = false;           // owned by the main thread
+   MouseContext mouseCtx;          // owned by the parser thread
+
+   /* The window size of the last ConfigureNotify (width << 16 | height)
+    * not yet taken up by the parser thread, or 0 if none. A window drag
+    * brings a storm of these events, but the Vterm is only resized (and
+    * its screen reflowed) for the latest one each time the parser gets
+    * to it.
+    */
+   std::atomic <uint32_t> pendingSize {0};
+};
+
+static std::map <Window, Terminal*> terminals;
+
+// Set up the EGL config (and its X visual) and the GL context for all
+// windows to be drawn with
 static void
-make_x_window (Display* x_dpy, EGLDisplay egl_dpy,
-               const char* name, int width, int height,
-               Window* o_win, EGLContext* o_ctx,
-               EGLSurface* o_surface)
+setupEgl ()
 {
    static const EGLint attribs[] = {
       EGL_RED_SIZE, 8,
@@ -72,67 +184,83 @@ make_x_window (Display* x_dpy, EGLDisplay egl_dpy,
       EGL_NONE
    };
 
-   int scrnum;
-   XSetWindowAttributes attr;
-   unsigned long mask;
-   Window root;
-   Window win;
-   XVisualInfo *visInfo, visTemplate;
+   XVisualInfo visTemplate;
    int num_visuals;
-   EGLContext ctx;
-   EGLConfig config;
    EGLint num_configs;
    EGLint vid;
 
-   scrnum = DefaultScreen (x_dpy);
-   root = RootWindow (x_dpy, scrnum);
-
-   if (!eglChooseConfig (egl_dpy, attribs, &config, 1, &num_configs)) {
+   if (!eglChooseConfig (eglDpy, attribs, &eglConfig, 1, &num_configs)) {
       logE << "Couldn't get an EGL visual config" << std::endl;
       exit(1);
    }
 
-   assert (config);
+   assert (eglConfig);
    assert (num_configs > 0);
 
-   if (!eglGetConfigAttrib (egl_dpy, config, EGL_NATIVE_VISUAL_ID, &vid)) {
+   if (!eglGetConfigAttrib (eglDpy, eglConfig, EGL_NATIVE_VISUAL_ID, &vid)) {
       logE << "eglGetConfigAttrib() failed" << std::endl;
       exit (1);
    }
 
    // The X window visual must match the EGL config
    visTemplate.visualid = vid;
-   visInfo = XGetVisualInfo (x_dpy, VisualIDMask, &visTemplate, &num_visuals);
-   if (!visInfo) {
+   xVisual = XGetVisualInfo (xDpy, VisualIDMask, &visTemplate, &num_visuals);
+   if (!xVisual) {
       logE << "Couldn't get X visual" << std::endl;
       exit (1);
    }
 
+   wmDeleteMessage = XInternAtom (xDpy, "WM_DELETE_WINDOW", False);
+
+   eglBindAPI (EGL_OPENGL_ES_API);
+
+   eglCtx = eglCreateContext (eglDpy, eglConfig, EGL_NO_CONTEXT, ctx_attribs);
+   if (!eglCtx) {
+      logE << "eglCreateContext failed" << std::endl;
+      exit (1);
+   }
+
+   // test eglQueryContext()
+   {
+      EGLint val;
+      eglQueryContext (eglDpy, eglCtx, EGL_CONTEXT_CLIENT_TYPE, &val);
+      assert (val == EGL_OPENGL_ES_API);
+   }
+}
+
+static void
+makeWindow (const char* name, int width, int height,
+            Window& o_win, EGLSurface& o_surface)
+{
+   int scrnum;
+   XSetWindowAttributes attr;
+   unsigned long mask;
+   Window root;
+   Window win;
+
+   scrnum = DefaultScreen (xDpy);
+   root = RootWindow (xDpy, scrnum);
+
    // window attributes
    attr.background_pixel = 0;
    attr.border_pixel = 0;
-   attr.colormap = XCreateColormap (x_dpy, root, visInfo->visual, AllocNone);
+   attr.colormap = XCreateColormap (xDpy, root, xVisual->visual, AllocNone);
    attr.event_mask = StructureNotifyMask | ExposureMask | FocusChangeMask |
       PropertyChangeMask | KeyPressMask | ButtonPressMask | ButtonReleaseMask |
       PointerMotionMask;
    mask = CWBackPixel | CWBorderPixel | CWColormap | CWEventMask;
 
-   win = XCreateWindow (x_dpy, root, 0, 0, width, height,
-                        0, visInfo->depth, InputOutput,
-                        visInfo->visual, mask, &attr);
+   win = XCreateWindow (xDpy, root, 0, 0, width, height,
+                        0, xVisual->depth, InputOutput,
+                        xVisual->visual, mask, &attr);
    logI << "Window ID: " << win << " / 0x" << std::hex << win << std::dec
         << std::endl;
-   if (setenv ("WINDOWID", std::to_string (win).c_str (), 1) < 0)
-   {
-      logE << "Can't setenv (WINDOWID)" << std::endl;
-      exit (1);
-   }
 
    {
       // set NET_WM_PID to the the process ID to link the window to the pid
-      Atom _NET_WM_PID = XInternAtom (x_dpy, "_NET_WM_PID", false);
+      Atom _NET_WM_PID = XInternAtom (xDpy, "_NET_WM_PID", false);
       pid_t pid = getpid ();
-      XChangeProperty (x_dpy, win, _NET_WM_PID, XA_CARDINAL,
+      XChangeProperty (xDpy, win, _NET_WM_PID, XA_CARDINAL,
                        32, PropModeReplace, (unsigned char *)&pid, 1);
    }
 
@@ -148,7 +276,7 @@ make_x_window (Display* x_dpy, EGLDisplay egl_dpy,
       char *hostname [] = { name };
       XTextProperty text_prop;
       XStringListToTextProperty (hostname, 1, &text_prop);
-      XSetWMClientMachine (x_dpy, win, &text_prop);
+      XSetWMClientMachine (xDpy, win, &text_prop);
       XFree (text_prop.value);
    }
 
@@ -157,32 +285,16 @@ make_x_window (Display* x_dpy, EGLDisplay egl_dpy,
       sizehints.width  = width;
       sizehints.height = height;
       sizehints.flags = USSize;
-      XSetNormalHints (x_dpy, win, &sizehints);
-      XSetStandardProperties (x_dpy, win, name, name,
+      XSetNormalHints (xDpy, win, &sizehints);
+      XSetStandardProperties (xDpy, win, name, name,
                               None, nullptr, 0, &sizehints);
    }
 
-   wmDeleteMessage = XInternAtom (x_dpy, "WM_DELETE_WINDOW", False);
-   XSetWMProtocols (x_dpy, win, &wmDeleteMessage, 1);
-
-   eglBindAPI (EGL_OPENGL_ES_API);
+   XSetWMProtocols (xDpy, win, &wmDeleteMessage, 1);
 
-   ctx = eglCreateContext (egl_dpy, config, EGL_NO_CONTEXT, ctx_attribs);
-   if (!ctx) {
-      logE << "eglCreateContext failed" << std::endl;
-      exit (1);
-   }
-
-   // test eglQueryContext()
-   {
-      EGLint val;
-      eglQueryContext (egl_dpy, ctx, EGL_CONTEXT_CLIENT_TYPE, &val);
-      assert (val == EGL_OPENGL_ES_API);
-   }
-
-   *o_surface = eglCreateWindowSurface (egl_dpy, config,
-                                        (EGLNativeWindowType)win, nullptr);
-   if (! *o_surface) {
+   o_surface = eglCreateWindowSurface (eglDpy, eglConfig,
+                                       (EGLNativeWindowType)win, nullptr);
+   if (! o_surface) {
       logE << "eglCreateWindowSurface failed" << std::endl;
       exit (1);
    }
@@ -190,18 +302,15 @@ make_x_window (Display* x_dpy, EGLDisplay egl_dpy,
    // sanity checks
    {
       EGLint val;
-      eglQuerySurface (egl_dpy, *o_surface, EGL_WIDTH, &val);
+      eglQuerySurface (eglDpy, o_surface, EGL_WIDTH, &val);
       assert (val == width);
-      eglQuerySurface (egl_dpy, *o_surface, EGL_HEIGHT, &val);
+      eglQuerySurface (eglDpy, o_surface, EGL_HEIGHT, &val);
       assert (val == height);
-      assert (eglGetConfigAttrib (egl_dpy, config, EGL_SURFACE_TYPE, &val));
+      assert (eglGetConfigAttrib (eglDpy, eglConfig, EGL_SURFACE_TYPE, &val));
       assert (val & EGL_WINDOW_BIT);
    }
 
-   XFree (visInfo);
-
-   *o_win = win;
-   *o_ctx = ctx;
+   o_win = win;
 }
 
 static void
@@ -281,12 +390,27 @@ validateShell (char* progPath)
    unsetenv ("SHELL");
 }
 
+// Set on SIGUSR1, to dump the stats to the log from the event loop
+static volatile sig_atomic_t statsDumpRequested = 0;
+
+// Written to on SIGCHLD, so the event loop reaps the child and closes
+// its window
+static int childPipe [2];
+
 static void
 sighandler (int sig, siginfo_t* info, void* ucontext)
 {
    if (sig == SIGCHLD)
    {
-      waitpid (info->si_pid, nullptr, 0);
+      const int err = errno;
+      const char ch = 0;
+      const ssize_t rc = write (childPipe [1], &ch, 1);
+      (void) rc;
+      errno = err;
+   }
+   else if (sig == SIGUSR1)
+   {
+      statsDumpRequested = 1;
    }
 }
 
@@ -294,8 +418,18 @@ static void
 setupSignals ()
 {
    // The SIGCHLD handler is required to detect that the child process
-   // has quit; its handler ensures we won't create zombies.
+   // has quit; reaping it in the event loop ensures we won't create
+   // zombies.
    {
+      using zutty::printArgs;
+      if (pipe (childPipe) < 0)
+         SYS_ERROR ("can't create child pipe: pipe()");
+      for (int fd: childPipe)
+      {
+         fcntl (fd, F_SETFD, FD_CLOEXEC);
+         fcntl (fd, F_SETFL, O_NONBLOCK);
+      }
+
       struct sigaction sa {};
       sa.sa_sigaction = sighandler;
       sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
@@ -306,6 +440,19 @@ setupSignals ()
       }
    }
 
+   // SIGUSR1 dumps the stats (if enabled by -stats or -hud)
+   if (opts.stats)
+   {
+      struct sigaction sa {};
+      sa.sa_sigaction = sighandler;
+      sa.sa_flags = SA_SIGINFO | SA_RESTART;
+      if (sigaction (SIGUSR1, &sa, nullptr) < 0)
+      {
+         using zutty::printArgs;
+         SYS_ERROR ("can't install SIGUSR1 handler: sigaction()");
+      }
+   }
+
    // SIGINT and SIGQUIT might have inherited handlers if Zutty was launched
    // from an interactive Bash shell. Restore the default handlers to enable
    // normal functionality (e.g., terminate a program under Zutty with Ctrl-C);
@@ -327,12 +474,45 @@ setupSignals ()
    }
 }
 
+static void
+setEnv (std::vector <std::string>& env, const std::string& name,
+        const std::string& value)
+{
+   const std::string prefix = name + "=";
+   env.erase (std::remove_if (env.begin (), env.end (),
+                              [&prefix] (const std::string& var)
+                              { return var.compare (0, prefix.size (),
+                                                    prefix) == 0; }),
+              env.end ());
+   env.push_back (prefix + value);
+}
+
+/* Start the shell (or the command line argv) for the window win, in the
+ * directory cwd (if not empty), with the environment env (or our own).
+ */
 static int
-startShell (const char* const argv[])
+startShell (const char* const argv[], const std::string& cwd,
+            const std::vector <std::string>* env, Window win, pid_t& o_pid)
 {
    int ptyFd;
    pid_t pid;
 
+   // Set up everything beforehand, as there are threads of ours running
+   // (in server mode), so the child should do no more than exec.
+   std::vector <std::string> vars;
+   if (env)
+      vars = * env;
+   else
+      for (char** e = environ; * e; ++e)
+         vars.emplace_back (* e);
+   setEnv (vars, "TERM", "xterm-256color");
+   setEnv (vars, "WINDOWID", std::to_string (win));
+   setEnv (vars, "ZUTTY_VERSION", ZUTTY_VERSION);
+   std::vector <char*> envp;
+   for (std::string& var: vars)
+      envp.push_back (&var [0]);
+   envp.push_back (nullptr);
+
    pid = zutty::pty_fork (ptyFd, opts.nCols, opts.nRows);
 
    if (pid < 0)
@@ -341,19 +521,23 @@ startShell (const char* const argv[])
    }
    else if (pid == 0) // child:
    {
-      // N.B.: DISPLAY and WINDOWID are inherited from parent
-      // environment (set elsewhere)
-      if (setenv ("TERM", "xterm-256color", 1) < 0)
-         throw std::runtime_error ("can't setenv (TERM)");
-
-      if (execvp (argv[0], (char * const *) argv) < 0)
-         throw std::runtime_error (std::string ("can't execvp: ") + argv [0]);
+      // N.B.: DISPLAY is inherited from the parent environment (set
+      // elsewhere), or passed on by the client
+      if (!cwd.empty () && chdir (cwd.c_str ()) < 0)
+         fprintf (stderr, "Can't chdir to %s: %s\n",
+                  cwd.c_str (), strerror (errno));
+      environ = envp.data ();
+
+      execvp (argv[0], (char * const *) argv);
+      fprintf (stderr, "Can't execvp %s: %s\n", argv [0], strerror (errno));
+      _exit (127);
    }
    else // parent:
    {
       logT << "Shell subprocess started, pid: " << pid << std::endl;
    }
 
+   o_pid = pid;
    return ptyFd;
 }
 
@@ -380,8 +564,21 @@ convertKeyState (KeySym ks, unsigned int state)
    return mod;
 }
 
-static bool
-onKeyPress (XEvent& event, XIC& xic, int pty_fd)
+// Called on the main thread; the text is pasted on the parser thread
+void
+Terminal::pasteSelection (Time time)
+{
+   selMgr->getSelection (time,
+                         [this] (const SelectionManager::Text& chunk,
+                                 bool last)
+                         {
+                            onParser ([this, chunk, last]
+                                      { vt->pasteSelection (chunk, last); });
+                         });
+}
+
+bool
+Terminal::onKeyPress (XEvent& event)
 {
    using Key = VtKey;
    XKeyEvent& xkevt = event.xkey;
@@ -413,24 +610,39 @@ onKeyPress (XEvent& event, XIC& xic, int pty_fd)
    if ((ks == XK_Insert || ks == XK_KP_Insert) &&
        xkevt.state == ShiftMask)
    {
-      selMgr->getSelection (xkevt.time,
-                            [] (const std::string& s)
-                            { vt->pasteSelection (s); });
+      pasteSelection (xkevt.time);
+      return false;
+   }
+   // Shift+PageUp/Down are sent on if there is no scrollback to page
+   if (ks == XK_Page_Up && xkevt.state == ShiftMask)
+   {
+      onParser ([this] {
+         if (!vt->scrollbackPageUp ())
+            vt->writePty (Key::PageUp, VtModifier::shift);
+      });
+      return false;
+   }
+   if (ks == XK_Page_Down && xkevt.state == ShiftMask)
+   {
+      onParser ([this] {
+         if (!vt->scrollbackPageDown ())
+            vt->writePty (Key::PageDown, VtModifier::shift);
+      });
       return false;
    }
    if ((ks == XK_space || ks == XK_KP_Space) &&
        (xkevt.state & (Button1Mask | Button3Mask)))
    {
-      vt->selectRectangularModeToggle ();
+      onParser ([this] { vt->selectRectangularModeToggle (); });
       return false;
    }
 
    VtModifier mod = convertKeyState (ks, xkevt.state);
    switch (ks)
    {
-#define KEYSEND(XKey, VtKey)                    \
-      case XKey:                                \
-         vt->writePty (VtKey, mod);             \
+#define KEYSEND(XKey, VtKey)                                      \
+      case XKey:                                                  \
+         onParser ([this, mod] { vt->writePty (VtKey, mod); });   \
          return false
 
       KEYSEND (XK_0,                Key::K0);
@@ -550,41 +762,31 @@ onKeyPress (XEvent& event, XIC& xic, int pty_fd)
       {
          if (nbytes > 1)
          {
-            if (vt->writePty (buffer, true) < nbytes)
-               return true;
+            onParser ([this, str = std::string (buffer, nbytes)]
+                      { vt->writePty (str.c_str (), true); });
          }
          else
          {
-            if (vt->writePty (buffer [0], mod, true) < 1)
-               return true;
+            onParser ([this, ch = buffer [0], mod]
+                      { vt->writePty (ch, mod, true); });
          }
       }
       return false;
    }
 }
 
-// Data shared between mouse event handlers
-struct MouseContext
-{
-   // cycle selection SnapTo behaviour based on double/triple clicks
-   constexpr const static int Multi_Click_Threshold_Ms = 250;
-   Time lastButtonReleasedAt = 0;
-   unsigned int lastButtonReleased = 0;
-   bool selectionOngoing = false;
-};
-static MouseContext mouseCtx;
-
-static inline bool
-isMouseProtocol (unsigned int state, const MouseTrackingState& mouseTrk)
+inline bool
+Terminal::isMouseProtocol (unsigned int state,
+                           const MouseTrackingState& mouseTrk)
 {
    return !mouseCtx.selectionOngoing &&
       !(state & ShiftMask) &&
       mouseTrk.mode != MouseTrackingMode::Disabled;
 }
 
-static inline void
-mouseProtoSend (MouseTrackingEnc enc, int eventType, unsigned int modstate,
-                int button, int cx, int cy)
+inline void
+Terminal::mouseProtoSend (MouseTrackingEnc enc, int eventType,
+                          unsigned int modstate, int button, int cx, int cy)
 {
    int cb = 0;
    if (eventType == MotionNotify)
@@ -646,9 +848,9 @@ mouseProtoConvCoords (int px, int py, uint16_t& out_cx, uint16_t& out_cy)
    out_cy = std::max (0, (py - opts.border - 1) / fontpk->getPy ()) + 1;
 }
 
-static inline void
-onButtonPressMouseProto (XButtonEvent& xbevt,
-                         const MouseTrackingState& mouseTrk)
+inline void
+Terminal::onButtonPressMouseProto (XButtonEvent& xbevt,
+                                   const MouseTrackingState& mouseTrk)
 {
    uint16_t cx, cy;
 
@@ -673,9 +875,9 @@ onButtonPressMouseProto (XButtonEvent& xbevt,
    }
 }
 
-static inline void
-onButtonReleaseMouseProto (XButtonEvent& xbevt,
-                           const MouseTrackingState& mouseTrk)
+inline void
+Terminal::onButtonReleaseMouseProto (XButtonEvent& xbevt,
+                                     const MouseTrackingState& mouseTrk)
 {
    uint16_t cx, cy;
 
@@ -697,13 +899,13 @@ onButtonReleaseMouseProto (XButtonEvent& xbevt,
    }
 }
 
-static inline void
-onMotionNotifyMouseProto (XMotionEvent& xmoevt,
-                          const MouseTrackingState& mouseTrk)
+inline void
+Terminal::onMotionNotifyMouseProto (XMotionEvent& xmoevt,
+                                    const MouseTrackingState& mouseTrk)
 {
    uint16_t cx, cy;
-   static uint16_t lastCx = 65535;
-   static uint16_t lastCy = 65535;
+   uint16_t& lastCx = mouseCtx.lastCx;
+   uint16_t& lastCy = mouseCtx.lastCy;
 
    switch (mouseTrk.mode)
    {
@@ -726,8 +928,8 @@ onMotionNotifyMouseProto (XMotionEvent& xmoevt,
    }
 }
 
-static void
-onButtonPress (XButtonEvent& xbevt, bool& holdPtyIn)
+void
+Terminal::onButtonPress (XButtonEvent& xbevt)
 {
    const auto& mouseTrk = vt->getMouseTrackingState ();
    if (isMouseProtocol (xbevt.state, mouseTrk))
@@ -757,8 +959,8 @@ onButtonPress (XButtonEvent& xbevt, bool& holdPtyIn)
    }
 }
 
-static void
-onButtonRelease (XButtonEvent& xbevt, bool& holdPtyIn)
+void
+Terminal::onButtonRelease (XButtonEvent& xbevt)
 {
    const auto& mouseTrk = vt->getMouseTrackingState ();
    if (isMouseProtocol (xbevt.state, mouseTrk))
@@ -774,17 +976,16 @@ onButtonRelease (XButtonEvent& xbevt, bool& holdPtyIn)
    {
    case 1: case 3:
    {
-      std::string utf8_sel;
+      SelectedText::Ptr sel;
       holdPtyIn = false;
       mouseCtx.selectionOngoing = false;
-      if (vt->selectFinish (utf8_sel))
-         selMgr->setSelection (xbevt.time, utf8_sel);
+      if (vt->selectFinish (sel))
+         onX11 ([this, time = xbevt.time, sel]
+                { selMgr->setSelection (time, sel); });
    }
    break;
    case 2:
-      selMgr->getSelection (xbevt.time,
-                            [] (const std::string& s)
-                            { vt->pasteSelection (s); });
+      onX11 ([this, time = xbevt.time] { pasteSelection (time); });
       break;
    case 4: vt->mouseWheelUp (); break;
    case 5: vt->mouseWheelDown (); break;
@@ -792,8 +993,8 @@ onButtonRelease (XButtonEvent& xbevt, bool& holdPtyIn)
    }
 }
 
-static void
-onMotionNotify (XMotionEvent& xmoevt)
+void
+Terminal::onMotionNotify (XMotionEvent& xmoevt)
 {
    const auto& mouseTrk = vt->getMouseTrackingState ();
    if (isMouseProtocol (xmoevt.state, mouseTrk))
@@ -802,12 +1003,10 @@ onMotionNotify (XMotionEvent& xmoevt)
       vt->selectUpdate (xmoevt.x, xmoevt.y);
 }
 
-static bool
-x11Event (XEvent& event, XIC& xic, int pty_fd, bool& destroyed, bool& holdPtyIn)
+bool
+Terminal::x11Event (XEvent& event)
 {
-   static bool exposed = false;
    bool redraw = false;
-   destroyed = false;
 
    switch (event.type) {
    case Expose:
@@ -818,7 +1017,6 @@ x11Event (XEvent& event, XIC& xic, int pty_fd, bool& destroyed, bool& holdPtyIn)
       if ((unsigned long) event.xclient.data.l [0] == wmDeleteMessage)
       {
          logT << "WM Delete message" << std::endl;
-         destroyed = true;
          return true;
       }
       else
@@ -827,9 +1025,19 @@ x11Event (XEvent& event, XIC& xic, int pty_fd, bool& destroyed, bool& holdPtyIn)
       }
       break;
    case ConfigureNotify:
-      vt->resize (event.xconfigure.width, event.xconfigure.height);
+   {
+      const uint32_t size = (uint32_t)event.xconfigure.width << 16 |
+                            (uint16_t)event.xconfigure.height;
+      if (pendingSize.exchange (size))
+         break; // the resize already posted will use this size
+      onParser ([this]
+                {
+                   const uint32_t size = pendingSize.exchange (0);
+                   vt->resize (size >> 16, size & 0xffff);
+                });
       redraw = true;
       break;
+   }
    case ReparentNotify:
       logT << "ReparentNotify" << std::endl;
       redraw = true;
@@ -848,33 +1056,40 @@ x11Event (XEvent& event, XIC& xic, int pty_fd, bool& destroyed, bool& holdPtyIn)
       destroyed = true;
       return true;
    case KeyPress:
-      return onKeyPress (event, xic, pty_fd);
+      return onKeyPress (event);
    case KeyRelease:
       break;
    case ButtonPress:
-      onButtonPress (event.xbutton, holdPtyIn);
+      onParser ([this, xbevt = event.xbutton] () mutable
+                { onButtonPress (xbevt); });
       break;
    case ButtonRelease:
-      onButtonRelease (event.xbutton, holdPtyIn);
+      onParser ([this, xbevt = event.xbutton] () mutable
+                { onButtonRelease (xbevt); });
       break;
    case MotionNotify:
-      onMotionNotify (event.xmotion);
+      onParser ([this, xmoevt = event.xmotion] () mutable
+                { onMotionNotify (xmoevt); });
       break;
    case FocusIn:
-      if (vt->getMouseTrackingState ().focusEventMode)
-         vt->writePty ("\e[I");
-      vt->setHasFocus (true);
+      onParser ([this] {
+         if (vt->getMouseTrackingState ().focusEventMode)
+            vt->writePty ("\e[I");
+         vt->setHasFocus (true);
+      });
       break;
    case FocusOut:
-      if (vt->getMouseTrackingState ().focusEventMode)
-         vt->writePty ("\e[O");
-      vt->setHasFocus (false);
+      onParser ([this] {
+         if (vt->getMouseTrackingState ().focusEventMode)
+            vt->writePty ("\e[O");
+         vt->setHasFocus (false);
+      });
       break;
    case PropertyNotify:
       selMgr->onPropertyNotify (event.xproperty);
       break;
    case SelectionClear:
-      vt->selectClear ();
+      onParser ([this] { vt->selectClear (); });
       selMgr->onSelectionClear (event.xselectionclear);
       break;
    case SelectionNotify:
@@ -889,57 +1104,66 @@ x11Event (XEvent& event, XIC& xic, int pty_fd, bool& destroyed, bool& holdPtyIn)
    }
 
    if (exposed && redraw) {
-      vt->redraw ();
+      onParser ([this] { vt->redraw (); });
    }
 
    return false;
 }
 
-static bool
-eventLoop (Display* dpy, Window win, XIC& xic, int pty_fd)
+/* The parser thread: process the output of the shell, and the commands
+ * posted from the main thread. Its end (on the shell exiting) closes the
+ * window as well.
+ */
+void
+Terminal::parserLoop ()
 {
-   int x11_fd = XConnectionNumber (dpy);
-   logT << "x11_fd = " << x11_fd << std::endl;
-   logT << "pty_fd = " << pty_fd << std::endl;
+   // Leave the signals (SIGCHLD in particular) to the main thread
+   sigset_t sigs;
+   sigfillset (&sigs);
+   pthread_sigmask (SIG_BLOCK, &sigs, nullptr);
 
    struct pollfd pollset[] = {
-      {pty_fd, POLLIN, 0},
-      {x11_fd, POLLIN, 0},
+      {ptyFd, POLLIN, 0},
+      {parserQueue.fd (), POLLIN, 0},
    };
 
-   bool holdPtyIn = false;
-   while (1) {
-      pollset [0].fd = holdPtyIn ? -pty_fd : pty_fd;
+   while (!parserDone) {
+      // Reading is held while selecting, writing waits for the pty to take
+      // the queued output; neither waits for the other, so a shell that
+      // is not reading its input cannot stall its output (or the reverse).
+      pollset [0].events = (holdPtyIn ? 0 : POLLIN) |
+                           (vt->isOutputPending () ? POLLOUT : 0);
       if (poll (pollset, 2, -1) < 0)
-         return false;
+      {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
 
       if (pollset[0].revents & POLLHUP)
-         return false;
-
-      if (pollset[0].revents & POLLIN)
-         vt->readPty ();
+         break;
 
       if (pollset[1].revents & POLLIN)
-         while (XPending (dpy))
-         {
-            XEvent event;
-            bool destroyed = false;
+         parserQueue.run ();
 
-            XNextEvent (dpy, &event);
-            if (x11Event (event, xic, pty_fd, destroyed, holdPtyIn))
-               return destroyed;
-         }
+      if (!parserDone && (pollset[0].revents & POLLOUT))
+         vt->flushPty ();
+
+      if (!parserDone && (pollset[0].revents & POLLIN))
+         vt->readPty ();
    }
+
+   onX11 ([this] { finished = true; });
 }
 
-static void
-handleOsc (Display* dpy, Window win, int cmd, const std::string& arg)
+void
+Terminal::handleOsc (int cmd, const std::string& arg)
 {
    switch (cmd)
    {
    case 0: // Change Icon Name & Window Title
    case 2: // Change Window Title
-      XStoreName (dpy, win, arg.c_str ());
+      XStoreName (xDpy, win, arg.c_str ());
       break;
    case 52: // Manipulate Selection Data
    {
@@ -956,13 +1180,19 @@ handleOsc (Display* dpy, Window win, int cmd, const std::string& arg)
 
       if (pd == "?")
       {
+         auto text = std::make_shared <std::string> ();
          selMgr->getSelection (
             CurrentTime,
-            [] (const std::string& s)
+            [this, text] (const SelectionManager::Text& chunk, bool last)
             {
+               if (chunk)
+                  text->append (*chunk);
+               if (!last)
+                  return;
                std::ostringstream oss;
-               oss << "\e]52;;" << zutty::base64::encode (s) << "\e\\";
-               vt->writePty (oss.str ().c_str ());
+               oss << "\e]52;;" << zutty::base64::encode (*text) << "\e\\";
+               onParser ([this, reply = oss.str ()]
+                         { vt->writePty (reply.c_str ()); });
             });
       }
       else
@@ -1020,6 +1250,250 @@ printGLInfo (EGLDisplay egl_dpy)
              << std::endl;
 }
 
+Terminal::Terminal (const char* const argv[], const char* title,
+                    const std::string& cwd,
+                    const std::vector <std::string>* env)
+{
+   const int winWidth = 2 * opts.border + opts.nCols * fontpk->getPx ();
+   const int winHeight = 2 * opts.border + opts.nRows * fontpk->getPy ();
+
+   makeWindow (title, winWidth, winHeight, win, eglSurf);
+
+   try
+   {
+      ptyFd = startShell (argv, cwd, env, win, pid);
+   }
+   catch (...)
+   {
+      eglDestroySurface (eglDpy, eglSurf);
+      XDestroyWindow (xDpy, win);
+      throw;
+   }
+
+   XMapWindow (xDpy, win);
+
+   if (xim && ximStyle)
+   {
+      xic = XCreateIC (xim, XNInputStyle, ximStyle,
+                       XNClientWindow, win, XNFocusWindow, win,
+                       nullptr);
+
+      if (xic == nullptr)
+      {
+         logW << "XCreateIC failed, compose key won't work" << std::endl;
+      }
+   }
+
+   selMgr = std::make_unique <SelectionManager> (xDpy, win);
+
+   renderer = std::make_unique <Renderer> (
+      * renderThread,
+      [surf = eglSurf] ()
+      {
+         if (!eglMakeCurrent (eglDpy, surf, surf, eglCtx))
+            throw std::runtime_error ("Error: eglMakeCurrent() failed");
+         // cap rendering at the display refresh rate; a server does not
+         // wait for it, as that would hold up drawing the other windows
+         eglSwapInterval (eglDpy, opts.server ? 0 : 1);
+
+         static bool glInfoShown = false; // only on the render thread
+         if (opts.glinfo && !glInfoShown)
+         {
+            glInfoShown = true;
+            printGLInfo (eglDpy);
+         }
+      },
+      [surf = eglSurf] ()
+      {
+         eglSwapBuffers (eglDpy, surf);
+      });
+
+   vt = std::make_unique <Vterm> (fontpk->getPx (), fontpk->getPy (),
+                                  winWidth, winHeight, ptyFd);
+   vt->setRefreshHandler ([this] (const zutty::Frame& f)
+                          { renderer->update (f); });
+   vt->setOscHandler ([this] (int cmd, const std::string& arg)
+                      { onX11 ([this, cmd, arg] { handleOsc (cmd, arg); }); });
+   if (opts.record)
+   {
+      // one file for each window of a server
+      std::string path = opts.record;
+      if (opts.server)
+         path += "." + std::to_string (pid);
+      try
+      {
+         vt->startCapture (path);
+      }
+      catch (const std::exception& e)
+      {
+         logE << "Cannot record the session: " << e.what () << std::endl;
+      }
+   }
+
+   // We might not get a ConfigureNotify event when the window first appears:
+   vt->resize (winWidth, winHeight);
+
+   parser = std::thread (&Terminal::parserLoop, this);
+}
+
+Terminal::~Terminal ()
+{
+   parser.join ();
+
+   renderer = nullptr; // returns once the render thread is done with it
+   vt = nullptr;
+   selMgr = nullptr;
+   close (ptyFd);
+
+   eglDestroySurface (eglDpy, eglSurf);
+   if (xic)
+      XDestroyIC (xic);
+   if (! destroyed)
+      XDestroyWindow (xDpy, win);
+}
+
+static void
+openTerminal (const char* const argv[], const char* title,
+              const std::string& cwd = "",
+              const std::vector <std::string>* env = nullptr)
+{
+   Terminal* term = new Terminal (argv, title, cwd, env);
+   terminals [term->win] = term;
+}
+
+static void
+closeTerminal (Terminal* term)
+{
+   terminals.erase (term->win);
+   delete term;
+
+   if (terminals.empty () && !opts.server)
+      x11Done = true;
+}
+
+// Open a window as asked by a client; returns the error, if any
+static std::string
+onWindowRequest (const zutty::WindowRequest& req)
+{
+   std::vector <const char*> argv;
+   for (const std::string& arg: req.argv)
+      argv.push_back (arg.c_str ());
+   if (argv.empty ())
+      argv.push_back (opts.shell);
+   argv.push_back (nullptr);
+
+   const char* title = req.title.empty () ? opts.title : req.title.c_str ();
+   try
+   {
+      openTerminal (argv.data (), title, req.cwd, &req.env);
+   }
+   catch (const std::exception& e)
+   {
+      return e.what ();
+   }
+   return "";
+}
+
+static void
+reapChildren ()
+{
+   char buf [64];
+   while (read (childPipe [0], buf, sizeof (buf)) > 0)
+      ;
+
+   pid_t pid;
+   while ((pid = waitpid (-1, nullptr, WNOHANG)) > 0)
+      for (const auto& it: terminals)
+         if (it.second->pid == pid)
+            it.second->requestClose ();
+}
+
+static void
+dispatchEvent (XEvent& event)
+{
+   auto it = terminals.find (event.xany.window);
+   if (it != terminals.end ())
+   {
+      // N.B.: a PropertyNotify may also be of an ongoing INCR transfer
+      // (of a selection owned by another window of ours)
+      if (event.type == PropertyNotify)
+         for (const auto& other: terminals)
+            if (other.second != it->second)
+               other.second->selMgr->onPropertyNotify (event.xproperty);
+
+      if (it->second->x11Event (event))
+         it->second->requestClose ();
+   }
+   else if (event.type == PropertyNotify)
+   {
+      // on the window of a client receiving a selection in INCR chunks
+      for (const auto& other: terminals)
+         other.second->selMgr->onPropertyNotify (event.xproperty);
+   }
+}
+
+static void
+eventLoop (zutty::Server* server)
+{
+   int x11_fd = XConnectionNumber (xDpy);
+   logT << "x11_fd = " << x11_fd << std::endl;
+
+   std::vector <struct pollfd> pollset;
+   std::vector <Terminal*> polled;
+   while (!x11Done) {
+      // N.B.: XPending () also flushes the requests of commands run below
+      while (XPending (xDpy))
+      {
+         XEvent event;
+         XNextEvent (xDpy, &event);
+         dispatchEvent (event);
+      }
+
+      pollset = {
+         {x11_fd, POLLIN, 0},
+         {childPipe [0], POLLIN, 0},
+      };
+      polled.clear ();
+      for (const auto& it: terminals)
+      {
+         pollset.push_back ({it.second->x11Queue.fd (), POLLIN, 0});
+         polled.push_back (it.second);
+      }
+      const size_t serverFds = pollset.size ();
+      if (server)
+         server->addPollFds (pollset);
+
+      const int rc = poll (pollset.data (), pollset.size (),
+                           server ? server->pollTimeout () : -1);
+      if (statsDumpRequested)
+      {
+         statsDumpRequested = 0;
+         plog (zlog, "I") << zutty::stats.report () << std::endl;
+      }
+      if (rc < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         logE << "poll: " << strerror (errno) << std::endl;
+         return;
+      }
+
+      if (pollset[1].revents & POLLIN)
+         reapChildren ();
+
+      if (server)
+         server->handle (&pollset [serverFds], onWindowRequest);
+
+      for (size_t k = 0; k < polled.size (); ++k)
+         if (pollset [k + 2].revents & POLLIN)
+            polled [k]->x11Queue.run ();
+
+      for (Terminal* term: polled)
+         if (term->finished)
+            closeTerminal (term);
+   }
+}
+
 static int
 handleXError (Display* dpy, XErrorEvent* ev)
 {
@@ -1027,7 +1501,7 @@ handleXError (Display* dpy, XErrorEvent* ev)
    XmuPrintDefaultErrorMessage(dpy, ev, stdout);
    fflush (stdout);
 
-   renderer = nullptr; // ~Renderer () shuts down renderer thread
+   renderThread = nullptr; // ~RenderThread () shuts down renderer thread
    exit (1);
    return 0;
 }
@@ -1039,24 +1513,57 @@ handleXIOError (Display* dpy)
    logE << "Fatal IO error " << err << " (" << strerror (err)
         << ") on X server " << DisplayString (dpy) << std::endl;
 
-   renderer = nullptr; // ~Renderer () shuts down renderer thread
+   renderThread = nullptr; // ~RenderThread () shuts down renderer thread
    exit (1);
    return 0;
 }
 
+// Ask the server to open a window, with the command line given to us
+static int
+runClient (int argc, char* argv[])
+{
+   zutty::WindowRequest req;
+   if (argc > 1 && strcmp (argv [1], "-e") == 0)
+   {
+      req.argv.assign (argv + 2, argv + argc);
+      if (!req.argv.empty ())
+         req.title = req.argv [0];
+   }
+   else if (argc == 2)
+   {
+      char progPath [PATH_MAX];
+      strncpy (progPath, argv [1], PATH_MAX-1);
+      progPath [PATH_MAX-1] = '\0';
+      validateShell (progPath);
+      req.argv.push_back (progPath);
+   }
+
+   char cwd [PATH_MAX];
+   if (getcwd (cwd, sizeof (cwd)))
+      req.cwd = cwd;
+   for (char** e = environ; * e; ++e)
+      req.env.push_back (* e);
+
+   try
+   {
+      const std::string error =
+         zutty::requestWindow (zutty::serverSocketPath (opts.display), req);
+      if (error.empty ())
+         return 0;
+      std::cout << "Error: " << error << std::endl;
+   }
+   catch (const std::exception& e)
+   {
+      std::cout << "Error: " << e.what () << std::endl;
+   }
+   return -1;
+}
+
 int
 main (int argc, char* argv[])
 {
-   Display* x_dpy = nullptr;
-   Window win;
-   EGLSurface egl_surf;
-   EGLContext egl_ctx;
-   EGLDisplay egl_dpy;
    EGLint egl_major, egl_minor;
-   XIC xic = nullptr;
-   XIM xim;
    XIMStyles* xim_styles;
-   XIMStyle xim_style = 0;
    char* modifiers;
    char* imvalret;
    int i;
@@ -1093,23 +1600,51 @@ main (int argc, char* argv[])
 
    opts.initialize (&argc, argv);
 
-   x_dpy = XOpenDisplay (opts.display);
-   if (!x_dpy)
+   if (opts.bench)
+   {
+      opts.parse ();
+      return zutty::runBench (opts.bench);
+   }
+   if (opts.replay)
+   {
+      opts.parse ();
+      return zutty::runReplay (opts.replay, opts.realtime);
+   }
+
+   // the options are those of the server
+   if (opts.client)
+      return runClient (argc, argv);
+
+   xDpy = XOpenDisplay (opts.display);
+   if (!xDpy)
    {
       std::cout << "Error: couldn't open display " << opts.display << std::endl;
       return -1;
    }
-   opts.setDisplay (x_dpy);
+   opts.setDisplay (xDpy);
 
    opts.parse ();
 
    if (opts.verbose)
       opts.printVersion ();
 
-   if (setenv ("ZUTTY_VERSION", ZUTTY_VERSION, 1) < 0)
+   std::unique_ptr <zutty::Server> server;
+   if (opts.server)
    {
-      logE << "Can't setenv (ZUTTY_VERSION)" << std::endl;
-      exit (1);
+      if (argc > 1)
+      {
+         logW << "Ignoring the command line in server mode" << std::endl;
+      }
+      try
+      {
+         server = std::make_unique <zutty::Server> (
+            zutty::serverSocketPath (opts.display));
+      }
+      catch (const std::exception& e)
+      {
+         logE << e.what () << std::endl;
+         return -1;
+      }
    }
 
    char progPath [PATH_MAX];
@@ -1127,16 +1662,15 @@ main (int argc, char* argv[])
       validateShell (progPath);
    }
    setupSignals ();
-   int pty_fd = startShell (shArgv);
 
-   egl_dpy = eglGetDisplay ((EGLNativeDisplayType)x_dpy);
-   if (!egl_dpy)
+   eglDpy = eglGetDisplay ((EGLNativeDisplayType)xDpy);
+   if (!eglDpy)
    {
       logE << "eglGetDisplay() failed" << std::endl;
       return -1;
    }
 
-   if (!eglInitialize (egl_dpy, &egl_major, &egl_minor))
+   if (!eglInitialize (eglDpy, &egl_major, &egl_minor))
    {
       logE << "eglInitialize() failed" << std::endl;
       return -1;
@@ -1149,7 +1683,7 @@ main (int argc, char* argv[])
       return -1;
    }
 
-   xim = XOpenIM (x_dpy, nullptr, nullptr, nullptr);
+   xim = XOpenIM (xDpy, nullptr, nullptr, nullptr);
    if (xim == nullptr)
    {
       logW << "XOpenIM failed" << std::endl;
@@ -1164,18 +1698,18 @@ main (int argc, char* argv[])
       }
 
       if (xim_styles) {
-         xim_style = 0;
+         ximStyle = 0;
          for (i = 0;  i < xim_styles->count_styles;  i++)
          {
             if (xim_styles->supported_styles [i] ==
                 (XIMPreeditNothing | XIMStatusNothing))
             {
-               xim_style = xim_styles->supported_styles [i];
+               ximStyle = xim_styles->supported_styles [i];
                break;
             }
          }
 
-         if (xim_style == 0)
+         if (ximStyle == 0)
          {
             logW << "Insufficient input method support" << std::endl;
          }
@@ -1185,68 +1719,22 @@ main (int argc, char* argv[])
 
    fontpk = std::make_unique <Fontpack> (opts.fontpath, opts.fontname);
 
-   int win_width = 2 * opts.border + opts.nCols * fontpk->getPx ();
-   int win_height = 2 * opts.border + opts.nRows * fontpk->getPy ();
-
-   make_x_window (x_dpy, egl_dpy, opts.title, win_width, win_height,
-                  &win, &egl_ctx, &egl_surf);
-
-   XMapWindow (x_dpy, win);
-
-   if (xim && xim_style)
-   {
-      xic = XCreateIC (xim, XNInputStyle, xim_style,
-                       XNClientWindow, win, XNFocusWindow, win,
-                       nullptr);
-
-      if (xic == nullptr)
-      {
-         logW << "XCreateIC failed, compose key won't work" << std::endl;
-      }
-   }
-
-   if (!eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT))
-   {
-      logE << "eglMakeCurrent() failed" << std::endl;
-      return -1;
-   }
+   setupEgl ();
 
-   selMgr = std::make_unique <zutty::SelectionManager> (x_dpy, win);
+   renderThread = std::make_unique <RenderThread> (fontpk.get ());
 
-   renderer = std::make_unique <Renderer> (
-      [egl_dpy, egl_surf, egl_ctx] ()
-      {
-         if (!eglMakeCurrent (egl_dpy, egl_surf, egl_surf, egl_ctx))
-            throw std::runtime_error ("Error: eglMakeCurrent() failed");
-         if (opts.glinfo)
-            printGLInfo (egl_dpy);
-      },
-      [egl_dpy, egl_surf] ()
-      {
-         eglSwapBuffers (egl_dpy, egl_surf);
-      },
-      fontpk.get ());
+   if (!server)
+      openTerminal (shArgv, opts.title);
 
-   vt = std::make_unique <Vterm> (fontpk->getPx (), fontpk->getPy (),
-                                  win_width, win_height, pty_fd);
-   vt->setRefreshHandler ([] (const zutty::Frame& f) { renderer->update (f); });
-   vt->setOscHandler ([&] (int cmd, const std::string& arg)
-                      { handleOsc (x_dpy, win, cmd, arg); });
+   eventLoop (server.get ());
 
-   // We might not get a ConfigureNotify event when the window first appears:
-   vt->resize (win_width, win_height);
-
-   bool destroyed = eventLoop (x_dpy, win, xic, pty_fd);
+   renderThread = nullptr; // ~RenderThread () shuts down renderer thread
 
-   renderer = nullptr; // ~Renderer () shuts down renderer thread
+   eglDestroyContext (eglDpy, eglCtx);
+   eglTerminate (eglDpy);
 
-   eglDestroyContext (egl_dpy, egl_ctx);
-   eglDestroySurface (egl_dpy, egl_surf);
-   eglTerminate (egl_dpy);
-
-   if (! destroyed)
-      XDestroyWindow (x_dpy, win);
-   XCloseDisplay (x_dpy);
+   XFree (xVisual);
+   XCloseDisplay (xDpy);
 
    return 0;
 }
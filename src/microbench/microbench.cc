@@ -0,0 +1,371 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+/* Microbenchmarks of the hot spots of the Vterm, built on the headless
+ * terminal library (no GL or X needed). Each benchmark prints one line
+ * of JSON with its results. Usage:
+ *
+ *   zutty-microbench [name-substring ...]
+ *
+ * to only run the benchmarks with names containing any of the given
+ * substrings (e.g., "processInput" or "sgr").
+ */
+
+#include "frame.h"
+#include "options.h"
+#include "vterm.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// The library reads its settings from here, normally parsed by options.cc
+zutty::Options opts;
+
+namespace {
+
+   using namespace zutty;
+
+   using Clock = std::chrono::steady_clock;
+
+   constexpr const uint16_t nCols = 160;
+   constexpr const uint16_t nRows = 48;
+   constexpr const uint16_t glyphPx = 8;
+   constexpr const uint16_t glyphPy = 16;
+   constexpr const uint16_t winPx = nCols * glyphPx;
+   constexpr const uint16_t winPy = nRows * glyphPy;
+   constexpr const size_t streamSize = 1 << 20;
+
+   // Each benchmark is repeated until it has run for at least this long
+   constexpr const Clock::duration minDuration =
+      std::chrono::milliseconds (500);
+
+   void
+   setupOptions ()
+   {
+      opts.border = 0;
+      opts.fg = {255, 255, 255};
+      opts.bg = {0, 0, 0};
+      opts.title = "Zutty";
+      opts.saveLines = 50000;
+      opts.saveLinesRaw = 1000;
+      opts.readSize = 65536;
+      opts.sliceTime = 10;
+      opts.altScrollMode = false;
+      opts.boldAsBright = true;
+      opts.quiet = true; // only the results go to stdout
+      opts.verbose = false;
+   }
+
+   std::vector <std::string> filters;
+
+   bool
+   selected (const std::string& name)
+   {
+      if (filters.empty ())
+         return true;
+      for (const auto& f: filters)
+         if (name.find (f) != std::string::npos)
+            return true;
+      return false;
+   }
+
+   // Run op until minDuration is reached and print the time per op; if
+   // bytesPerOp is given, also the throughput.
+   void
+   bench (const std::string& name, size_t bytesPerOp,
+          const std::function <void ()>& op)
+   {
+      if (!selected (name))
+         return;
+
+      op (); // warm up
+      uint64_t nOps = 0;
+      const Clock::time_point start = Clock::now ();
+      Clock::duration elapsed;
+      do
+      {
+         op ();
+         ++nOps;
+         elapsed = Clock::now () - start;
+      }
+      while (elapsed < minDuration);
+
+      const double secs = std::chrono::duration <double> (elapsed).count ();
+      std::cout << std::fixed << std::setprecision (3)
+                << "{\"name\": \"" << name << "\""
+                << ", \"ops\": " << nOps
+                << ", \"nsPerOp\": " << secs * 1e9 / nOps;
+      if (bytesPerOp)
+         std::cout << ", \"mbPerSec\": " << bytesPerOp * nOps / secs / 1e6;
+      std::cout << "}" << std::endl;
+   }
+
+   void
+   appendUtf8 (std::string& out, uint32_t cp)
+   {
+      if (cp < 0x80)
+         out += (char)cp;
+      else if (cp < 0x800)
+      {
+         out += (char)(0xc0 | (cp >> 6));
+         out += (char)(0x80 | (cp & 0x3f));
+      }
+      else
+      {
+         out += (char)(0xe0 | (cp >> 12));
+         out += (char)(0x80 | ((cp >> 6) & 0x3f));
+         out += (char)(0x80 | (cp & 0x3f));
+      }
+   }
+
+   // Build a stream of about streamSize bytes out of lines made by
+   // calling addToLine (line, k) for k = 0, 1, ... until it returns false.
+   std::string
+   makeStream (const std::function <bool (std::string&, int)>& addToLine)
+   {
+      std::string stream;
+      stream.reserve (streamSize + 4096);
+      int k = 0;
+      while (stream.size () < streamSize)
+      {
+         std::string line;
+         while (addToLine (line, k++))
+            ;
+         stream += line + "\r\n";
+      }
+      return stream;
+   }
+
+   std::string
+   asciiStream ()
+   {
+      return makeStream (
+         [] (std::string& line, int k)
+         {
+            line += (char)(' ' + 1 + k % 94);
+            return line.size () < nCols - 8;
+         });
+   }
+
+   std::string
+   sgrStream ()
+   {
+      static const char* sgrs [] = {
+         "\e[0m", "\e[1m", "\e[31m", "\e[1;32m", "\e[4;33;44m", "\e[7m",
+         "\e[38;5;208m", "\e[48;5;17m", "\e[22;24;27m", "\e[39;49m"
+      };
+      return makeStream (
+         [] (std::string& line, int k)
+         {
+            line += sgrs [k % 10];
+            line += "word";
+            line += (char)('a' + k % 26);
+            line += ' ';
+            return k % 24 != 23;
+         });
+   }
+
+   std::string
+   cjkStream ()
+   {
+      return makeStream (
+         [] (std::string& line, int k)
+         {
+            appendUtf8 (line, 0x4e00 + (k * 37) % 0x5000);
+            return k % (nCols - 8) != nCols - 9;
+         });
+   }
+
+   std::string
+   truecolorStream ()
+   {
+      return makeStream (
+         [] (std::string& line, int k)
+         {
+            line += "\e[38;2;" + std::to_string (k % 256) + ";" +
+               std::to_string ((k * 7) % 256) + ";" +
+               std::to_string ((k * 13) % 256) + "m\e[48;2;" +
+               std::to_string ((k * 3) % 256) + ";" +
+               std::to_string ((k * 5) % 256) + ";" +
+               std::to_string ((k * 11) % 256) + "m#";
+            return k % (nCols - 8) != nCols - 9;
+         });
+   }
+
+   // Insert and delete lines in a scrolling region, interleaved with
+   // some text (as a full-screen editor would do).
+   std::string
+   insertDeleteStream ()
+   {
+      std::string stream = "\e[5;" + std::to_string (nRows - 4) + "r";
+      for (int k = 0; stream.size () < streamSize; ++k)
+      {
+         stream += "\e[" + std::to_string (5 + k % 20) + "H\e[" +
+            std::to_string (1 + k % 3) + (k % 2 ? "L" : "M") +
+            "inserted or deleted some lines";
+      }
+      return stream + "\e[r";
+   }
+
+   // Clear the screen and paint a few lines of it, as full-screen
+   // programs do: erase in display and line, erase and repeat characters.
+   std::string
+   eraseStream ()
+   {
+      std::string stream;
+      for (int k = 0; stream.size () < streamSize; ++k)
+      {
+         stream += "\e[H\e[2J\e[" + std::to_string (1 + k % nRows) +
+            "Hstatus\e[K\e[" + std::to_string (k % 40) + "X-\e[" +
+            std::to_string (nCols / 2) + "b";
+      }
+      return stream;
+   }
+
+   // Plain text scrolling the whole screen (into the scrollback)
+   std::string
+   scrollStream ()
+   {
+      return makeStream (
+         [] (std::string& line, int k)
+         {
+            line += "line " + std::to_string (k);
+            return false;
+         });
+   }
+
+   void
+   benchProcessInput (const std::string& name, const std::string& stream)
+   {
+      const int devNull = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+      Vterm vt (glyphPx, glyphPy, winPx, winPy, devNull);
+      const unsigned char* data = (const unsigned char*)stream.data ();
+      bench (name, stream.size (),
+             [&] ()
+             {
+                // in chunks, as readPty () would read them
+                for (size_t pos = 0; pos < stream.size ();
+                     pos += opts.readSize)
+                {
+                   vt.processInput (data + pos, std::min (
+                      (size_t)opts.readSize, stream.size () - pos));
+                }
+             });
+      close (devNull);
+   }
+
+   void
+   benchDeltaCopyCells ()
+   {
+      Frame frames [2] = {Frame (winPx, winPy, nCols, nRows),
+                          Frame (winPx, winPy, nCols, nRows)};
+      for (uint32_t k = 0; k < (uint32_t)nCols * nRows; ++k)
+      {
+         frames [0][k].uc_pt = 'a' + k % 26;
+         frames [1][k].uc_pt = 'A' + k % 26;
+         frames [1][k].attr = AttrTable::inverseId;
+      }
+      std::vector <Cell> dst (nCols * nRows);
+      std::vector <uint8_t> dirtyRows (nRows);
+
+      // Full damage, with none or all of the cells actually changed
+      int k = 0;
+      for (bool changed: {false, true})
+      {
+         bench (changed ? "deltaCopyCells/changed"
+                        : "deltaCopyCells/unchanged",
+                0,
+                [&] ()
+                {
+                   Frame& f = frames [changed ? k++ % 2 : 0];
+                   f.damage.reset ();
+                   f.damage.add (0, nCols * nRows);
+                   f.deltaCopyCells (dst.data (), dirtyRows.data ());
+                });
+      }
+   }
+
+   // Reflow a full screen of wrapped lines, as one step of a window drag
+   void
+   benchResize ()
+   {
+      Frame frame (winPx, winPy, nCols, nRows);
+      for (uint32_t k = 0; k < (uint32_t)nCols * nRows; ++k)
+      {
+         frame [k].uc_pt = 'a' + k % 26;
+         if (k % nCols == nCols - 1 && k / nCols % 4 != 3)
+            frame [k].wrap = 1;
+      }
+
+      int k = 0;
+      bench ("Frame::resize/reflow", 0,
+             [&] ()
+             {
+                const uint16_t dx = ++k % 2;
+                uint16_t pY = nRows - 1, pX = 0;
+                frame.resize (winPx - dx * glyphPx, winPy,
+                              nCols - dx, nRows, pY, pX);
+             });
+   }
+
+   void
+   benchSelectFinish ()
+   {
+      const int devNull = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+      Vterm vt (glyphPx, glyphPy, winPx, winPy, devNull);
+      const std::string stream = asciiStream ();
+      vt.processInput ((const unsigned char*)stream.data (),
+                       std::min (stream.size (), (size_t)nCols * nRows));
+
+      SelectedText::Ptr sel;
+      std::string utf8_sel;
+      bench ("selectFinish/fullScreen", 0,
+             [&] ()
+             {
+                vt.selectStart (0, 0, false);
+                vt.selectExtend (winPx - 1, winPy - 1, false);
+                vt.selectFinish (sel);
+                sel->toUtf8 (utf8_sel);
+                sel = nullptr;
+             });
+      close (devNull);
+   }
+
+} // namespace
+
+int
+main (int argc, char* argv[])
+{
+   setupOptions ();
+   for (int k = 1; k < argc; ++k)
+      filters.push_back (argv [k]);
+
+   benchProcessInput ("processInput/ascii", asciiStream ());
+   benchProcessInput ("processInput/sgr", sgrStream ());
+   benchProcessInput ("processInput/cjk", cjkStream ());
+   benchProcessInput ("processInput/scroll", scrollStream ());
+   benchProcessInput ("csi_SGR/truecolor", truecolorStream ());
+   benchProcessInput ("insertRows+deleteRows", insertDeleteStream ());
+   benchProcessInput ("eraseRows+eraseRange", eraseStream ());
+   benchDeltaCopyCells ();
+   benchResize ();
+   benchSelectFinish ();
+
+   return 0;
+}
@@ -87,6 +87,22 @@ namespace {
       return strcmp (opt, "true") == 0;
    }
 
+   void
+   convBackend (Backend& outBackend)
+   {
+      const char* opt = get ("backend");
+      if (!opt)
+         throw std::runtime_error ("-backend: missing value");
+
+      if (strcmp (opt, "compute") == 0)
+         outBackend = Backend::compute;
+      else if (strcmp (opt, "fragment") == 0)
+         outBackend = Backend::fragment;
+      else
+         throw std::runtime_error ("-backend: expected one of: "
+                                   "compute, fragment");
+   }
+
    void
    convBorder (uint16_t& outBorder)
    {
@@ -152,6 +168,23 @@ namespace {
       }
    }
 
+   void
+   convUint32 (const char* name, uint32_t& outValue)
+   {
+      const char* opt = get (name);
+      if (!opt)
+         throw std::runtime_error (std::string ("-") + name +
+                                   ": missing value");
+
+      std::stringstream iss (opt);
+      long long val;
+      iss >> val;
+      if (iss.fail () || val < 0 || val > UINT32_MAX)
+         throw std::runtime_error (std::string ("-") + name +
+                                   ": expected unsigned integer");
+      outValue = val;
+   }
+
    uint8_t
    convHexDigit (const char* name, const char ch)
    {
@@ -202,10 +235,16 @@ namespace zutty {
       XrmParseCommand (&xrmOptionsDb,
                        xrmOptionsTable.data (), xrmOptionsTable.size (),
                        "zutty", argc, argv);
+      // benchmark and replay modes run without a display
+      bench = get ("bench");
+      replay = get ("replay");
+      client = getBool ("client");
+      server = getBool ("server");
       display = get ("display", getenv ("DISPLAY"));
-      if (!display)
+      if (!display && !bench && !replay)
          throw std::runtime_error ("DISPLAY not set!");
-      setenv ("DISPLAY", display, 1);
+      if (display)
+         setenv ("DISPLAY", display, 1);
    }
 
    void
@@ -225,6 +264,7 @@ namespace zutty {
 
       try
       {
+         convBackend (backend);
          convBorder (border);
          fontname = get ("font");
          fontpath = get ("fontpath");
@@ -239,10 +279,20 @@ namespace zutty {
          rv = getBool ("rv");
          if (rv)
             std::swap (fg, bg);
+         convUint32 ("saveLines", saveLines);
+         convUint32 ("saveLinesRaw", saveLinesRaw);
+         convUint32 ("readSize", readSize);
+         if (readSize < 1)
+            throw std::runtime_error ("-readSize: expected nonzero value");
+         convUint32 ("sliceTime", sliceTime);
          altScrollMode = getBool ("altScroll");
          boldAsBright = getBool ("boldAsBright");
+         record = get ("record");
+         realtime = getBool ("realtime");
          quiet = getBool ("quiet");
          verbose = getBool ("verbose");
+         hud = getBool ("hud");
+         stats = hud || getBool ("stats");
       }
       catch (const std::exception& e)
       {
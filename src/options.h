@@ -32,9 +32,12 @@ namespace zutty {
 
    static const std::vector <OptionDesc> optionsTable = {
       {"altScroll",    XrmoptionNoArg,    "true",  "false",     "Alternate scroll mode"},
+      {"backend",      XrmoptionSepArg,   nullptr, "compute",   "Rendering backend: compute, fragment"},
+      {"bench",        XrmoptionSepArg,   nullptr, nullptr,     "Benchmark: render the content of a file offscreen"},
       {"bg",           XrmoptionSepArg,   nullptr, "000000",    "Background color"},
       {"border",       XrmoptionSepArg,   nullptr, "2",         "Border width in pixels"},
       {"boldAsBright", XrmoptionSepArg,   nullptr, "true",      "Display bold text in bright colors"},
+      {"client",       XrmoptionNoArg,    "true",  "false",     "Open a window in the running server"},
       {"display",      XrmoptionSepArg,   nullptr, nullptr,     "Display to connect to"},
       {"fg",           XrmoptionSepArg,   nullptr, "ffffff",    "Foreground color"},
       {"font",         XrmoptionSepArg,   nullptr, "9x18",      "Font to use"},
@@ -43,20 +46,42 @@ namespace zutty {
       {"geometry",     XrmoptionSepArg,   nullptr, "80x24",     "Terminal size in chars"},
       {"glinfo",       XrmoptionNoArg,    "true",  "false",     "Print OpenGL information"},
       {"help",         XrmoptionNoArg,    "true",  "false",     "Print usage information"},
+      {"hud",          XrmoptionNoArg,    "true",  "false",     "Show frame statistics on screen (implies -stats)"},
+      {"readSize",     XrmoptionSepArg,   nullptr, "65536",     "Max. bytes of shell output read at once"},
+      {"realtime",     XrmoptionNoArg,    "true",  "false",     "Replay with the timing recorded"},
+      {"record",       XrmoptionSepArg,   nullptr, nullptr,     "Record the session to a capture file"},
+      {"replay",       XrmoptionSepArg,   nullptr, nullptr,     "Replay a capture file without a display"},
       {"rv",           XrmoptionNoArg,    "true",  "false",     "Reverse video"},
+      {"saveLines",    XrmoptionSepArg,   nullptr, "50000",     "Number of scrollback lines"},
+      {"saveLinesRaw", XrmoptionSepArg,   nullptr, "1000",      "Scrollback lines kept uncompressed"},
       {"selection",    XrmoptionSepArg,   nullptr, "primary",   "Selection target"},
+      {"server",       XrmoptionNoArg,    "true",  "false",     "Run as a server opening windows for clients"},
       {"shell",        XrmoptionSepArg,   nullptr, "/bin/bash", "Shell program to run"},
+      {"sliceTime",    XrmoptionSepArg,   nullptr, "10",        "Max. ms of shell output processed at once"},
+      {"stats",        XrmoptionNoArg,    "true",  "false",     "Collect frame statistics (dumped to the log on SIGUSR1)"},
       {"title",        XrmoptionSepArg,   nullptr, "Zutty",     "Window title"},
       {"quiet",        XrmoptionNoArg,    "true",  "false",     "Silence logging output"},
       {"verbose",      XrmoptionNoArg,    "true",  "false",     "Output info messages"},
       {"e",            XrmoptionSkipLine, nullptr, nullptr,     "Command line to run"},
    };
 
+   enum class Backend: uint8_t
+   {
+      compute,  // compute shader into an image, drawn by a fragment shader
+      fragment  // fragment shader only
+   };
+
    struct Options
    {
       // N.B.: no static initializers - will decode hardDefault fields above!
       uint16_t border;
       const char* display;
+      const char* bench;
+      const char* record;
+      const char* replay;
+      bool realtime;
+      bool client;
+      bool server;
       const char* fontname;
       const char* fontpath;
       uint8_t fontsize;
@@ -69,10 +94,17 @@ namespace zutty {
       Color fg;
       Color bg;
       bool rv;
+      uint32_t saveLines;
+      uint32_t saveLinesRaw;
+      uint32_t readSize;
+      uint32_t sliceTime;
       bool altScrollMode;
+      Backend backend;
       bool boldAsBright;
       bool quiet;
       bool verbose;
+      bool stats;
+      bool hud;
 
       void initialize (int* argc, char** argv);
       void setDisplay (Display* dpy);
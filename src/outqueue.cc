@@ -0,0 +1,65 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "outqueue.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+
+namespace zutty {
+
+   OutputQueue::OutputQueue (size_t capacity)
+      : buf (capacity)
+   {}
+
+   size_t
+   OutputQueue::push (const char* data, size_t size)
+   {
+      size = std::min (size, space ());
+      const size_t tail = (head + len) % buf.size ();
+      const size_t n = std::min (size, buf.size () - tail);
+      memcpy (buf.data () + tail, data, n);
+      memcpy (buf.data (), data + n, size - n);
+      len += size;
+      return size;
+   }
+
+   bool
+   OutputQueue::flush (int fd)
+   {
+      while (len)
+      {
+         // the content wraps around the end of buf into (at most) two parts
+         const size_t n = std::min (len, buf.size () - head);
+         struct iovec iov [2] = {
+            {buf.data () + head, n},
+            {buf.data (), len - n}
+         };
+         const ssize_t written = writev (fd, iov, len > n ? 2 : 1);
+         if (written < 0)
+         {
+            if (errno == EINTR)
+               continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+               return true;
+            head = len = 0;
+            return false;
+         }
+         head = (head + written) % buf.size ();
+         len -= written;
+      }
+      head = 0; // keep the content in one piece while it is short
+      return true;
+   }
+
+} // namespace zutty
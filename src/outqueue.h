@@ -0,0 +1,45 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace zutty {
+
+   /* Bytes waiting to be written to a non-blocking fd, in a ring buffer
+    * of fixed capacity. Whatever the fd does not take right away is kept
+    * in order for the next flush (), once the fd is writable again.
+    */
+   class OutputQueue
+   {
+   public:
+      explicit OutputQueue (size_t capacity);
+
+      bool empty () const { return !len; }
+      size_t space () const { return buf.size () - len; }
+
+      // Append up to space () bytes of data; return the number taken
+      size_t push (const char* data, size_t size);
+
+      /* Write out as much as the fd takes. Return false on an error other
+       * than the fd being full, in which case the content is dropped.
+       */
+      bool flush (int fd);
+
+   private:
+      std::vector <char> buf;
+      size_t head = 0; // position of the oldest byte
+      size_t len = 0;
+   };
+
+} // namespace zutty
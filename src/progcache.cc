@@ -0,0 +1,228 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "glyphcache.h"
+#include "log.h"
+#include "progcache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+/* Layout of a cache file (in native byte order, as it never leaves the
+ * host it was made on):
+ *
+ *   Header
+ *   <key> padded with zeros to a multiple of 4 bytes
+ *   uint8_t binary [binaryLen]
+ */
+namespace {
+
+   constexpr const uint32_t Magic = 0x5a504331; // "ZPC1"
+
+   struct Header
+   {
+      uint32_t magic;
+      uint32_t keyLen;
+      uint32_t binaryFormat;
+      uint32_t binaryLen;
+   };
+
+   inline size_t
+   padded (size_t len)
+   {
+      return (len + 3) & ~3;
+   }
+
+   uint64_t
+   hash (const std::string& str)
+   {
+      uint64_t h = 0xcbf29ce484222325; // FNV-1a
+      for (char ch: str)
+         h = (h ^ (uint8_t)ch) * 0x100000001b3;
+      return h;
+   }
+
+   std::string
+   glString (GLenum name)
+   {
+      const GLubyte* str = glGetString (name);
+      return str ? (const char*) str : "";
+   }
+
+   bool
+   readFile (const std::string& path, std::vector <uint8_t>& buf)
+   {
+      const int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+         return false;
+
+      struct stat st;
+      bool ok = fstat (fd, &st) == 0;
+      if (ok)
+      {
+         buf.resize (st.st_size);
+         size_t pos = 0;
+         while (ok && pos < buf.size ())
+         {
+            const ssize_t n = read (fd, buf.data () + pos, buf.size () - pos);
+            if (n < 0 && errno == EINTR)
+               continue;
+            ok = n > 0;
+            pos += ok ? n : 0;
+         }
+      }
+      close (fd);
+      return ok;
+   }
+
+} // namespace
+
+namespace zutty {
+
+   ProgramCache::ProgramCache ()
+   {
+      GLint nFormats = 0;
+      glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS, &nFormats);
+      dir = cacheDir ();
+      if (!nFormats || dir.empty ())
+      {
+         logT << "Program cache: disabled" << std::endl;
+         return;
+      }
+
+      driver = glString (GL_VENDOR) + '\n' + glString (GL_RENDERER) + '\n' +
+               glString (GL_VERSION);
+   }
+
+   bool
+   ProgramCache::load (const std::string& name, const std::string& source,
+                       GLuint program) const
+   {
+      if (driver.empty ())
+         return false;
+
+      const std::string key = makeKey (name, source);
+      const std::string path = makePath (key);
+      std::vector <uint8_t> buf;
+      if (!readFile (path, buf))
+      {
+         logT << "Program cache: " << path << " not found" << std::endl;
+         return false;
+      }
+
+      Header hdr;
+      if (buf.size () < sizeof (Header))
+         hdr.magic = 0;
+      else
+         memcpy (&hdr, buf.data (), sizeof (Header));
+      const size_t binaryOffset = sizeof (Header) + padded (hdr.keyLen);
+      if (hdr.magic != Magic || hdr.keyLen != key.size () ||
+          buf.size () != binaryOffset + (size_t)hdr.binaryLen ||
+          memcmp (buf.data () + sizeof (Header), key.data (), key.size ()))
+      {
+         logT << "Program cache: ignoring stale " << path << std::endl;
+         return false;
+      }
+
+      glProgramBinary (program, hdr.binaryFormat,
+                       buf.data () + binaryOffset, hdr.binaryLen);
+      GLint stat = 0;
+      glGetProgramiv (program, GL_LINK_STATUS, &stat);
+      if (!stat)
+      {
+         while (glGetError () != GL_NO_ERROR)
+            ; // of a bad format, not to be reported later on
+         logT << "Program cache: binary rejected in " << path << std::endl;
+         return false;
+      }
+
+      logT << "Program cache: loaded " << name << " program from " << path
+           << std::endl;
+      return true;
+   }
+
+   void
+   ProgramCache::prepare (GLuint program) const
+   {
+      if (!driver.empty ())
+         glProgramParameteri (program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                              GL_TRUE);
+   }
+
+   void
+   ProgramCache::save (const std::string& name, const std::string& source,
+                       GLuint program) const
+   {
+      if (driver.empty ())
+         return;
+
+      GLint len = 0;
+      glGetProgramiv (program, GL_PROGRAM_BINARY_LENGTH, &len);
+      if (len <= 0)
+         return;
+
+      const std::string key = makeKey (name, source);
+      const size_t binaryOffset = sizeof (Header) + padded (key.size ());
+      std::vector <uint8_t> buf (binaryOffset + len, 0);
+      GLenum format = 0;
+      GLsizei binaryLen = 0;
+      glGetProgramBinary (program, len, &binaryLen, &format,
+                          buf.data () + binaryOffset);
+      if (binaryLen <= 0)
+         return;
+      buf.resize (binaryOffset + binaryLen);
+
+      const Header hdr = {Magic, (uint32_t)key.size (), format,
+                          (uint32_t)binaryLen};
+      memcpy (buf.data (), &hdr, sizeof (Header));
+      memcpy (buf.data () + sizeof (Header), key.data (), key.size ());
+
+      const std::string path = makePath (key);
+      if (!replaceFile (path, buf.data (), buf.size ()))
+      {
+         logW << "Program cache: cannot write " << path
+              << ": " << strerror (errno) << std::endl;
+         return;
+      }
+      logT << "Program cache: saved " << name << " program to " << path
+           << std::endl;
+   }
+
+   // private methods
+
+   std::string
+   ProgramCache::makeKey (const std::string& name,
+                          const std::string& source) const
+   {
+      std::ostringstream oss;
+      oss << driver << '\n' << ZUTTY_VERSION << '\n' << name << ' '
+          << std::hex << std::setw (16) << std::setfill ('0')
+          << hash (source);
+      return oss.str ();
+   }
+
+   std::string
+   ProgramCache::makePath (const std::string& key) const
+   {
+      std::ostringstream oss;
+      oss << dir << "/program-" << std::hex << std::setw (16)
+          << std::setfill ('0') << hash (key);
+      return oss.str ();
+   }
+
+} // namespace zutty
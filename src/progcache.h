@@ -0,0 +1,62 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include "gl.h"
+
+#include <string>
+
+namespace zutty {
+
+   /* Persistent cache of linked GL programs, so they need not be
+    * compiled and linked from source in later sessions.
+    *
+    * There is one cache file per program next to those of the glyph
+    * cache (see GlyphCache), holding the binary got by
+    * glGetProgramBinary. It is identified by a key made of the GL
+    * vendor, renderer and version strings, the Zutty version, the name
+    * of the program and a hash of its source; a file with a different
+    * key is ignored (and replaced). If the driver does not take the
+    * binary (e.g., after an update that did not change its version
+    * string), the program is built from source as if nothing was cached.
+    */
+   class ProgramCache
+   {
+   public:
+      // With the GL context current; disabled if the driver offers no
+      // program binary formats
+      explicit ProgramCache ();
+
+      /* Load the program name, built from source, into program (as got
+       * from glCreateProgram, with nothing attached). Return false if
+       * there is no usable binary for it.
+       */
+      bool load (const std::string& name, const std::string& source,
+                 GLuint program) const;
+
+      // Call before linking a program to be saved below
+      void prepare (GLuint program) const;
+
+      // Store the binary of program, as linked from source
+      void save (const std::string& name, const std::string& source,
+                 GLuint program) const;
+
+   private:
+      std::string driver; // empty if disabled
+      std::string dir;
+
+      std::string makeKey (const std::string& name,
+                           const std::string& source) const;
+      std::string makePath (const std::string& key) const;
+   };
+
+} // namespace zutty
@@ -149,6 +149,12 @@ namespace zutty {
       }
       else // parent process
       {
+         // Writes are queued by the Vterm rather than waiting on the shell
+         if (fcntl (fdm, F_SETFL, fcntl (fdm, F_GETFL) | O_NONBLOCK) < 0)
+            SYS_ERROR ("fcntl O_NONBLOCK");
+         // Shells started later on (in server mode) must not inherit it
+         if (fcntl (fdm, F_SETFD, FD_CLOEXEC) < 0)
+            SYS_ERROR ("fcntl FD_CLOEXEC");
          o_ptyFd = fdm;
       }
       return pid;
@@ -10,86 +10,343 @@
  */
 
 #include "renderer.h"
+#include "utf8.h"
 
+#include <algorithm>
 #include <cassert>
 
+#include <signal.h>
+
 namespace zutty {
 
-   Renderer::Renderer (const std::function <void ()>& initDisplay,
-                       const std::function <void ()>& swapBuffers_,
-                       const Fontpack* fontpk)
-      : swapBuffers {swapBuffers_}
-      , thr (&Renderer::renderThread, this, initDisplay, fontpk)
+   RenderThread::RenderThread (const Fontpack* fontpk_)
+      : fontpk {fontpk_}
    {
+      thr = std::thread (&RenderThread::run, this);
    }
 
-   Renderer::~Renderer ()
+   RenderThread::~RenderThread ()
    {
-      std::unique_lock <std::mutex> lk (mx);
-      done = true;
-      nextFrame.seqNo = ++seqNo;
-      lk.unlock ();
-      cond.notify_one ();
+      {
+         std::lock_guard <std::mutex> lock (mutex);
+         done = true;
+      }
+      wakeup.notify_one ();
       thr.join ();
    }
 
    void
-   Renderer::update (const Frame& frame)
+   RenderThread::add (Renderer* renderer)
+   {
+      {
+         std::lock_guard <std::mutex> lock (mutex);
+         renderer->attached = true;
+         toAdd.push_back (renderer);
+         woken = true;
+      }
+      wakeup.notify_one ();
+   }
+
+   void
+   RenderThread::remove (Renderer* renderer)
+   {
+      std::unique_lock <std::mutex> lock (mutex);
+      if (!renderer->attached)
+         return;
+      toRemove.push_back (renderer);
+      woken = true;
+      wakeup.notify_one ();
+      removed.wait (lock, [renderer] { return !renderer->attached; });
+   }
+
+   void
+   RenderThread::wake ()
    {
-      std::unique_lock <std::mutex> lk (mx);
-      nextFrame = frame;
-      nextFrame.seqNo = ++seqNo;
-      lk.unlock ();
-      cond.notify_one ();
+      {
+         std::lock_guard <std::mutex> lock (mutex);
+         woken = true;
+      }
+      wakeup.notify_one ();
    }
 
    void
-   Renderer::renderThread (const std::function <void ()>& initDisplay,
-                           const Fontpack* fontpk)
+   RenderThread::select (Renderer* renderer)
    {
-      initDisplay ();
+      if (current == renderer)
+         return;
 
-      charVdev = std::make_unique <CharVdev> (fontpk);
+      renderer->makeCurrent ();
+      current = renderer;
+      if (!shared)
+         shared = std::make_unique <CharVdev::Shared> (fontpk);
+   }
 
-      Frame lastFrame;
-      bool delta = false;
+   void
+   RenderThread::run ()
+   {
+      // Leave the signals to the main thread
+      sigset_t sigs;
+      sigfillset (&sigs);
+      pthread_sigmask (SIG_BLOCK, &sigs, nullptr);
 
+      std::unique_lock <std::mutex> lock (mutex);
+      bool held = false;
+      Clock::time_point next;
       while (1)
       {
-         std::unique_lock <std::mutex> lk (mx);
-         cond.wait (lk,
-                    [&] ()
-                    {
-                       return lastFrame.seqNo != nextFrame.seqNo;
-                    });
+         auto pred = [this] { return woken || done; };
+         if (held)
+            wakeup.wait_until (lock, next, pred);
+         else
+            wakeup.wait (lock, pred);
 
          if (done)
-            return;
+            break;
+
+         woken = false;
+         std::vector <Renderer*> adding, removing;
+         adding.swap (toAdd);
+         removing.swap (toRemove);
+         lock.unlock ();
+
+         for (Renderer* r: adding)
+         {
+            select (r);
+            r->charVdev = std::make_unique <CharVdev> (* shared);
+            renderers.push_back (r);
+         }
+
+         for (Renderer* r: removing)
+         {
+            renderers.erase (std::find (renderers.begin (), renderers.end (),
+                                        r));
+            r->charVdev = nullptr;
+            if (current == r)
+               current = nullptr;
+         }
+
+         // Draw each renderer with a fresh frame, unless held off
+         const Clock::time_point now = Clock::now ();
+         held = false;
+         for (Renderer* r: renderers)
+         {
+            if (!r->isFresh ())
+               continue;
+
+            const Clock::time_point at = r->drawAt (now);
+            if (at > now)
+            {
+               next = held ? std::min (next, at) : at;
+               held = true;
+               continue;
+            }
+
+            select (r);
+            r->draw ();
+         }
+
+         lock.lock ();
+         if (!removing.empty ())
+         {
+            for (Renderer* r: removing)
+               r->attached = false;
+            removed.notify_all ();
+         }
+      }
+
+      // The context is still current (with the surface last drawn into)
+      for (Renderer* r: renderers)
+      {
+         r->charVdev = nullptr;
+         r->attached = false;
+      }
+      for (Renderer* r: toAdd)
+         r->attached = false;
+      removed.notify_all ();
+      shared = nullptr;
+   }
+
+   Renderer::Renderer (RenderThread& thread_,
+                       const std::function <void ()>& makeCurrent_,
+                       const std::function <void ()>& swapBuffers_)
+      : thread {thread_}
+      , makeCurrent {makeCurrent_}
+      , swapBuffers {swapBuffers_}
+   {
+      thread.add (this);
+   }
+
+   Renderer::Renderer (const std::function <void ()>& initDisplay,
+                       const std::function <void ()>& swapBuffers_,
+                       const Fontpack* fontpk)
+      : ownThread {std::make_unique <RenderThread> (fontpk)}
+      , thread {* ownThread}
+      , makeCurrent {initDisplay}
+      , swapBuffers {swapBuffers_}
+   {
+      thread.add (this);
+   }
+
+   Renderer::~Renderer ()
+   {
+      thread.remove (this);
+   }
+
+   constexpr const Renderer::Clock::duration Renderer::burstGap;
+   constexpr const Renderer::Clock::duration Renderer::maxLatency;
+   constexpr const Renderer::Clock::duration Renderer::hudInterval;
+
+   void
+   Renderer::update (const Frame& frame)
+   {
+      const Clock::rep now = Clock::now ().time_since_epoch ().count ();
+      if (now - lastUpdateAt.load () > burstGap.count ())
+         burstStartAt = now;
+      lastUpdateAt = now;
+
+      Frame& slot = slots [back];
+      frame.snapshotTo (slot);
+
+      // fold in the damage of updates published after the last one taken
+      damageLog [++seqNo % damageLogSize] = frame.damage;
+      const uint64_t taken = takenSeqNo.load ();
+      if (seqNo - taken > damageLogSize)
+         slot.damage.add (0, slot.nRows * slot.nCols);
+      else
+         for (uint64_t k = taken + 1; k < seqNo; ++k)
+            slot.damage.add (damageLog [k % damageLogSize]);
+
+      uint64_t prev = published.exchange ((seqNo << seqShift) |
+                                          freshFlag | back);
+      back = prev & slotMask;
+
+      // If the previous frame was not yet taken, the render thread has
+      // already been woken up for it and will pick up this one instead.
+      if (! (prev & freshFlag))
+         thread.wake ();
+   }
+
+   Renderer::Clock::time_point
+   Renderer::drawAt (Clock::time_point now)
+   {
+      const Clock::rep last = lastUpdateAt.load ();
+      if (last == burstStartAt.load ())
+         return now; // not a burst
+
+      if (!held)
+      {
+         held = true;
+         heldSince = now;
+      }
+      const Clock::time_point quietAt =
+         Clock::time_point (Clock::duration (last)) + burstGap;
+      return std::min (quietAt, heldSince + maxLatency);
+   }
+
+   void
+   Renderer::drawHud (Frame& frame, Cell* cells, uint8_t* dirtyRows,
+                      bool delta)
+   {
+      const Stats::Snapshot snap = stats.snapshot ();
+      if (snap.takenAt - hudSnapshot.takenAt >= hudInterval)
+      {
+         if (hudSnapshot.takenAt != Clock::time_point ())
+            hudLines = Stats::summary (hudSnapshot, snap);
+         hudSnapshot = snap;
+      }
 
-         delta = (lastFrame.seqNo + 1 == nextFrame.seqNo);
-         lastFrame = nextFrame;
-         lk.unlock ();
+      const uint16_t nLines =
+         std::min <size_t> (hudLines.size (), frame.nRows);
+      const uint16_t width =
+         nLines ? std::min <size_t> (hudLines [0].size (), frame.nCols) : 0;
+      const uint16_t left = frame.nCols - width;
+      std::vector <uint32_t> idxs;
+      idxs.reserve (nLines * width);
+      for (uint16_t y = 0; y < nLines; ++y)
+         for (uint16_t x = left; x < frame.nCols; ++x)
+            idxs.push_back (frame.getIdx (y, x));
 
-         if (charVdev->resize (lastFrame.winPx, lastFrame.winPy))
-            delta = false;
+      // Only write cells that change, so a steady HUD costs no uploads
+      auto put = [&] (uint32_t idx, Cell cell)
+      {
+         cell.dirty = 0;
+         Cell& out = cells [idx];
+         Cell cur = out;
+         cur.dirty = 0;
+         if (cur == cell)
+            return;
+         out = cell;
+         if (delta)
+         {
+            out.dirty = 1;
+            dirtyRows [idx / frame.nCols] = 1;
+         }
+      };
+
+      // A full copy has replaced the HUD; if it moved, restore the cells
+      // of the frame underneath.
+      if (!delta)
+         hudCells.clear ();
+      if (idxs != hudCells)
+         for (uint32_t idx: hudCells)
+            put (idx, frame [idx]);
 
+      for (uint16_t y = 0, k = 0; y < nLines; ++y)
+         for (uint16_t x = 0; x < width; ++x, ++k)
          {
-            CharVdev::Mapping m = charVdev->getMapping ();
-            assert (m.nCols == lastFrame.nCols);
-            assert (m.nRows == lastFrame.nRows);
+            Cell cell;
+            cell.uc_pt = (uint8_t) hudLines [y][x];
+            cell.attr = AttrTable::inverseId;
+            put (idxs [k], cell);
+         }
+      hudCells.swap (idxs);
+   }
+
+   void
+   Renderer::draw ()
+   {
+      held = false;
+
+      uint64_t cur = published.exchange (front);
+      front = cur & slotMask;
+      takenSeqNo = cur >> seqShift;
+      Frame& frame = slots [front];
+
+      // The damage published with the frame covers every change since
+      // the last frame taken, so a delta frame is always possible,
+      // except right after a change of the output geometry, or a
+      // renumbering of attribute IDs (as a cell may then look different
+      // with the same ID).
+      charVdev->activate ();
+      bool delta = !charVdev->resize (frame.winPx, frame.winPy);
+      if (frame.attrTable && charVdev->setAttrTable (* frame.attrTable))
+         delta = false;
+      charVdev->setDeltaFrame (delta);
+      charVdev->setScrollRegion (frame.marginTop, frame.marginBottom,
+                                 frame.scrollHead);
 
+      {
+         CharVdev::Mapping m = charVdev->getMapping ();
+         assert (m.nCols == frame.nCols);
+         assert (m.nRows == frame.nRows);
+
+         {
+            Stats::Probe probe (Stats::Copy);
             if (delta)
-               lastFrame.deltaCopyCells (m.cells);
+               frame.deltaCopyCells (m.cells, m.dirtyRows);
             else
-               lastFrame.copyCells (m.cells);
+               frame.copyCells (m.cells);
          }
-
-         charVdev->setDeltaFrame (delta);
-         charVdev->setCursor (lastFrame.cursor);
-         charVdev->setSelection (lastFrame.selection);
-         charVdev->draw ();
-         swapBuffers ();
+         if (opts.hud)
+            drawHud (frame, m.cells, m.dirtyRows, delta);
       }
+
+      charVdev->setCursor (frame.cursor);
+      charVdev->setSelection (frame.selection);
+      charVdev->draw ();
+
+      Stats::Probe probe (Stats::Swap);
+      swapBuffers ();
    }
 
 } // namespace zutty
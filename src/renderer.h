@@ -13,18 +13,76 @@
 
 #include "charvdev.h"
 #include "frame.h"
+#include "stats.h"
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 namespace zutty {
 
+   class Renderer;
+
+   /* The thread drawing the frames handed to any number of Renderers,
+    * each of them drawing into a window (GL surface) of its own. All of
+    * them are drawn with one GL context, and share the shader programs
+    * and the glyph atlas (see CharVdev::Shared), set up when the first
+    * Renderer is added.
+    */
+   class RenderThread
+   {
+   public:
+      explicit RenderThread (const Fontpack* fontpk);
+
+      ~RenderThread ();
+
+   private:
+      friend class Renderer;
+
+      using Clock = std::chrono::steady_clock;
+
+      void add (Renderer* renderer);
+      void remove (Renderer* renderer); // return once no longer drawn
+      void wake ();
+      void select (Renderer* renderer);
+      void run ();
+
+      const Fontpack* fontpk;
+      std::unique_ptr <CharVdev::Shared> shared;
+      std::vector <Renderer*> renderers;
+      Renderer* current = nullptr; // the one whose surface is current
+
+      std::mutex mutex; // guarding the rest
+      std::condition_variable wakeup;  // of the thread
+      std::condition_variable removed; // of remove ()
+      bool woken = false;
+      bool done = false;
+      std::vector <Renderer*> toAdd;
+      std::vector <Renderer*> toRemove;
+
+      std::thread thr;
+   };
+
    class Renderer {
    public:
+      /* Draw on thread, into the surface that makeCurrent makes the GL
+       * context current with. That is called on the render thread,
+       * before the first frame of this Renderer and whenever one of
+       * another Renderer was drawn in between, and swapBuffers after
+       * each frame.
+       */
+      explicit Renderer (RenderThread& thread,
+                         const std::function <void ()>& makeCurrent,
+                         const std::function <void ()>& swapBuffers);
+
+      // The same, on a render thread of its own
       explicit Renderer (const std::function <void ()>& initDisplay,
                          const std::function <void ()>& swapBuffers,
                          const Fontpack* fontpk);
@@ -33,19 +91,78 @@ namespace zutty {
 
       void update (const Frame& frame);
 
+      // Sequence number of the update last taken by the render thread
+      // (the n-th call of update () publishes sequence number n)
+      uint64_t getTakenSeqNo () const { return takenSeqNo.load (); }
+
    private:
-      std::unique_ptr <CharVdev> charVdev;
+      friend class RenderThread;
+
+      std::unique_ptr <RenderThread> ownThread;
+      RenderThread& thread;
+      const std::function <void ()> makeCurrent;
       const std::function <void ()> swapBuffers;
-      Frame nextFrame;
-      uint64_t seqNo;
-      bool done = false;
+      bool attached = false; // guarded by the mutex of the thread
 
-      std::condition_variable cond;
-      std::mutex mx;
-      std::thread thr;
+      // As the following, owned by the render thread
+      std::unique_ptr <CharVdev> charVdev;
 
-      void renderThread (const std::function <void ()>& initDisplay,
-                         const Fontpack* fontpk);
+      /* Triple buffered frame handoff. update () always writes a deep
+       * copy of the frame into the back slot, the render thread always
+       * works with the front slot, and each of them exchanges its own
+       * slot with the one currently published. The published word holds
+       * the sequence number, a flag set by update () and cleared by the
+       * render thread on taking the frame, and the slot index.
+       */
+      Frame slots [3];
+      int back = 0;           // owned by update ()
+      int front = 2;          // owned by the render thread
+      uint64_t seqNo = 0;     // last sequence number published
+      std::atomic <uint64_t> published {1};
+      constexpr const static uint64_t slotMask = 3;
+      constexpr const static uint64_t freshFlag = 4;
+      constexpr const static int seqShift = 3;
+
+      /* Damage of the most recent updates, so that the damage published
+       * with a frame covers all changes since the frame last taken by
+       * the render thread, even if the ones in between were never drawn.
+       */
+      constexpr const static uint64_t damageLogSize = 16;
+      Frame::Damage damageLog [damageLogSize];
+      std::atomic <uint64_t> takenSeqNo {0};
+
+      /* Render scheduling: an update following the previous one within
+       * burstGap is part of a burst (e.g., a large amount of output being
+       * processed), and drawing it is held off until the burst is over,
+       * but at most for maxLatency. The first update of a burst (e.g., the
+       * echo of a keypress) is drawn immediately.
+       */
+      using Clock = RenderThread::Clock;
+      constexpr const static Clock::duration burstGap =
+         std::chrono::milliseconds (2);
+      constexpr const static Clock::duration maxLatency =
+         std::chrono::milliseconds (20);
+      std::atomic <Clock::rep> lastUpdateAt {0};
+      std::atomic <Clock::rep> burstStartAt {0};
+      bool held = false;      // drawing the published frame is held off
+      Clock::time_point heldSince;
+
+      /* Stats overlay (-hud): a box of text in the top right corner,
+       * put into the cells handed to the CharVdev on top of those of the
+       * frame, with its content refreshed every hudInterval.
+       */
+      constexpr const static Clock::duration hudInterval =
+         std::chrono::milliseconds (500);
+      std::vector <std::string> hudLines;
+      Stats::Snapshot hudSnapshot;
+      std::vector <uint32_t> hudCells; // cell indices covered by the HUD
+
+      bool isFresh () const { return published.load () & freshFlag; }
+      // When to draw the published frame, so as to hold off a burst
+      Clock::time_point drawAt (Clock::time_point now);
+      void draw ();
+      void drawHud (Frame& frame, Cell* cells, uint8_t* dirtyRows,
+                    bool delta);
    };
 
 } // namespace zutty
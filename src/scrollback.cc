@@ -0,0 +1,331 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "cellpool.h"
+#include "scrollback.h"
+
+#include <cstring>
+
+/* Encoding of a cold line:
+ *
+ *   <width> { <flags> <nLiteral> <nRepeat> [fg] [bg] <cp>{nLiteral} [cp] }*
+ *
+ * where numbers and code points are LEB128-style varints. Each group
+ * describes a run of cells sharing the same attributes: nLiteral cells
+ * with their code points listed one by one, followed by nRepeat cells
+ * (usually trailing spaces) repeating a single code point. The colors
+ * are only present if they differ from those of the previous run (the
+ * first run is compared to the default colors).
+ */
+namespace {
+
+   using zutty::Attrs;
+   using zutty::Cell;
+   using zutty::Color;
+
+   enum: uint8_t
+   {
+      Bold = 1 << 0,
+      Italic = 1 << 1,
+      Underline = 1 << 2,
+      Inverse = 1 << 3,
+      Wrap = 1 << 4,
+      HaveFg = 1 << 5,
+      HaveBg = 1 << 6
+   };
+
+   inline void
+   putVarint (std::vector <uint8_t>& out, uint32_t val)
+   {
+      while (val >= 0x80)
+      {
+         out.push_back ((val & 0x7f) | 0x80);
+         val >>= 7;
+      }
+      out.push_back (val);
+   }
+
+   inline uint32_t
+   getVarint (const uint8_t*& p)
+   {
+      uint32_t val = 0;
+      int shift = 0;
+      while (*p & 0x80)
+      {
+         val |= (uint32_t)(*p++ & 0x7f) << shift;
+         shift += 7;
+      }
+      val |= (uint32_t)(*p++) << shift;
+      return val;
+   }
+
+   inline void
+   putColor (std::vector <uint8_t>& out, const Color& color)
+   {
+      out.push_back (color.red);
+      out.push_back (color.green);
+      out.push_back (color.blue);
+   }
+
+   inline Color
+   getColor (const uint8_t*& p)
+   {
+      Color color = {p [0], p [1], p [2]};
+      p += 3;
+      return color;
+   }
+
+   inline bool
+   sameAttrs (const Cell& c1, const Cell& c2)
+   {
+      return c1.attr == c2.attr && c1.wrap == c2.wrap;
+   }
+
+} // namespace
+
+namespace zutty {
+
+   Scrollback::Scrollback (uint32_t maxLines_, uint32_t hotLines_,
+                           AttrTable& attrTable_,
+                           AstralGlyphUse& astralUse_)
+      : attrTable (attrTable_)
+      , astralUse (astralUse_)
+      , maxLines (maxLines_)
+      , hotLines (std::min (hotLines_, maxLines_))
+   {}
+
+   void
+   Scrollback::push (const Cell* row, uint16_t nCols)
+   {
+      if (!maxLines)
+         return;
+
+      if (!hotLines)
+      {
+         encodeLine (row, nCols);
+      }
+      else
+      {
+         if (nCols != hotCols)
+         {
+            evictAllHot ();
+            hot = CellPool::instance ().get ((size_t)hotLines * nCols);
+            hotCols = nCols;
+            hotTail = 0;
+         }
+
+         if (nHot == hotLines)
+            evictHot ();
+
+         uint32_t slot = (hotTail + nHot) % hotLines;
+         memcpy (hot.get () + slot * hotCols, row, nCols * sizeof (Cell));
+         ++nHot;
+      }
+
+      while (size () > maxLines)
+         dropOldest ();
+   }
+
+   void
+   Scrollback::getLine (uint32_t idx, Cell* dst, uint16_t nCols) const
+   {
+      if (idx < nHot)
+      {
+         uint32_t slot = (hotTail + nHot - 1 - idx) % hotLines;
+         uint16_t n = std::min (nCols, hotCols);
+         memcpy (dst, hot.get () + slot * hotCols, n * sizeof (Cell));
+         std::fill (dst + n, dst + nCols, Cell ());
+         return;
+      }
+
+      idx -= nHot;
+      for (auto it = cold.rbegin (); it != cold.rend (); ++it)
+      {
+         const size_t n = it->offsets.size ();
+         if (idx < n)
+         {
+            decodeLine (it->data.data () + it->offsets [n - 1 - idx],
+                        dst, nCols);
+            return;
+         }
+         idx -= n;
+      }
+   }
+
+   void
+   Scrollback::clear ()
+   {
+      hotTail = 0;
+      nHot = 0;
+      cold.clear ();
+      coldSkip = 0;
+      nCold = 0;
+   }
+
+   void
+   Scrollback::evictAllHot ()
+   {
+      while (nHot)
+         evictHot ();
+   }
+
+   void
+   Scrollback::markGlyphs (AstralGlyphUse& use) const
+   {
+      for (uint32_t k = 0; k < nHot; ++k)
+      {
+         const Cell* row = hot.get () + (hotTail + k) % hotLines * hotCols;
+         for (uint16_t x = 0; x < hotCols; ++x)
+            use.mark (row [x].uc_pt);
+      }
+   }
+
+   void
+   Scrollback::evictHot ()
+   {
+      encodeLine (hot.get () + hotTail * hotCols, hotCols);
+      hotTail = (hotTail + 1) % hotLines;
+      --nHot;
+   }
+
+   void
+   Scrollback::dropOldest ()
+   {
+      if (nCold)
+      {
+         --nCold;
+         if (++coldSkip == cold.front ().offsets.size ())
+         {
+            cold.pop_front ();
+            coldSkip = 0;
+         }
+      }
+      else if (nHot)
+      {
+         hotTail = (hotTail + 1) % hotLines;
+         --nHot;
+      }
+   }
+
+   void
+   Scrollback::encodeLine (const Cell* row, uint16_t nCols)
+   {
+      if (cold.empty () || cold.back ().data.size () >= blockSize)
+      {
+         cold.emplace_back ();
+         cold.back ().data.reserve (blockSize);
+      }
+
+      Block& block = cold.back ();
+      std::vector <uint8_t>& out = block.data;
+      block.offsets.push_back (out.size ());
+      ++nCold;
+
+      putVarint (out, nCols);
+      Color fg = opts.fg;
+      Color bg = opts.bg;
+      uint16_t x = 0;
+      while (x < nCols)
+      {
+         const Cell& c = row [x];
+         const Attrs& a = attrTable [c.attr];
+         uint16_t end = x + 1;
+         while (end < nCols && sameAttrs (row [end], c))
+            ++end;
+
+         uint16_t nRepeat = 1;
+         while (end - nRepeat > x &&
+                row [end - nRepeat - 1].uc_pt == row [end - 1].uc_pt)
+            ++nRepeat;
+         if (nRepeat < 3)
+            nRepeat = 0;
+         const uint16_t nLiteral = end - x - nRepeat;
+
+         uint8_t flags = (a.bold ? Bold : 0) | (a.italic ? Italic : 0) |
+                         (a.underline ? Underline : 0) |
+                         (a.inverse ? Inverse : 0) | (c.wrap ? Wrap : 0);
+         if (! (a.fg == fg))
+            flags |= HaveFg;
+         if (! (a.bg == bg))
+            flags |= HaveBg;
+
+         out.push_back (flags);
+         putVarint (out, nLiteral);
+         putVarint (out, nRepeat);
+         if (flags & HaveFg)
+         {
+            putColor (out, a.fg);
+            fg = a.fg;
+         }
+         if (flags & HaveBg)
+         {
+            putColor (out, a.bg);
+            bg = a.bg;
+         }
+         for (uint16_t k = x; k < x + nLiteral; ++k)
+            putVarint (out, toCodePoint (row [k].uc_pt));
+         if (nRepeat)
+            putVarint (out, toCodePoint (row [end - 1].uc_pt));
+
+         x = end;
+      }
+   }
+
+   void
+   Scrollback::decodeLine (const uint8_t* p,
+                           Cell* dst, uint16_t nCols) const
+   {
+      const uint16_t width = getVarint (p);
+      Attrs a;
+      Cell c;
+      uint16_t x = 0;
+      auto put =
+         [&] (uint16_t uc_pt)
+         {
+            if (x < nCols)
+            {
+               c.uc_pt = uc_pt;
+               dst [x] = c;
+            }
+            ++x;
+         };
+
+      while (x < width)
+      {
+         const uint8_t flags = *p++;
+         const uint16_t nLiteral = getVarint (p);
+         const uint16_t nRepeat = getVarint (p);
+         a.bold = !! (flags & Bold);
+         a.italic = !! (flags & Italic);
+         a.underline = !! (flags & Underline);
+         a.inverse = !! (flags & Inverse);
+         if (flags & HaveFg)
+            a.fg = getColor (p);
+         if (flags & HaveBg)
+            a.bg = getColor (p);
+         c.attr = attrTable.intern (a);
+         c.wrap = !! (flags & Wrap);
+
+         for (uint16_t k = 0; k < nLiteral; ++k)
+            put (toGlyphId (getVarint (p), astralUse));
+         if (nRepeat)
+         {
+            const uint16_t uc_pt = toGlyphId (getVarint (p), astralUse);
+            for (uint16_t k = 0; k < nRepeat; ++k)
+               put (uc_pt);
+         }
+      }
+
+      if (x < nCols)
+         std::fill (dst + x, dst + nCols, Cell ());
+   }
+
+} // namespace zutty
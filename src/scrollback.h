@@ -0,0 +1,94 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include "attrtable.h"
+#include "cell.h"
+#include "utf8.h"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace zutty {
+
+   /* Storage of lines that scrolled off the top of the primary screen.
+    *
+    * The most recent lines are kept as raw cell rows in a ring (the hot
+    * area), so that scrolling back a few pages is just a memcpy. Lines
+    * evicted from the ring are packed into an attribute run / repeat
+    * encoding (the cold area) that is stored in large blocks, so that
+    * dropping the oldest history is cheap as well.
+    *
+    * Lines are addressed by age: index 0 is the line that most recently
+    * scrolled off the screen, index size () - 1 is the oldest one kept.
+    *
+    * Raw rows hold attribute IDs of the AttrTable of the Vterm, while
+    * encoded lines hold the attributes themselves. The hot area is thus
+    * evicted before the table is compacted, so that its lines do not
+    * keep their attributes in use. Likewise, encoded lines hold code
+    * points rather than glyph IDs, so only the hot area keeps astral
+    * glyph IDs in use.
+    */
+   class Scrollback
+   {
+   public:
+      explicit Scrollback (uint32_t maxLines, uint32_t hotLines,
+                           AttrTable& attrTable, AstralGlyphUse& astralUse);
+
+      uint32_t size () const { return nHot + nCold; }
+
+      void push (const Cell* row, uint16_t nCols);
+      /* Decoding a line of the cold area interns its attributes, so the
+       * full handler of the AttrTable must not get to change the
+       * scrollback meanwhile (see Vterm::composeView).
+       */
+      void getLine (uint32_t idx, Cell* dst, uint16_t nCols) const;
+      void clear ();
+
+      // Move all lines of the hot area to the cold area
+      void evictAllHot ();
+
+      // Mark the glyph IDs held by the hot area
+      void markGlyphs (AstralGlyphUse& use) const;
+
+   private:
+      void evictHot ();
+      void dropOldest ();
+      void encodeLine (const Cell* row, uint16_t nCols);
+      void decodeLine (const uint8_t* src, Cell* dst, uint16_t nCols) const;
+
+      AttrTable& attrTable; // decoding lines interns their attributes
+      AstralGlyphUse& astralUse; // ... and their astral code points
+      const uint32_t maxLines;
+      const uint32_t hotLines;
+
+      // hot area: ring of raw rows, nHot of them valid, oldest at hotTail
+      Cell::Ptr hot;
+      uint16_t hotCols = 0;
+      uint32_t hotTail = 0;
+      uint32_t nHot = 0;
+
+      // cold area: encoded lines in blocks, oldest first
+      struct Block
+      {
+         std::vector <uint8_t> data;
+         std::vector <uint32_t> offsets; // start of each line in data
+      };
+      constexpr const static size_t blockSize = 64 * 1024;
+      std::deque <Block> cold;
+      uint32_t coldSkip = 0; // lines already dropped from cold.front ()
+      uint32_t nCold = 0;
+   };
+
+} // namespace zutty
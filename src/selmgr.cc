@@ -28,6 +28,7 @@ namespace zutty {
                    : XMaxRequestSize (dpy) >> 2)
       , selection (opts.selection)
       , target (XA_UTF8_STRING (dpy))
+      , content (std::make_shared <std::string> ())
    {
       logT << "SelectionManager: chunkSize=" << chunkSize << std::endl;
    }
@@ -37,11 +38,13 @@ namespace zutty {
    {
       if (selOwned)
       {
-         cb (content);
+         cb (getContent (), true);
          return;
       }
 
-      incoming.clear ();
+      if (state == State::ReadingIncr)
+         pasteCallback (nullptr, true); // cut short by this request
+
       pasteCallback = cb;
       XConvertSelection (dpy, selection, target, prop, win, time);
       state = State::WaitingForSelNotify;
@@ -53,7 +56,8 @@ namespace zutty {
       XSetSelectionOwner(dpy, selection, win, time);
       if (XGetSelectionOwner (dpy, selection) == win)
       {
-         content = content_;
+         newContent () = content_;
+         pending = nullptr;
          selOwned = true;
       }
       else
@@ -63,6 +67,44 @@ namespace zutty {
       return selOwned;
    }
 
+   bool
+   SelectionManager::setSelection (Time time, const SelectedText::Ptr& text)
+   {
+      XSetSelectionOwner(dpy, selection, win, time);
+      if (XGetSelectionOwner (dpy, selection) == win)
+      {
+         pending = text;
+         selOwned = true;
+      }
+      else
+      {
+         selOwned = false;
+      }
+      return selOwned;
+   }
+
+   SelectionManager::Text
+   SelectionManager::getContent ()
+   {
+      if (pending)
+      {
+         pending->toUtf8 (newContent ());
+         pending = nullptr; // converted, no need to keep it
+      }
+      return content;
+   }
+
+   /* Storage for new content: a new string each time, as the current one
+    * may still be read by those sharing it (such as the parser thread,
+    * pasting it), and use_count () is no synchronization with them.
+    */
+   std::string&
+   SelectionManager::newContent ()
+   {
+      content = std::make_shared <std::string> ();
+      return *content;
+   }
+
    void
    SelectionManager::onPropertyNotify (XPropertyEvent& event)
    {
@@ -76,19 +118,20 @@ namespace zutty {
           event.state == PropertyDelete)
       {
          // Send next chunk of ongoing INCR transfer
-         size_t len = std::min (chunkSize, content.length () - cliPos);
+         size_t len = std::min (chunkSize, cliContent->length () - cliPos);
          if (len > 0)
          {
             logT << "Sending next INCR chunk..." << std::endl;
             XChangeProperty (dpy, cliWin, cliProp, target, 8, PropModeReplace,
-                             (const unsigned char *) content.data () + cliPos,
-                             len);
+                             (const unsigned char *) cliContent->data ()
+                             + cliPos, len);
          }
          else
          {
             logT << "Signaling end of INCR transfer..." << std::endl;
             XChangeProperty (dpy, cliWin, cliProp, target, 8, PropModeReplace,
                              nullptr, 0);
+            cliContent = nullptr;
             state = State::Idle;
          }
          XFlush (dpy);
@@ -116,9 +159,7 @@ namespace zutty {
             state = State::Idle;
 
             logT << "Received INCR end of transfer" << std::endl;
-            pasteCallback (std::string ((char *) incoming.data (),
-                                        incoming.size ()));
-            incoming.clear ();
+            pasteCallback (nullptr, true);
             return;
          }
 
@@ -133,9 +174,8 @@ namespace zutty {
               << " bytes=" << (propFormat >> 3) * propItems
               << std::endl;
          size_t len = (propFormat >> 3) * propItems;
-         size_t pos = incoming.size ();
-         incoming.resize (pos + len);
-         memcpy (incoming.data () + pos, buffer, len);
+         pasteCallback (std::make_shared <const std::string> (
+                           (const char *) buffer, len), false);
 
          XFree (buffer);
 
@@ -201,11 +241,8 @@ namespace zutty {
            << " bytes=" << (propFormat >> 3) * propItems
            << std::endl;
       size_t len = (propFormat >> 3) * propItems;
-      size_t pos = incoming.size ();
-      incoming.resize (pos + len);
-      memcpy (incoming.data () + pos, buffer, len);
-      pasteCallback (std::string ((char *) incoming.data (), incoming.size ()));
-      incoming.clear ();
+      pasteCallback (std::make_shared <const std::string> (
+                        (const char *) buffer, len), true);
 
       XFree (buffer);
       state = State::Idle;
@@ -233,9 +270,10 @@ namespace zutty {
          XChangeProperty (dpy, cliWin, cliProp, XA_ATOM, 32, PropModeReplace,
                           (const unsigned char *) types, 2);
       }
-      else if (chunkSize < content.size ()) // INCR response
+      else if (chunkSize < getContent ()->size ()) // INCR response
       {
          logT << "Sending INCR response" << std::endl;
+         cliContent = content; // kept as is until sent in full
          XChangeProperty (dpy, cliWin, cliProp, incr, 32, PropModeReplace,
                           nullptr, 0);
          XSelectInput (dpy, cliWin, PropertyChangeMask);
@@ -245,8 +283,8 @@ namespace zutty {
       {
          logT << "Sending normal response" << std::endl;
          XChangeProperty (dpy, cliWin, cliProp, target, 8, PropModeReplace,
-                          (const unsigned char *) content.data (),
-                          content.size ());
+                          (const unsigned char *) content->data (),
+                          content->size ());
       }
 
       // send SelectionNotify event in response
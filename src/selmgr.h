@@ -11,13 +11,15 @@
 
 #pragma once
 
+#include "seltext.h"
+
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 
 #include <cstdint>
 #include <functional>
+#include <memory>
 #include <string>
-#include <vector>
 
 namespace zutty {
 
@@ -26,9 +28,16 @@ namespace zutty {
    public:
       SelectionManager (Display*, Window);
 
-      using PasteCallbackFn = std::function <void (const std::string&)>;
+      using Text = std::shared_ptr <const std::string>;
+      /* The text is handed over in chunks as it arrives (an INCR transfer
+       * brings many), the last one flagged as such and possibly empty.
+       */
+      using PasteCallbackFn = std::function <void (const Text& chunk,
+                                                   bool last)>;
       void getSelection (Time, PasteCallbackFn&&);
       bool setSelection (Time, const std::string&);
+      // The text is only produced once it is asked for
+      bool setSelection (Time, const SelectedText::Ptr&);
 
       void onPropertyNotify (XPropertyEvent& event);
       void onSelectionClear (XSelectionClearEvent& event);
@@ -48,8 +57,9 @@ namespace zutty {
       const Atom target;
 
       bool selOwned = false;
-      std::string content;
-      std::vector <unsigned char> incoming;
+      // Shared by reference with pastes and INCR transfers still using it
+      std::shared_ptr <std::string> content;
+      SelectedText::Ptr pending; // not yet converted into content
       PasteCallbackFn pasteCallback;
 
       enum class State: uint8_t
@@ -61,6 +71,10 @@ namespace zutty {
       };
       State state = State::Idle;
 
+      Text getContent ();
+      std::string& newContent ();
+
+      Text cliContent; // being sent by INCR
       size_t cliPos;
       Window cliWin;
       Atom cliProp;
@@ -0,0 +1,66 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "seltext.h"
+#include "utf8.h"
+
+namespace zutty {
+
+   void
+   SelectedText::clear ()
+   {
+      codePoints.clear ();
+      rows.clear ();
+   }
+
+   void
+   SelectedText::addRow (const Cell* row, uint16_t x1, uint16_t x2, bool wrap)
+   {
+      const size_t pos = codePoints.size ();
+      if (x2 > x1)
+      {
+         codePoints.resize (pos + x2 - x1);
+         for (uint16_t x = x1; x < x2; ++x)
+            codePoints [pos + x - x1] = toCodePoint (row [x].uc_pt);
+      }
+      rows.push_back ({(uint32_t)codePoints.size (), wrap});
+   }
+
+   void
+   SelectedText::toUtf8 (std::string& out) const
+   {
+      out.clear ();
+      out.reserve (codePoints.size () + rows.size ());
+      auto sink = [&out] (char ch) { out.push_back (ch); };
+
+      uint32_t k = 0;
+      for (const Row& row: rows)
+      {
+         size_t keep = out.size (); // end of the line without trailing blanks
+         for (; k < row.end; ++k)
+         {
+            const uint32_t cp = codePoints [k];
+            Utf8Encoder::pushUnicode (cp, sink);
+            if (cp != ' ')
+               keep = out.size ();
+         }
+         if (!row.wrap)
+         {
+            out.resize (keep);
+            out.push_back ('\n');
+         }
+      }
+
+      while (out.size () && out.back () == '\n')
+         out.pop_back (); // discard trailing empty lines
+   }
+
+} // namespace zutty
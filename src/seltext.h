@@ -0,0 +1,55 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include "cell.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace zutty {
+
+   /* The content of a finished selection: the code points of the
+    * selected cells (rather than their glyph IDs, which may be reassigned
+    * meanwhile), row by row. It is only converted to UTF-8 once the text
+    * is actually asked for (mostly, it never is), and that can be done
+    * on another thread than the one of the Vterm that collected it.
+    */
+   class SelectedText
+   {
+   public:
+      using Ptr = std::shared_ptr <SelectedText>;
+
+      void clear ();
+
+      /* Add the cells [x1, x2) of a row. Unless the row wraps onto the
+       * next one, its trailing blanks are dropped and a line break
+       * follows.
+       */
+      void addRow (const Cell* row, uint16_t x1, uint16_t x2, bool wrap);
+
+      // Replace the content of out (reusing its storage) with the text
+      void toUtf8 (std::string& out) const;
+
+   private:
+      struct Row
+      {
+         uint32_t end; // of the row in codePoints
+         bool wrap;
+      };
+      std::vector <uint32_t> codePoints;
+      std::vector <Row> rows;
+   };
+
+} // namespace zutty
@@ -0,0 +1,382 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "log.h"
+#include "server.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace {
+
+   using namespace zutty;
+
+   /* A request is a sequence of NUL terminated fields: the magic, the
+    * working directory, the title, the number of arguments, the
+    * arguments, and the environment (up to the end of the request).
+    */
+   constexpr const char* magic = "ZUTTY1";
+   constexpr const size_t maxRequestSize = 1 << 20;
+   constexpr const int timeoutMs = 1000;
+   constexpr const size_t maxClients = 16; // with requests coming in
+
+   std::runtime_error
+   sysError (const std::string& what)
+   {
+      return std::runtime_error (what + ": " + strerror (errno));
+   }
+
+   sockaddr_un
+   makeAddress (const std::string& path)
+   {
+      sockaddr_un addr {};
+      if (path.size () >= sizeof (addr.sun_path))
+         throw std::runtime_error ("socket path too long: " + path);
+      addr.sun_family = AF_UNIX;
+      strcpy (addr.sun_path, path.c_str ());
+      return addr;
+   }
+
+   int
+   makeSocket ()
+   {
+      int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0)
+         throw sysError ("socket()");
+      fcntl (fd, F_SETFD, FD_CLOEXEC);
+      return fd;
+   }
+
+   std::string
+   encode (const WindowRequest& req)
+   {
+      std::string out;
+      auto put = [&out] (const std::string& field)
+                 { out.append (field); out.push_back ('\0'); };
+      put (magic);
+      put (req.cwd);
+      put (req.title);
+      put (std::to_string (req.argv.size ()));
+      for (const auto& arg: req.argv)
+         put (arg);
+      for (const auto& var: req.env)
+         put (var);
+      return out;
+   }
+
+   bool
+   decode (const std::string& in, WindowRequest& req)
+   {
+      std::vector <std::string> fields;
+      for (size_t pos = 0; pos < in.size (); )
+      {
+         const size_t end = in.find ('\0', pos);
+         if (end == std::string::npos)
+            return false;
+         fields.emplace_back (in, pos, end - pos);
+         pos = end + 1;
+      }
+
+      if (fields.size () < 4 || fields [0] != magic)
+         return false;
+      const size_t argc = strtoul (fields [3].c_str (), nullptr, 10);
+      if (argc > fields.size () - 4)
+         return false;
+
+      req.cwd = fields [1];
+      req.title = fields [2];
+      req.argv.assign (fields.begin () + 4, fields.begin () + 4 + argc);
+      req.env.assign (fields.begin () + 4 + argc, fields.end ());
+      return true;
+   }
+
+   // Read up to the end of stream (or the size limit), waiting at most
+   // timeoutMs for each bit of data, so a stuck server cannot hang us.
+   bool
+   readAll (int fd, std::string& out)
+   {
+      char buf [4096];
+      while (out.size () < maxRequestSize)
+      {
+         struct pollfd pfd = {fd, POLLIN, 0};
+         const int rc = poll (&pfd, 1, timeoutMs);
+         if (rc < 0 && errno == EINTR)
+            continue;
+         if (rc <= 0)
+            return false;
+
+         const ssize_t n = read (fd, buf, sizeof (buf));
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n < 0)
+            return false;
+         if (n == 0)
+            return true;
+         out.append (buf, n);
+      }
+      return false;
+   }
+
+   bool
+   writeAll (int fd, const std::string& data)
+   {
+      for (size_t pos = 0; pos < data.size (); )
+      {
+         const ssize_t n = send (fd, data.data () + pos, data.size () - pos,
+                                 MSG_NOSIGNAL);
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n < 0)
+            return false;
+         pos += n;
+      }
+      return true;
+   }
+
+} // namespace
+
+namespace zutty {
+
+   std::string
+   serverSocketPath (const char* display)
+   {
+      std::string dir;
+      const char* runtimeDir = getenv ("XDG_RUNTIME_DIR");
+      if (runtimeDir && runtimeDir [0])
+         dir = runtimeDir;
+      else
+      {
+         // a directory of our own, as anyone could create one in /tmp
+         dir = "/tmp/zutty-" + std::to_string (getuid ());
+         if (mkdir (dir.c_str (), 0700) < 0 && errno != EEXIST)
+            throw sysError ("mkdir " + dir);
+         struct stat st;
+         if (lstat (dir.c_str (), &st) < 0)
+            throw sysError ("stat " + dir);
+         if (!S_ISDIR (st.st_mode) || st.st_uid != getuid () ||
+             (st.st_mode & 077))
+            throw std::runtime_error ("not a private directory: " + dir);
+      }
+
+      std::string name = display ? display : "";
+      std::replace (name.begin (), name.end (), '/', '_');
+      return dir + "/zutty-" + name + ".sock";
+   }
+
+   Server::Server (const std::string& path_)
+      : path {path_}
+   {
+      const sockaddr_un addr = makeAddress (path);
+      listenFd = makeSocket ();
+      fcntl (listenFd, F_SETFL, O_NONBLOCK);
+
+      if (bind (listenFd, (const sockaddr*) &addr, sizeof (addr)) < 0)
+      {
+         if (errno != EADDRINUSE)
+         {
+            close (listenFd);
+            throw sysError ("bind " + path);
+         }
+
+         // Left behind by a server gone, unless one answers there
+         int fd = makeSocket ();
+         const bool alive =
+            connect (fd, (const sockaddr*) &addr, sizeof (addr)) == 0 ||
+            errno != ECONNREFUSED;
+         close (fd);
+         if (alive || unlink (path.c_str ()) < 0 ||
+             bind (listenFd, (const sockaddr*) &addr, sizeof (addr)) < 0)
+         {
+            close (listenFd);
+            throw std::runtime_error ("a server is already running at " +
+                                      path);
+         }
+      }
+
+      if (listen (listenFd, 16) < 0)
+      {
+         close (listenFd);
+         unlink (path.c_str ());
+         throw sysError ("listen " + path);
+      }
+      logI << "Server listening at " << path << std::endl;
+   }
+
+   Server::~Server ()
+   {
+      for (const Client& client: clients)
+         close (client.fd);
+      close (listenFd);
+      unlink (path.c_str ());
+   }
+
+   void
+   Server::addPollFds (std::vector <struct pollfd>& pollset) const
+   {
+      // no new clients while there are all too many of them
+      pollset.push_back ({clients.size () < maxClients ? listenFd : -1,
+                          POLLIN, 0});
+      for (const Client& client: clients)
+         pollset.push_back ({client.fd, POLLIN, 0});
+   }
+
+   int
+   Server::pollTimeout () const
+   {
+      if (clients.empty ())
+         return -1;
+
+      Clock::time_point deadline = clients [0].deadline;
+      for (const Client& client: clients)
+         deadline = std::min (deadline, client.deadline);
+      const auto ms = std::chrono::duration_cast <std::chrono::milliseconds>
+         (deadline - Clock::now ()).count ();
+      return std::max <decltype (ms)> (ms + 1, 0);
+   }
+
+   void
+   Server::handle (const struct pollfd* fds, const RequestFn& onRequest)
+   {
+      const Clock::time_point now = Clock::now ();
+      std::vector <Client> pending;
+      for (size_t k = 0; k < clients.size (); ++k)
+      {
+         Client& client = clients [k];
+         bool finished;
+         if (fds [k + 1].revents)
+            finished = readRequest (client);
+         else
+            finished = now >= client.deadline;
+         if (finished)
+            finish (client, onRequest);
+         else
+            pending.push_back (std::move (client));
+      }
+      clients.swap (pending);
+
+      if (fds [0].revents & POLLIN)
+         accept ();
+   }
+
+   // private methods
+
+   void
+   Server::accept ()
+   {
+      while (clients.size () < maxClients)
+      {
+         int fd = ::accept (listenFd, nullptr, nullptr);
+         if (fd < 0)
+         {
+            if (errno == EINTR)
+               continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+               logE << "Server: accept: " << strerror (errno) << std::endl;
+            }
+            return;
+         }
+         fcntl (fd, F_SETFD, FD_CLOEXEC);
+         fcntl (fd, F_SETFL, O_NONBLOCK);
+         clients.push_back ({fd, std::string (),
+                             Clock::now () + std::chrono::milliseconds (
+                                timeoutMs),
+                             false});
+      }
+   }
+
+   // Read what the client sent so far; return true once it is complete
+   // (at the end of stream) or failed (on an error, or too long).
+   bool
+   Server::readRequest (Client& client)
+   {
+      char buf [4096];
+      for (;;)
+      {
+         const ssize_t n = read (client.fd, buf, sizeof (buf));
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+         if (n <= 0)
+         {
+            client.complete = n == 0;
+            return true;
+         }
+         client.data.append (buf, n);
+         if (client.data.size () > maxRequestSize)
+            return true;
+      }
+      client.deadline = Clock::now () + std::chrono::milliseconds (timeoutMs);
+      return false;
+   }
+
+   void
+   Server::finish (Client& client, const RequestFn& onRequest)
+   {
+      if (client.complete && client.data.empty ())
+      {
+         // only checking that a server is running here
+         close (client.fd);
+         return;
+      }
+
+      WindowRequest req;
+      std::string reply;
+      if (!client.complete || !decode (client.data, req))
+         reply = "malformed request";
+      else
+         reply = onRequest (req);
+
+      if (!reply.empty ())
+      {
+         logW << "Server: request failed: " << reply << std::endl;
+      }
+      writeAll (client.fd, reply);
+      close (client.fd);
+   }
+
+   std::string
+   requestWindow (const std::string& path, const WindowRequest& request)
+   {
+      const sockaddr_un addr = makeAddress (path);
+      int fd = makeSocket ();
+      if (connect (fd, (const sockaddr*) &addr, sizeof (addr)) < 0)
+      {
+         close (fd);
+         throw sysError ("no server running at " + path);
+      }
+
+      std::string reply;
+      const bool ok = writeAll (fd, encode (request)) &&
+                      shutdown (fd, SHUT_WR) == 0 &&
+                      readAll (fd, reply);
+      close (fd);
+      if (!ok)
+         throw std::runtime_error ("no reply from the server at " + path);
+      return reply;
+   }
+
+} // namespace zutty
@@ -0,0 +1,92 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include <poll.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace zutty {
+
+   /* A window asked for by a client (zutty -client) of the server
+    * (zutty -server) running on the same display: the command line to
+    * run in it (the shell of the server, if empty), with the working
+    * directory and the environment of the client.
+    */
+   struct WindowRequest
+   {
+      std::string cwd;
+      std::string title;
+      std::vector <std::string> argv;
+      std::vector <std::string> env;
+   };
+
+   // The path of the socket the server on display listens at
+   std::string serverSocketPath (const char* display);
+
+   class Server
+   {
+   public:
+      // Throws if another server is already listening at path
+      explicit Server (const std::string& path);
+
+      Server (const Server&) = delete;
+      Server& operator = (const Server&) = delete;
+
+      ~Server ();
+
+      /* Requests are read as they come in, along with the other events
+       * of the main loop: add the descriptors to poll for (the socket
+       * listening, and the connections of clients still sending their
+       * requests) to pollset, and poll for at most pollTimeout () ms.
+       */
+      void addPollFds (std::vector <struct pollfd>& pollset) const;
+      int pollTimeout () const; // -1 if there is no deadline to keep
+
+      /* With fds pointing to the descriptors added to the pollset (once
+       * polled), accept clients connecting and read what they sent. For
+       * each request complete, reply with what onRequest returns: an
+       * error message, or empty if the window was opened.
+       */
+      using RequestFn = std::function <std::string (const WindowRequest&)>;
+      void handle (const struct pollfd* fds, const RequestFn& onRequest);
+
+   private:
+      using Clock = std::chrono::steady_clock;
+
+      struct Client
+      {
+         int fd;
+         std::string data;            // of the request, up to now
+         Clock::time_point deadline;  // for the next bit of it
+         bool complete;               // read up to the end of stream
+      };
+
+      void accept ();
+      bool readRequest (Client& client);
+      void finish (Client& client, const RequestFn& onRequest);
+
+      std::string path;
+      int listenFd = -1;
+      std::vector <Client> clients;
+   };
+
+   /* Ask the server listening at path for a window. Throws if there is
+    * none, returns the reply (empty if the window was opened).
+    */
+   std::string requestWindow (const std::string& path,
+                              const WindowRequest& request);
+
+} // namespace zutty
@@ -0,0 +1,167 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "stats.h"
+
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+   using zutty::Stats;
+
+   const char* stageNames [Stats::NumStages] = {
+      "parse", "copy", "upload", "dispatch", "draw", "swap",
+      "gpu compute", "gpu draw"
+   };
+
+   inline void
+   addTo (std::atomic <uint64_t>& counter, uint64_t value)
+   {
+      counter.fetch_add (value, std::memory_order_relaxed);
+   }
+
+   inline void
+   raiseTo (std::atomic <uint64_t>& counter, uint64_t value)
+   {
+      uint64_t prev = counter.load (std::memory_order_relaxed);
+      while (value > prev &&
+             !counter.compare_exchange_weak (prev, value,
+                                             std::memory_order_relaxed))
+         ;
+   }
+
+   inline double
+   perUnit (uint64_t amount, uint64_t units)
+   {
+      return units ? (double)amount / units : 0.0;
+   }
+
+} // namespace
+
+namespace zutty {
+
+   Stats stats;
+
+   Stats::Stats ()
+      : startedAt (std::chrono::steady_clock::now ())
+   {
+   }
+
+   void
+   Stats::add (Stage stage, uint64_t ns)
+   {
+      AtomicCounter& c = stages [stage];
+      addTo (c.count, 1);
+      addTo (c.totalNs, ns);
+      raiseTo (c.maxNs, ns);
+   }
+
+   void
+   Stats::addInput (uint64_t nBytes)
+   {
+      addTo (bytes, nBytes);
+   }
+
+   void
+   Stats::addRefresh (uint64_t nCells)
+   {
+      addTo (refreshes, 1);
+      addTo (cells, nCells);
+   }
+
+   Stats::Snapshot
+   Stats::snapshot () const
+   {
+      Snapshot s;
+      s.takenAt = std::chrono::steady_clock::now ();
+      for (int k = 0; k < NumStages; ++k)
+      {
+         s.stages [k].count = stages [k].count.load (std::memory_order_relaxed);
+         s.stages [k].totalNs =
+            stages [k].totalNs.load (std::memory_order_relaxed);
+         s.stages [k].maxNs = stages [k].maxNs.load (std::memory_order_relaxed);
+      }
+      s.bytes = bytes.load (std::memory_order_relaxed);
+      s.refreshes = refreshes.load (std::memory_order_relaxed);
+      s.cells = cells.load (std::memory_order_relaxed);
+      return s;
+   }
+
+   std::string
+   Stats::report () const
+   {
+      const Snapshot s = snapshot ();
+      const double secs =
+         std::chrono::duration <double> (s.takenAt - startedAt).count ();
+
+      std::ostringstream oss;
+      oss << std::fixed << std::setprecision (3)
+          << "Stats of the last " << secs << " s:\n"
+          << "  input: " << s.bytes << " bytes ("
+          << perUnit (s.bytes, s.stages [Parse].totalNs) * 1e3
+          << " MB/s while parsing), " << s.refreshes << " refreshes, "
+          << perUnit (s.cells, s.refreshes) << " cells each on average\n"
+          << "  stage            count     avg ms     max ms    total s";
+      for (int k = 0; k < NumStages; ++k)
+      {
+         const Counter& c = s.stages [k];
+         oss << "\n  " << std::left << std::setw (12) << stageNames [k]
+             << std::right << std::setw (10) << c.count
+             << std::setw (11) << perUnit (c.totalNs, c.count) / 1e6
+             << std::setw (11) << c.maxNs / 1e6
+             << std::setw (11) << c.totalNs / 1e9;
+      }
+      return oss.str ();
+   }
+
+   std::vector <std::string>
+   Stats::summary (const Snapshot& prev, const Snapshot& cur)
+   {
+      const double secs =
+         std::chrono::duration <double> (cur.takenAt - prev.takenAt).count ();
+      auto delta = [&] (int k) -> Counter
+      {
+         return {cur.stages [k].count - prev.stages [k].count,
+                 cur.stages [k].totalNs - prev.stages [k].totalNs, 0};
+      };
+      const uint64_t nFrames = delta (Swap).count;
+
+      std::vector <std::string> lines;
+      auto addLine = [&lines] (const char* label, double value, int prec)
+      {
+         std::ostringstream oss;
+         oss << " " << std::left << std::setw (12) << label << std::right
+             << std::fixed << std::setprecision (prec) << std::setw (9)
+             << value << " ";
+         lines.push_back (oss.str ());
+      };
+
+      addLine ("frames/s", secs > 0 ? nFrames / secs : 0.0, 1);
+      addLine ("input MB/s",
+               secs > 0 ? (cur.bytes - prev.bytes) / secs / 1e6 : 0.0, 2);
+      addLine ("cells/frame",
+               perUnit (cur.cells - prev.cells, cur.refreshes - prev.refreshes),
+               0);
+      addLine ("parse busy%",
+               secs > 0 ? delta (Parse).totalNs / secs / 1e7 : 0.0, 1);
+      for (int k = Copy; k < NumStages; ++k)
+      {
+         if (k >= GpuCompute && !cur.stages [k].count)
+            continue; // no GPU timers
+         std::string label = std::string (stageNames [k]) + " ms";
+         addLine (label.c_str (), perUnit (delta (k).totalNs, nFrames) / 1e6,
+                  3);
+      }
+      return lines;
+   }
+
+} // namespace zutty
@@ -0,0 +1,130 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#pragma once
+
+#include "options.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace zutty {
+
+   /* Counters of the time spent in the stages of processing the output
+    * of the shell and rendering it, to find out where a slow frame came
+    * from. They are only updated if enabled (by -stats or -hud); if not,
+    * a Probe costs no more than testing opts.stats.
+    *
+    * The parser threads of all the Vterms (several of them in server
+    * mode) update Parse and the input and refresh counters at the same
+    * time, so updates are atomic read-modify-write operations, relaxed
+    * as the counters are independent of each other. Readers on other
+    * threads might see a snapshot slightly inconsistent across them,
+    * which is fine for statistics.
+    */
+   class Stats
+   {
+   public:
+      enum Stage: uint8_t
+      {
+         Parse,      // Vterm::processInput ()
+         Copy,       // copying (the changes of) a Frame into the CharVdev
+         Upload,     // loading glyphs and uploading the changed cells
+         Dispatch,   // CharVdev::dispatchCompute (), CPU side
+         Draw,       // drawing the window in CharVdev::draw (), CPU side
+         Swap,       // swapping buffers (typically, waiting for vsync)
+         GpuCompute, // GPU time of the compute pass (via timer query)
+         GpuDraw,    // GPU time of drawing the window (via timer query)
+         NumStages
+      };
+
+      struct Counter
+      {
+         uint64_t count = 0;
+         uint64_t totalNs = 0;
+         uint64_t maxNs = 0;
+      };
+
+      struct Snapshot
+      {
+         std::chrono::steady_clock::time_point takenAt;
+         Counter stages [NumStages];
+         uint64_t bytes = 0;     // input bytes processed
+         uint64_t refreshes = 0; // frames handed off by the Vterm
+         uint64_t cells = 0;     // cells damaged, summed over refreshes
+      };
+
+      explicit Stats ();
+
+      void add (Stage stage, uint64_t ns);
+      void addInput (uint64_t nBytes);
+      void addRefresh (uint64_t nCells);
+
+      Snapshot snapshot () const;
+
+      // Multi-line report of everything since startup
+      std::string report () const;
+
+      // Short lines (for the HUD) with the rates and averages per frame
+      // over the period between two snapshots.
+      static std::vector <std::string> summary (const Snapshot& prev,
+                                                const Snapshot& cur);
+
+      // Adds the time spent from construction to destruction to a stage
+      class Probe
+      {
+      public:
+         explicit Probe (Stage stage);
+         ~Probe ();
+
+      private:
+         Stage stage;
+         std::chrono::steady_clock::time_point start;
+      };
+
+   private:
+      struct AtomicCounter
+      {
+         std::atomic <uint64_t> count {0};
+         std::atomic <uint64_t> totalNs {0};
+         std::atomic <uint64_t> maxNs {0};
+      };
+
+      std::chrono::steady_clock::time_point startedAt;
+      AtomicCounter stages [NumStages];
+      std::atomic <uint64_t> bytes {0};
+      std::atomic <uint64_t> refreshes {0};
+      std::atomic <uint64_t> cells {0};
+   };
+
+   extern Stats stats;
+
+   inline
+   Stats::Probe::Probe (Stage stage_)
+      : stage (stage_)
+   {
+      if (opts.stats)
+         start = std::chrono::steady_clock::now ();
+   }
+
+   inline
+   Stats::Probe::~Probe ()
+   {
+      if (opts.stats)
+         stats.add (stage, std::chrono::duration_cast
+                    <std::chrono::nanoseconds> (
+                       std::chrono::steady_clock::now () - start).count ());
+   }
+
+} // namespace zutty
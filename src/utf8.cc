@@ -0,0 +1,304 @@
+/* This file is part of Zutty.
+ * Copyright (C) 2020 Tom Szilagyi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the file LICENSE for the full license.
+ */
+
+#include "log.h"
+#include "utf8.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON) && defined (__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+   using namespace zutty;
+
+   /* Interned astral code points: written with the mutex held, read by
+    * astralGlyphCodePoint () from any thread. Those of the free IDs are
+    * stale, but no cell refers to them any more.
+    */
+   std::mutex astralMutex;
+   std::unordered_map <uint32_t, uint16_t> astralIds;
+   std::atomic <uint32_t> astralCodePoints [Astral_Glyph_Count];
+   std::atomic <uint32_t> astralGenerations [Astral_Glyph_Count];
+   uint16_t nAstralFresh = 0;               // IDs ever handed out
+   std::vector <uint16_t> freeAstralIds;    // reclaimed since
+   std::vector <AstralGlyphUse*> astralUsers;
+   bool astralWarned = false;
+   // Reclaiming found nothing to free: only try again every so often,
+   // until a set has been rebuilt
+   std::atomic <bool> astralStuck {false};
+   uint32_t astralMisses = 0;
+   constexpr const uint32_t astralRetryEvery = Astral_Glyph_Count / 2;
+
+   // Bumped to have all AstralGlyphUse sets rebuilt
+   std::atomic <uint32_t> astralScanEpoch {0};
+   bool astralScanAsked = false;
+
+   // Ask for the sets to be rebuilt this short of running out
+   constexpr const size_t astralLowWater = Astral_Glyph_Count / 4;
+
+   void
+   askForAstralScan ()
+   {
+      astralScanEpoch.fetch_add (1, std::memory_order_relaxed);
+      astralScanAsked = true;
+   }
+
+} // namespace
+
+namespace zutty {
+
+   AstralGlyphUse::AstralGlyphUse ()
+   {
+      for (auto& word: used)
+         word.store (0, std::memory_order_relaxed);
+      seenEpoch = astralScanEpoch.load (std::memory_order_relaxed);
+
+      std::lock_guard <std::mutex> lock (astralMutex);
+      astralUsers.push_back (this);
+   }
+
+   AstralGlyphUse::~AstralGlyphUse ()
+   {
+      std::lock_guard <std::mutex> lock (astralMutex);
+      astralUsers.erase (std::find (astralUsers.begin (), astralUsers.end (),
+                                    this));
+   }
+
+   bool
+   AstralGlyphUse::isStale () const
+   {
+      return seenEpoch != astralScanEpoch.load (std::memory_order_relaxed);
+   }
+
+   void
+   AstralGlyphUse::beginScan ()
+   {
+      scanEpoch = astralScanEpoch.load (std::memory_order_relaxed);
+      std::fill (scanned, scanned + nWords, 0);
+   }
+
+   /* Each word published is a superset of the IDs in use by the cells,
+    * before as well as after, so reclaiming may go on in the meantime.
+    * (IDs are only added by internAstralGlyph () on behalf of the owner,
+    * that is, not while it is scanning.)
+    */
+   void
+   AstralGlyphUse::endScan ()
+   {
+      for (int k = 0; k < nWords; ++k)
+         used [k].store (scanned [k], std::memory_order_relaxed);
+      seenEpoch = scanEpoch;
+      astralStuck.store (false, std::memory_order_relaxed);
+   }
+
+   // With the mutex held: free the IDs in no set, return their number
+   uint16_t
+   reclaimAstralGlyphs ()
+   {
+      uint64_t inUse [AstralGlyphUse::nWords] = {};
+      for (const AstralGlyphUse* user: astralUsers)
+         for (int k = 0; k < AstralGlyphUse::nWords; ++k)
+            inUse [k] |= user->used [k].load (std::memory_order_relaxed);
+
+      uint16_t nFreed = 0;
+      for (auto it = astralIds.begin (); it != astralIds.end (); )
+      {
+         const uint16_t n = it->second - Astral_Glyph_Base;
+         if (inUse [n / 64] & (uint64_t)1 << (n % 64))
+         {
+            ++it;
+            continue;
+         }
+         freeAstralIds.push_back (it->second);
+         it = astralIds.erase (it);
+         ++nFreed;
+      }
+      logT << "Astral glyphs: reclaimed " << nFreed << " of "
+           << Astral_Glyph_Count << std::endl;
+      return nFreed;
+   }
+
+   uint16_t
+   internAstralGlyph (uint32_t cp, AstralGlyphUse& use)
+   {
+      std::lock_guard <std::mutex> lock (astralMutex);
+      auto it = astralIds.find (cp);
+      if (it == astralIds.end ())
+      {
+         if (freeAstralIds.empty () && nAstralFresh == Astral_Glyph_Count)
+         {
+            if (astralStuck.load (std::memory_order_relaxed) &&
+                ++astralMisses % astralRetryEvery)
+               return Unicode_Replacement_Character;
+
+            // The sets not rebuilt since asking are still safe to go by;
+            // ask again, so that the ones of the next time are tighter.
+            if (use.onScan)
+               use.onScan ();
+            const uint16_t nFreed = reclaimAstralGlyphs ();
+            askForAstralScan ();
+            if (nFreed >= astralLowWater) // warn again if it comes to it
+               astralWarned = false;
+            if (!nFreed)
+            {
+               if (!astralWarned)
+               {
+                  logW << "All " << Astral_Glyph_Count << " astral glyph "
+                       << "IDs in use, showing U+FFFD instead" << std::endl;
+                  astralWarned = true;
+               }
+               astralStuck.store (true, std::memory_order_relaxed);
+               return Unicode_Replacement_Character;
+            }
+            astralScanAsked = false;
+         }
+
+         uint16_t id;
+         if (nAstralFresh < Astral_Glyph_Count)
+            id = Astral_Glyph_Base + nAstralFresh++;
+         else
+         {
+            id = freeAstralIds.back ();
+            freeAstralIds.pop_back ();
+         }
+         const uint16_t n = id - Astral_Glyph_Base;
+         astralCodePoints [n].store (cp, std::memory_order_relaxed);
+         astralGenerations [n].fetch_add (1, std::memory_order_release);
+         it = astralIds.emplace (cp, id).first;
+
+         const size_t nLeft =
+            freeAstralIds.size () + Astral_Glyph_Count - nAstralFresh;
+         if (nLeft < astralLowWater && !astralScanAsked)
+            askForAstralScan ();
+      }
+
+      const uint16_t n = it->second - Astral_Glyph_Base;
+      use.used [n / 64].fetch_or ((uint64_t)1 << (n % 64),
+                                  std::memory_order_relaxed);
+      return it->second;
+   }
+
+   uint32_t
+   astralGlyphCodePoint (uint16_t id)
+   {
+      return astralCodePoints [id - Astral_Glyph_Base].load (
+         std::memory_order_relaxed);
+   }
+
+   uint32_t
+   astralGlyphGeneration (uint16_t id)
+   {
+      return astralGenerations [id - Astral_Glyph_Base].load (
+         std::memory_order_acquire);
+   }
+
+   int
+   Utf8Decoder::scanPrintableAscii (const unsigned char* buf, int len)
+   {
+      int k = 0;
+#if defined (__SSE2__)
+      // Bytes >= 0x80 are negative as signed chars, so one signed
+      // comparison against each bound is sufficient.
+      const __m128i lo = _mm_set1_epi8 (0x1f);
+      const __m128i hi = _mm_set1_epi8 (0x7f);
+      for (; k + 16 <= len; k += 16)
+      {
+         const __m128i v = _mm_loadu_si128 ((const __m128i*)(buf + k));
+         const __m128i ok = _mm_and_si128 (_mm_cmpgt_epi8 (v, lo),
+                                           _mm_cmplt_epi8 (v, hi));
+         const int mask = _mm_movemask_epi8 (ok) ^ 0xffff;
+         if (mask)
+            return k + __builtin_ctz (mask);
+      }
+#elif defined (__ARM_NEON) && defined (__aarch64__)
+      const uint8x16_t lo = vdupq_n_u8 (0x20);
+      const uint8x16_t hi = vdupq_n_u8 (0x7e);
+      for (; k + 16 <= len; k += 16)
+      {
+         const uint8x16_t v = vld1q_u8 (buf + k);
+         const uint8x16_t ok = vandq_u8 (vcgeq_u8 (v, lo), vcleq_u8 (v, hi));
+         if (vminvq_u8 (ok) != 0xff)
+            break; // the scalar loop below finds the exact position
+      }
+#endif
+      for (; k < len; ++k)
+         if (buf [k] < 0x20 || buf [k] > 0x7e)
+            break;
+      return k;
+   }
+
+   int
+   Utf8Decoder::decodeRun (const unsigned char* buf, int len,
+                           uint32_t* out, int maxOut, int& nOut)
+   {
+      int k = 0;
+      nOut = 0;
+      while (k < len && nOut < maxOut)
+      {
+         const unsigned char ch = buf [k];
+         if (ch < 0x80)
+         {
+            const int n = scanPrintableAscii (buf + k,
+                                              std::min (len - k, maxOut - nOut));
+            if (!n)
+               break;
+            for (int i = 0; i < n; ++i)
+               out [nOut++] = buf [k + i];
+            k += n;
+         }
+         else if (ch >= 0xc2 && ch < 0xe0) // 110x'xxxx, not overlong
+         {
+            if (k + 1 >= len || (buf [k + 1] & 0xc0) != 0x80)
+               break;
+            out [nOut++] = ((ch & 0x1f) << 6) | (buf [k + 1] & 0x3f);
+            k += 2;
+         }
+         else if ((ch & 0xf0) == 0xe0) // 1110'xxxx
+         {
+            if (k + 2 >= len ||
+                (buf [k + 1] & 0xc0) != 0x80 ||
+                (buf [k + 2] & 0xc0) != 0x80 ||
+                (ch == 0xe0 && buf [k + 1] < 0xa0) || // overlong
+                (ch == 0xed && buf [k + 1] >= 0xa0))  // surrogate
+               break;
+            out [nOut++] = ((ch & 0x0f) << 12) |
+                           ((buf [k + 1] & 0x3f) << 6) | (buf [k + 2] & 0x3f);
+            k += 3;
+         }
+         else if (ch >= 0xf0 && ch < 0xf5) // 1111'0xxx, up to U+10FFFF
+         {
+            if (k + 3 >= len ||
+                (buf [k + 1] & 0xc0) != 0x80 ||
+                (buf [k + 2] & 0xc0) != 0x80 ||
+                (buf [k + 3] & 0xc0) != 0x80 ||
+                (ch == 0xf0 && buf [k + 1] < 0x90) || // overlong
+                (ch == 0xf4 && buf [k + 1] >= 0x90))  // beyond U+10FFFF
+               break;
+            out [nOut++] = ((ch & 0x07) << 18) | ((buf [k + 1] & 0x3f) << 12) |
+                           ((buf [k + 2] & 0x3f) << 6) | (buf [k + 3] & 0x3f);
+            k += 4;
+         }
+         else
+            break;
+      }
+      return k;
+   }
+
+} // namespace zutty
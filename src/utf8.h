@@ -11,6 +11,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <functional>
 
@@ -21,11 +22,97 @@ namespace zutty {
    // The "question mark" to display in place of invalid/unsupported unicode
    constexpr const uint16_t Unicode_Replacement_Character = 0xfffd;
 
+   /* Cells store 16-bit glyph IDs. Code points of the Basic Multilingual
+    * Plane are their own glyph ID. Code points beyond the BMP (astral
+    * code points) are interned on first use into the range of UTF-16
+    * surrogates, which are not valid code points on their own (the
+    * decoder replaces them). The IDs are shared by all Vterms of the
+    * process, and those no Vterm refers to any more are reclaimed once
+    * they run short (see AstralGlyphUse). Only if all of them are in use
+    * at once are further astral code points stored as
+    * Unicode_Replacement_Character (with a warning).
+    */
+   constexpr const uint16_t Astral_Glyph_Base = 0xd800;
+   constexpr const uint16_t Astral_Glyph_Count = 0x800;
+
+   inline bool
+   isAstralGlyph (uint16_t id)
+   {
+      return id >= Astral_Glyph_Base &&
+             id < Astral_Glyph_Base + Astral_Glyph_Count;
+   }
+
+   /* The astral glyph IDs referred to by the cells of a Vterm (which
+    * stores code points in encoded scrollback lines and selections, so
+    * as not to hold on to IDs there). Each ID interned on its behalf is
+    * added to it, and the owner rebuilds the set from its cells whenever
+    * isStale (), as asked for when the IDs run short. IDs in none of the
+    * sets are free to be reclaimed. A Vterm receiving no input keeps its
+    * set as it is, which is safe, but may hold on to IDs no longer on
+    * its screen.
+    *
+    * Once all IDs are taken, the handler set by setScanHandler () is
+    * called to rebuild the set of the Vterm interning right away (on
+    * its thread, and while none of its cells are being changed).
+    */
+   class AstralGlyphUse
+   {
+   public:
+      using ScanHandlerFn = std::function <void ()>;
+
+      explicit AstralGlyphUse ();
+      ~AstralGlyphUse ();
+
+      AstralGlyphUse (const AstralGlyphUse&) = delete;
+      AstralGlyphUse& operator = (const AstralGlyphUse&) = delete;
+
+      void setScanHandler (const ScanHandlerFn& onScan_) { onScan = onScan_; }
+      bool isStale () const;
+
+      // Rebuild the set: mark () each glyph ID in use between these
+      void beginScan ();
+      void mark (uint16_t id)
+      {
+         const uint16_t n = id - Astral_Glyph_Base;
+         if (isAstralGlyph (id))
+            scanned [n / 64] |= (uint64_t)1 << (n % 64);
+      }
+      void endScan ();
+
+   private:
+      friend uint16_t internAstralGlyph (uint32_t cp, AstralGlyphUse& use);
+      friend uint16_t reclaimAstralGlyphs ();
+
+      constexpr const static int nWords = Astral_Glyph_Count / 64;
+      std::atomic <uint64_t> used [nWords]; // read by other threads
+      uint64_t scanned [nWords];
+      uint32_t seenEpoch;
+      uint32_t scanEpoch;
+      ScanHandlerFn onScan;
+   };
+
+   uint16_t internAstralGlyph (uint32_t cp, AstralGlyphUse& use);
+   uint32_t astralGlyphCodePoint (uint16_t id);
+   // Changed whenever id is reassigned to another code point
+   uint32_t astralGlyphGeneration (uint16_t id);
+
+   inline uint16_t
+   toGlyphId (uint32_t cp, AstralGlyphUse& use)
+   {
+      return cp < 0x10000 ? cp : internAstralGlyph (cp, use);
+   }
+
+   inline uint32_t
+   toCodePoint (uint16_t id)
+   {
+      return isAstralGlyph (id) ? astralGlyphCodePoint (id) : id;
+   }
+
    struct Utf8Encoder
    {
       template <typename Fn>
       static void
-      pushUnicode (uint16_t cp, Fn&& byteSink)
+      pushUnicode (uint32_t cp, Fn&& byteSink)
       {
          if (cp < 0x80)
          {
@@ -36,12 +123,19 @@ namespace zutty {
             byteSink ((cp >> 6) | 0xc0);
             byteSink ((cp & 0x3f) | 0x80);
          }
-         else
+         else if (cp < 0x10000)
          {
             byteSink ((cp >> 12) | 0xe0);
             byteSink (((cp >> 6) & 0x3f) | 0x80);
             byteSink ((cp & 0x3f) | 0x80);
          }
+         else
+         {
+            byteSink ((cp >> 18) | 0xf0);
+            byteSink (((cp >> 12) & 0x3f) | 0x80);
+            byteSink (((cp >> 6) & 0x3f) | 0x80);
+            byteSink ((cp & 0x3f) | 0x80);
+         }
       }
    };
 
@@ -63,17 +157,36 @@ namespace zutty {
          }
       }
 
-      uint16_t getUnicode () const
+      uint32_t getUnicode () const
       {
          return unicode;
       }
 
-      void setUnicode (uint16_t cp)
+      void setUnicode (uint32_t cp)
       {
          unicode = cp;
       }
 
-      void onUnicode (uint16_t ch)
+      // True if not in the middle of a multibyte sequence
+      bool idle () const
+      {
+         return remaining == 0;
+      }
+
+      // Return the length of the run of printable ASCII (0x20 - 0x7e)
+      // at the start of buf, scanning at most len bytes.
+      static int scanPrintableAscii (const unsigned char* buf, int len);
+
+      // Decode the longest prefix of buf that consists of printable
+      // ASCII and well-formed multibyte sequences, into at most
+      // maxOut code points, stored in out (their count in nOut). Return
+      // the number of bytes decoded. Anything else (control characters,
+      // malformed or truncated sequences) is left to pushByte (), so that
+      // the replacement of invalid input stays the same.
+      static int decodeRun (const unsigned char* buf, int len,
+                            uint32_t* out, int maxOut, int& nOut);
+
+      void onUnicode (uint32_t ch)
       {
          if (!ch)
             return;
@@ -89,8 +202,6 @@ namespace zutty {
          {
             if (remaining > 0)
             {
-               if (remaining > 1 && (!ch || (unicode == 0 && ch < 0xa0)))
-                  valid = false; // reject overlong encodings
                unicode <<= 6;
                unicode += ch & 0x3f;
                --remaining;
@@ -100,6 +211,9 @@ namespace zutty {
 
             if (remaining == 0)
             {
+               if (unicode < minUnicode || unicode > 0x10ffff ||
+                   (unicode >= 0xd800 && unicode < 0xe000))
+                  valid = false; // reject overlong encodings and surrogates
                if (!valid)
                   unicode = Unicode_Replacement_Character;
                cpSink ();
@@ -110,13 +224,15 @@ namespace zutty {
             checkPrematureEOS ();
             unicode = ch & 0x1f;
             remaining = 1;
-            valid = unicode > 1; // reject overlong encodings
+            minUnicode = 0x80;
+            valid = true;
          }
          else if ((ch >> 4) == 0xe) // 1110'xxxx
          {
             checkPrematureEOS ();
             unicode = ch & 0x0f;
             remaining = 2;
+            minUnicode = 0x800;
             valid = true;
          }
          else if ((ch >> 3) == 0x1e) // 1111'0xxx
@@ -124,7 +240,8 @@ namespace zutty {
             checkPrematureEOS ();
             unicode = ch & 0x07;
             remaining = 3;
-            valid = false; // not supported
+            minUnicode = 0x10000;
+            valid = true;
          }
          else if ((ch >> 2) == 0x3e) // 1111'10xx
          {
@@ -151,7 +268,8 @@ namespace zutty {
       }
 
    private:
-      uint16_t unicode = 0;
+      uint32_t unicode = 0;
+      uint32_t minUnicode = 0; // shortest encoding for the sequence length
       bool valid = false;
       uint8_t remaining = 0;
       CodepointSink cpSink;
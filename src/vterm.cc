@@ -11,8 +11,11 @@
 
 #include "options.h"
 #include "pty.h"
+#include "stats.h"
 #include "vterm.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 
 namespace {
@@ -27,7 +30,7 @@ namespace {
    // magic byte to act as a placeholder for the Modifier Code:
    #define MC "\xff"
 
-   const InputSpec is_Alt [] =
+   constexpr InputSpec is_Alt [] =
    {
       {Key::K0,          ESC "0"},
       {Key::K1,          ESC "1"},
@@ -38,7 +41,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Control [] =
+   constexpr InputSpec is_Control [] =
    {
       {Key::K0,          CSI "27;5;48~"},
       {Key::K1,          CSI "27;5;49~"},
@@ -49,13 +52,13 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Shift [] =
+   constexpr InputSpec is_Shift [] =
    {
       {Key::Tab,         CSI "Z"},
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Ansi [] =
+   constexpr InputSpec is_Ansi [] =
    {
       {Key::K0,          "0"},
       {Key::K1,          "1"},
@@ -71,7 +74,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Mod_Ansi [] =
+   constexpr InputSpec is_Mod_Ansi [] =
    {
       {Key::Insert,      CSI "2;" MC "~"},  {Key::KP_Insert,   CSI "2;" MC "~"},
       {Key::Delete,      CSI "3;" MC "~"},  {Key::KP_Delete,   CSI "3;" MC "~"},
@@ -80,7 +83,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Ansi_FunctionKeys [] =
+   constexpr InputSpec is_Ansi_FunctionKeys [] =
    {
       {Key::F1,          SS3 "P"},     {Key::KP_F1,       SS3 "P"},
       {Key::F2,          SS3 "Q"},     {Key::KP_F2,       SS3 "Q"},
@@ -105,7 +108,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Mod_Ansi_FunctionKeys [] =
+   constexpr InputSpec is_Mod_Ansi_FunctionKeys [] =
    {
       {Key::F1,          CSI "1;" MC "P"},   {Key::KP_F1,    CSI "1;" MC "P"},
       {Key::F2,          CSI "1;" MC "Q"},   {Key::KP_F2,    CSI "1;" MC "Q"},
@@ -130,7 +133,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Ansi_KeypadKeys [] =
+   constexpr InputSpec is_Ansi_KeypadKeys [] =
    {
       {Key::KP_Space,    " "},
       {Key::KP_Tab,      "\t"},
@@ -155,7 +158,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Appl_KeypadKeys [] =
+   constexpr InputSpec is_Appl_KeypadKeys [] =
    {
       {Key::KP_Space,    SS3 " "},
       {Key::KP_Tab,      SS3 "I"},
@@ -180,7 +183,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Mod_Appl_KeypadKeys [] =
+   constexpr InputSpec is_Mod_Appl_KeypadKeys [] =
    {
       {Key::KP_Space,    SS3 MC " "},
       {Key::KP_Tab,      SS3 MC "I"},
@@ -205,7 +208,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_VT52_KeypadKeys [] =
+   constexpr InputSpec is_VT52_KeypadKeys [] =
    {
       {Key::KP_Space,    ESC "? "},
       {Key::KP_Tab,      ESC "?I"},
@@ -230,7 +233,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_VT52_FunctionKeys [] =
+   constexpr InputSpec is_VT52_FunctionKeys [] =
    {
       {Key::F1,          ESC "P"},      {Key::KP_F1,       ESC "P"},
       {Key::F2,          ESC "Q"},      {Key::KP_F2,       ESC "Q"},
@@ -239,7 +242,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Ansi_CursorKeys [] =
+   constexpr InputSpec is_Ansi_CursorKeys [] =
    {
       {Key::Up,          CSI "A"},      {Key::KP_Up,       CSI "A"},
       {Key::Down,        CSI "B"},      {Key::KP_Down,     CSI "B"},
@@ -251,7 +254,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Appl_CursorKeys [] =
+   constexpr InputSpec is_Appl_CursorKeys [] =
    {
       {Key::Up,          SS3 "A"},      {Key::KP_Up,       SS3 "A"},
       {Key::Down,        SS3 "B"},      {Key::KP_Down,     SS3 "B"},
@@ -263,7 +266,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Mod_CursorKeys [] =
+   constexpr InputSpec is_Mod_CursorKeys [] =
    {
       {Key::Up,          CSI "1;" MC "A"},   {Key::KP_Up,     CSI "1;" MC "A"},
       {Key::Down,        CSI "1;" MC "B"},   {Key::KP_Down,   CSI "1;" MC "B"},
@@ -275,7 +278,7 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_VT52_CursorKeys [] =
+   constexpr InputSpec is_VT52_CursorKeys [] =
    {
       {Key::Up,          ESC "A"},      {Key::KP_Up,       ESC "A"},
       {Key::Down,        ESC "B"},      {Key::KP_Down,     ESC "B"},
@@ -287,20 +290,20 @@ namespace {
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_ReturnKey_ANL [] =
+   constexpr InputSpec is_ReturnKey_ANL [] =
    {
       {Key::Return,      "\r\n"},
       {Key::KP_Enter,    "\r\n"},
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_BackspaceKey_BkSp [] =
+   constexpr InputSpec is_BackspaceKey_BkSp [] =
    {
       {Key::Backspace,   "\b"},
       {Key::NONE,        nullptr},
    };
 
-   const InputSpec is_Alt_BackspaceKey_BkSp [] =
+   constexpr InputSpec is_Alt_BackspaceKey_BkSp [] =
    {
       {Key::Backspace,   ESC "\b"},
       {Key::NONE,        nullptr},
@@ -310,6 +313,120 @@ namespace {
    #undef CSI
    #undef SS3
 
+   /* Which of the sets of InputSpecs above apply depends on the state
+    * of the terminal and the modifiers held, condensed into the bits of
+    * an input mode:
+    */
+   constexpr const unsigned imModifiers = 7; // the bits of VtModifier
+   constexpr const unsigned imShift = 1;
+   constexpr const unsigned imControl = 2;
+   constexpr const unsigned imAlt = 4;
+   constexpr const unsigned imAutoNewline = 8;
+   constexpr const unsigned imBkspSendsBS = 16;
+   constexpr const unsigned imVT52 = 32;
+   constexpr const unsigned imApplKeypad = 64;
+   constexpr const unsigned imApplCursor = 128;
+   constexpr const unsigned nInputModes = 256;
+
+   /* A set of InputSpecs, applying in the input modes with all of the
+    * bits in all set, and any of the bits in any (unless that is zero).
+    */
+   struct InputSpecGroup
+   {
+      unsigned all;
+      unsigned any;
+      const InputSpec* specs;
+   };
+
+   // In order of precedence: the first group to apply with a key wins
+   constexpr InputSpecGroup inputSpecGroups [] =
+   {
+      {imAutoNewline,            0,             is_ReturnKey_ANL},
+      {imAlt | imBkspSendsBS,    0,             is_Alt_BackspaceKey_BkSp},
+      {imAlt,                    0,             is_Alt},
+      {imControl,                0,             is_Control},
+      {imShift,                  0,             is_Shift},
+      {imBkspSendsBS,            0,             is_BackspaceKey_BkSp},
+
+      {imVT52,                   0,             is_VT52_CursorKeys},
+      {imVT52,                   0,             is_VT52_FunctionKeys},
+      {imVT52 | imApplKeypad,    0,             is_VT52_KeypadKeys},
+
+      {0,                        imModifiers,   is_Mod_CursorKeys},
+      {imApplCursor,             0,             is_Appl_CursorKeys},
+      {imApplKeypad,             imModifiers,   is_Mod_Appl_KeypadKeys},
+      {imApplKeypad,             0,             is_Appl_KeypadKeys},
+
+      // entries to use with modifier keys being held
+      {0,                        imModifiers,   is_Mod_Ansi},
+      {0,                        imModifiers,   is_Mod_Ansi_FunctionKeys},
+
+      // default entries
+      {0,                        0,             is_Ansi},
+      {0,                        0,             is_Ansi_CursorKeys},
+      {0,                        0,             is_Ansi_FunctionKeys},
+      {0,                        0,             is_Ansi_KeypadKeys},
+   };
+
+   constexpr InputSpec nullSpec = {Key::NONE, ""};
+   constexpr const unsigned nKeys = (unsigned)Key::Print + 1;
+
+   /* The InputSpec of each key in each input mode, resolved from the
+    * groups above at compile time, so that looking one up on a keypress
+    * is a matter of indexing: index holds the position in specs, with
+    * zero standing for nullSpec.
+    */
+   struct InputSpecTable
+   {
+      const InputSpec* specs [256];
+      uint8_t index [nInputModes][nKeys];
+   };
+
+   constexpr unsigned
+   countInputSpecs ()
+   {
+      unsigned n = 1;
+      for (const InputSpecGroup& group: inputSpecGroups)
+         for (const InputSpec* spec = group.specs; spec->key != Key::NONE;
+              ++spec)
+            ++n;
+      return n;
+   }
+   static_assert (countInputSpecs () <= 256,
+                  "InputSpecTable::index cannot hold all InputSpecs");
+
+   constexpr InputSpecTable
+   makeInputSpecTable ()
+   {
+      InputSpecTable table {};
+      table.specs [0] = &nullSpec;
+      unsigned n = 1;
+      for (const InputSpecGroup& group: inputSpecGroups)
+         for (const InputSpec* spec = group.specs; spec->key != Key::NONE;
+              ++spec)
+            table.specs [n++] = spec;
+
+      for (unsigned mode = 0; mode < nInputModes; ++mode)
+      {
+         n = 1;
+         for (const InputSpecGroup& group: inputSpecGroups)
+         {
+            const bool applies = (mode & group.all) == group.all &&
+                                 (group.any == 0 || (mode & group.any));
+            for (const InputSpec* spec = group.specs; spec->key != Key::NONE;
+                 ++spec, ++n)
+            {
+               uint8_t& index = table.index [mode][(unsigned)spec->key];
+               if (applies && index == 0)
+                  index = n;
+            }
+         }
+      }
+      return table;
+   }
+
+   constexpr InputSpecTable inputSpecTable = makeInputSpecTable ();
+
    uint8_t
    getModifierCode (VtModifier modifiers)
    {
@@ -471,6 +588,64 @@ namespace {
       0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
       0x0078, 0x0079, 0x007a, 0x007b, 0x007c, 0x007d, 0x007e, 0x007f,
    };
+
+   /* The handlers the parse table dispatches to, called without
+    * arguments; they read the parameters from inputOps, and (unless
+    * meant to be run inside a sequence) return to the Normal state.
+    */
+   #define PARSE_HANDLERS(H)                                           \
+      H (inp_CR) H (inp_HT) H (inp_IND) H (inp_BEL) H (inp_SO)         \
+      H (inp_SI) H (inp_ENQ)                                           \
+      H (esc_RI) H (esc_NEL) H (esc_BI) H (esc_FI) H (esc_HTS)         \
+      H (esc_DECSC) H (esc_DECRC) H (esc_RIS) H (esc_SS2) H (esc_SS3)  \
+      H (esc_LS2) H (esc_LS3) H (esc_LS1R) H (esc_LS2R) H (esc_LS3R)   \
+      H (esc_DECKPAM) H (esc_DECKPNM) H (esc_ANSI) H (esch_DECALN)     \
+      H (escp_ISO8859) H (escp_UTF8)                                   \
+      H (vt52_ANSI) H (vt52_EGM) H (vt52_XGM) H (vt52_IDENT)           \
+      H (csi_CUU) H (csi_CUD) H (csi_CUF) H (csi_CUB) H (csi_CNL)      \
+      H (csi_CPL) H (csi_CHA) H (csi_HPA) H (csi_HPR) H (csi_VPA)      \
+      H (csi_VPR) H (csi_CUP) H (csi_SU) H (csi_SD) H (csi_CHT)        \
+      H (csi_CBT) H (csi_REP) H (csi_ED) H (csi_EL) H (csi_IL)         \
+      H (csi_DL) H (csi_ICH) H (csi_DCH) H (csi_ECH) H (csi_DECIC)     \
+      H (csi_DECDC) H (csi_STBM) H (csi_TBC) H (csi_SM) H (csi_RM)     \
+      H (csi_privSM) H (csi_privRM) H (csi_SGR) H (csi_SCOSC_SLRM)     \
+      H (csi_SCORC) H (csi_DECSTR) H (csi_ecma48_SL) H (csi_ecma48_SR) \
+      H (csi_priDA) H (csi_secDA) H (csi_DSR) H (csi_XTWINOPS)         \
+      H (csiq_DECSCL) H (handle_DCS) H (handle_OSC)
+
+   enum Handler: uint8_t
+   {
+   #define H(fn) H_##fn,
+      PARSE_HANDLERS (H)
+   #undef H
+      nHandlers
+   };
+
+   // Sequences recognized, but not implemented: only logged
+   enum Unimplemented: uint8_t
+   {
+      U_S7C1T, U_S8C1T, U_ANSI1, U_ANSI2, U_ANSI3,
+      U_DECDHL_Top, U_DECDHL_Bottom, U_DECSWL, U_DECDWL
+   };
+
+   const char* const unimplementedNames [] =
+   {
+      "S7C1T: Send 7-bit controls",
+      "S8C1T: Send 8-bit controls",
+      "Set ANSI conformance level 1",
+      "Set ANSI conformance level 2",
+      "Set ANSI conformance level 3",
+      "DECDHL: Double-height, top half",
+      "DECDHL: Double-height, bottom half",
+      "DECSWL: Single-width line",
+      "DECDWL: Double-width line",
+   };
+
+   inline bool
+   isParamByte (unsigned char ch)
+   {
+      return (ch >= '0' && ch <= '9') || ch == ';';
+   }
 }
 
 namespace zutty {
@@ -500,9 +675,14 @@ namespace zutty {
       , onRefresh ([] (const Frame&) {})
       , onOsc ([] (int cmd, const std::string& arg)
                { logU << "OSC: '" << cmd << ";" << arg << "'" << std::endl; })
+      , attrTable (std::make_shared <AttrTable> ())
       , frame_pri (winPx, winPy, nCols, nRows)
       , cf (&frame_pri)
+      , scrollback (opts.saveLines, opts.saveLinesRaw, * attrTable,
+                    astralUse)
+      , inputBuf (opts.readSize)
       , utf8dec ([this] () { placeGraphicChar (); })
+      , ptyOut (ptyOutCapacity)
       , nColsEff (nCols)
       , hMargin (0)
    {
@@ -513,6 +693,9 @@ namespace zutty {
       fgPalIx = defaultFgPalIx;
       bgPalIx = defaultBgPalIx;
 
+      attrTable->setFullHandler ([this] () { compactAttrs (); });
+      astralUse.setScanHandler ([this] () { scanAstralGlyphs (true); });
+
       resetTerminal ();
    }
 
@@ -522,6 +705,18 @@ namespace zutty {
       onRefresh = onRefresh_;
    }
 
+   void
+   Vterm::startCapture (const std::string& path)
+   {
+      capture::Header header;
+      header.glyphPx = glyphPx;
+      header.glyphPy = glyphPy;
+      header.winPx = winPx;
+      header.winPy = winPy;
+      header.border = opts.border;
+      capture = std::make_unique <CaptureWriter> (path, header);
+   }
+
    void
    Vterm::setOscHandler (const OscHandlerFn& onOsc_)
    {
@@ -532,6 +727,9 @@ namespace zutty {
    void
    Vterm::resize (uint16_t winPx_, uint16_t winPy_)
    {
+      if (capture)
+         capture->resize (winPx_, winPy_);
+
       winPx = winPx_;
       winPy = winPy_;
 
@@ -546,14 +744,18 @@ namespace zutty {
       }
 
       hideCursor ();
+      viewOffset = 0;
+      frame_view.freeCells ();
+      selection.clear (); // the text under it may well have moved
 
       if (altScreenBufferMode)
       {
-         frame_alt = Frame (winPx, winPy, nCols_, nRows_);
+         // the primary screen is only reflowed on switching back to it
+         frame_alt.reset (winPx, winPy, nCols_, nRows_);
       }
       else
       {
-         frame_pri.resize (winPx, winPy, nCols_, nRows_);
+         resizePrimary (nCols_, nRows_, posY, posX);
          frame_alt.freeCells ();
       }
 
@@ -569,12 +771,90 @@ namespace zutty {
          nColsEff = nCols;
          hMargin = 0;
       }
+      // a cursor just past the end of the row (as left by the reflow) has
+      // a wrap pending, as if it got there by placing a character
+      const bool wrapPending = posX == nColsEff;
       normalizeCursorPos ();
+      if (wrapPending)
+      {
+         ++posX;
+         setCur ();
+         curPosViaCharPlacement = true;
+      }
       showCursor ();
 
       pty_resize (ptyFd, nCols, nRows);
    }
 
+   // Resize the primary screen, handing the rows it sheds to the scrollback
+   void
+   Vterm::resizePrimary (uint16_t nCols_, uint16_t nRows_,
+                         uint16_t& pY, uint16_t& pX)
+   {
+      frame_pri.resize (winPx, winPy, nCols_, nRows_, pY, pX,
+                        [this] (const Cell* row, uint16_t n)
+                        { scrollback.push (row, n); });
+   }
+
+   // Call fn (Cell&) on every cell holding an attribute ID
+   template <typename Fn>
+   void
+   Vterm::forEachCell (Fn fn)
+   {
+      for (Frame* f: {&frame_pri, &frame_alt, &frame_view})
+      {
+         if (! *f)
+            continue;
+         const uint32_t n = f->nRows * f->nCols;
+         for (uint32_t k = 0; k < n; ++k)
+            fn ((* f) [k]);
+      }
+      fn (attrs);
+   }
+
+   // Called by the AttrTable once it is full
+   void
+   Vterm::compactAttrs ()
+   {
+      // evicting the hot lines would change the cold area under the line
+      // getLine () is decoding; the view is composed again afterwards
+      if (composingView)
+      {
+         compactPending = true;
+         return;
+      }
+
+      // encoded lines do not refer to the table
+      scrollback.evictAllHot ();
+
+      std::vector <uint8_t> used (attrTable->size (), 0);
+      forEachCell ([&] (Cell& c) { used [c.attr] = 1; });
+
+      std::vector <uint16_t> remap;
+      attrTable->compact (used, remap);
+      forEachCell ([&] (Cell& c) { c.attr = remap [c.attr]; });
+
+      for (Frame* f: {&frame_pri, &frame_alt})
+         if (* f)
+            f->damage.add (0, f->nRows * f->nCols);
+   }
+
+   // Asked for by the astral glyph IDs running short, or out (full)
+   void
+   Vterm::scanAstralGlyphs (bool full)
+   {
+      // encoded lines hold code points; not while composing, as above
+      if (full && composingView)
+         astralScanPending = true;
+      else if (full)
+         scrollback.evictAllHot ();
+
+      astralUse.beginScan ();
+      forEachCell ([&] (Cell& c) { astralUse.mark (c.uc_pt); });
+      scrollback.markGlyphs (astralUse);
+      astralUse.endScan ();
+   }
+
    std::string
    Vterm::getLocalEcho (const unsigned char *const begin,
                         const unsigned char *const end)
@@ -590,21 +870,21 @@ namespace zutty {
       return oss.str ();
    }
 
-   int
+   void
    Vterm::writePty (VtKey key, VtModifier modifiers_)
    {
 #ifdef DEBUG
       if (key == VtKey::Print)
       {
          debugKey ();
-         return 0;
+         return;
       }
 #endif
       modifiers = modifiers_;
       const auto& spec = getInputSpec (key);
       if (modifiers == VtModifier::none)
       {
-         return writePty (spec.input, true);
+         writePty (spec.input, true);
       }
       else
       {
@@ -617,543 +897,448 @@ namespace zutty {
             else
                buf [k++] = *p;
          buf [k] = '\0';
-         return writePty (buf, true);
+         writePty (buf, true);
       }
    }
 
-   using Key = VtKey;
-   using Mod = VtModifier;
+   const Vterm::InputSpec &
+   Vterm::getInputSpec (VtKey key) const
+   {
+      const unsigned mode =
+         (unsigned)modifiers |
+         (autoNewlineMode ? imAutoNewline : 0) |
+         (bkspSendsDel ? 0 : imBkspSendsBS) |
+         (compatLevel == CompatibilityLevel::VT52 ? imVT52 : 0) |
+         (keypadMode == KeypadMode::Application ? imApplKeypad : 0) |
+         (cursorKeyMode == CursorKeyMode::Application ? imApplCursor : 0);
+      return *inputSpecTable.specs [inputSpecTable.index [mode][(unsigned)key]];
+   }
 
-   Vterm::InputSpecTable *
-   Vterm::getInputSpecTable ()
+   struct Vterm::ParseTable
    {
-      static InputSpecTable ist [] =
+      enum class Action: uint8_t
       {
-         { [this] () { return (autoNewlineMode == true); },
-           is_ReturnKey_ANL
-         },
-
-         { [this] () { return ((modifiers & Mod::alt) != Mod::none &&
-                               bkspSendsDel == false); },
-           is_Alt_BackspaceKey_BkSp
-         },
-
-         { [this] () { return ((modifiers & Mod::alt) != Mod::none); },
-           is_Alt
-         },
-
-         { [this] () { return ((modifiers & Mod::control) != Mod::none); },
-           is_Control
-         },
-
-         { [this] () { return ((modifiers & Mod::shift) != Mod::none); },
-           is_Shift
-         },
-
-         { [this] () { return (bkspSendsDel == false); },
-           is_BackspaceKey_BkSp
-         },
-
-         { [this] () { return (compatLevel == CompatibilityLevel::VT52); },
-           is_VT52_CursorKeys
-         },
-         { [this] () { return (compatLevel == CompatibilityLevel::VT52); },
-           is_VT52_FunctionKeys
-         },
-         { [this] () { return (compatLevel == CompatibilityLevel::VT52 &&
-                               keypadMode == KeypadMode::Application); },
-           is_VT52_KeypadKeys
-         },
-
-         { [this] () { return (modifiers != Mod::none); },
-           is_Mod_CursorKeys
-         },
-         { [this] () { return (cursorKeyMode == CursorKeyMode::Application); },
-           is_Appl_CursorKeys
-         },
-         { [this] () { return (modifiers != Mod::none &&
-                               keypadMode == KeypadMode::Application); },
-           is_Mod_Appl_KeypadKeys
-         },
-         { [this] () { return (keypadMode == KeypadMode::Application); },
-           is_Appl_KeypadKeys
-         },
-
-         // entries to use with modifier keys being held
-         { [this] () { return (modifiers != Mod::none); },
-           is_Mod_Ansi
-         },
-         { [this] () { return (modifiers != Mod::none); },
-           is_Mod_Ansi_FunctionKeys
-         },
-
-         // default entries
-         { [] () { return true; }, is_Ansi },
-         { [] () { return true; }, is_Ansi_CursorKeys },
-         { [] () { return true; }, is_Ansi_FunctionKeys },
-         { [] () { return true; }, is_Ansi_KeypadKeys },
-
-         // end marker to delimit iteration
-         { [] () { return true; }, nullptr }
+         Unhandled,    // not part of a known sequence: log, back to Normal
+         Ignore,       // drop the byte
+         Print,        // graphic character, see inputGraphicChar ()
+         Enter,        // enter state arg
+         EscStart,     // ESC: start (or restart) an escape sequence
+         Param,        // digits and ';' of numeric parameters
+         ParamUndo,    // BS inside CSI undoes the last parameter byte
+         Execute,      // C0 control in Normal, or the end of a string:
+                       // run handler arg
+         ExecuteInSeq, // C0 control inside a sequence: run handler arg,
+                       // then carry on with the sequence
+         Dispatch,     // final byte: run handler arg, ending the sequence
+         Unimplemented,// final byte: log unimplemented sequence arg
+         ScsStart,     // intermediate starting a Select Charset sequence
+         ScsMod,       // further intermediate of a Select Charset sequence
+         ScsFinal,     // final byte of a Select Charset sequence
+         StrStart,     // start of a DCS or OSC string (state arg)
+         StrPut,       // byte of a DCS or OSC string
+         StrEsc,       // ESC not starting ST in a string (state arg)
+         Vt52CupArg,   // argument arg (0: row, 1: column) of VT52 CUP
       };
-      return ist;
-   }
 
-   void
-   Vterm::resetInputSpecTable ()
-   {
-      for (InputSpecTable* e = getInputSpecTable (); e->specs != nullptr; ++e)
-         e->visited = false;
-   }
+      struct Entry
+      {
+         Action action = Action::Unhandled;
+         uint8_t arg = 0;
+      };
 
-   const Vterm::InputSpec *
-   Vterm::selectInputSpecs ()
-   {
-      InputSpecTable* ist = getInputSpecTable ();
-      for (auto e = ist; e->specs != nullptr; ++e)
+      Entry entries [nInputStates][256] = {};
+
+      constexpr void
+      set (InputState state, unsigned char ch, Action action,
+           uint8_t arg = 0)
       {
-         if (!e->visited)
-         {
-            e->visited = true;
-            if (e->predicate ())
-               return e->specs;
-         }
+         entries [(int) state][ch] = {action, arg};
       }
-      return nullptr;
-   }
 
-   const Vterm::InputSpec &
-   Vterm::getInputSpec (Key key)
+      constexpr void
+      set (InputState state, const char* chars, Action action,
+           uint8_t arg = 0)
+      {
+         while (*chars)
+            set (state, *chars++, action, arg);
+      }
+
+      constexpr ParseTable ();
+   };
+
+   constexpr
+   Vterm::ParseTable::ParseTable ()
    {
-      static InputSpec nullSpec = {Key::NONE, ""};
+      using S = InputState;
+      using A = Action;
+      const S anyEscState [] = {
+         S::Escape, S::Escape_VT52, S::Esc_SPC, S::Esc_Hash, S::Esc_Pct,
+         S::SelectCharset, S::CSI, S::CSI_priv, S::CSI_Quote,
+         S::CSI_DblQuote, S::CSI_Bang, S::CSI_SPC, S::CSI_GT,
+         S::VT52_CUP_Arg1, S::VT52_CUP_Arg2
+      };
 
-      resetInputSpecTable ();
-      const InputSpec* specs;
-      while ((specs = selectInputSpecs ()) != nullptr)
+      for (int ch = 0; ch < 256; ++ch)
+      {
+         set (S::Normal, ch, A::Print);
+         set (S::SelectCharset, ch, ch < 0x30 ? A::ScsMod : A::ScsFinal);
+         set (S::DCS, ch, A::StrPut);
+         set (S::DCS_Esc, ch, A::StrEsc, (uint8_t) S::DCS);
+         set (S::OSC, ch, A::StrPut);
+         set (S::OSC_Esc, ch, A::StrEsc, (uint8_t) S::OSC);
+         set (S::VT52_CUP_Arg1, ch, A::Vt52CupArg, 0);
+         set (S::VT52_CUP_Arg2, ch, A::Vt52CupArg, 1);
+      }
+
+      // ESC (re)starts an escape sequence, CAN and SUB cancel it
+      for (S state: anyEscState)
       {
-         for (int k = 0; specs [k].key != Key::NONE; ++k)
-            if (specs [k].key == key)
-               return specs [k];
+         set (state, '\e', A::EscStart);
+         set (state, "\x18\x1a", A::Enter, (uint8_t) S::Normal);
       }
 
-      return nullSpec;
+      set (S::Normal, '\0', A::Ignore);
+      set (S::Normal, '\e', A::EscStart);
+      set (S::Normal, '\r', A::Execute, H_inp_CR);
+      set (S::Normal, "\n\v\f", A::Execute, H_inp_IND);
+      set (S::Normal, '\t', A::Execute, H_inp_HT);
+      set (S::Normal, '\b', A::Execute, H_csi_CUB);
+      set (S::Normal, '\a', A::Execute, H_inp_BEL);
+      set (S::Normal, '\x0e', A::Execute, H_inp_SO);
+      set (S::Normal, '\x0f', A::Execute, H_inp_SI);
+      set (S::Normal, '\x05', A::Execute, H_inp_ENQ);
+
+      set (S::Escape_VT52, '=', A::Dispatch, H_esc_DECKPAM);
+      set (S::Escape_VT52, '>', A::Dispatch, H_esc_DECKPNM);
+      set (S::Escape_VT52, '<', A::Dispatch, H_vt52_ANSI);
+      set (S::Escape_VT52, 'A', A::Dispatch, H_csi_CUU);
+      set (S::Escape_VT52, 'B', A::Dispatch, H_csi_CUD);
+      set (S::Escape_VT52, 'C', A::Dispatch, H_csi_CUF);
+      set (S::Escape_VT52, 'D', A::Dispatch, H_csi_CUB);
+      set (S::Escape_VT52, 'F', A::Dispatch, H_vt52_EGM);
+      set (S::Escape_VT52, 'G', A::Dispatch, H_vt52_XGM);
+      set (S::Escape_VT52, 'H', A::Dispatch, H_csi_CUP);
+      set (S::Escape_VT52, 'I', A::Dispatch, H_esc_RI);
+      set (S::Escape_VT52, 'J', A::Dispatch, H_csi_ED);
+      set (S::Escape_VT52, 'K', A::Dispatch, H_csi_EL);
+      set (S::Escape_VT52, 'Y', A::Enter, (uint8_t) S::VT52_CUP_Arg1);
+      set (S::Escape_VT52, 'Z', A::Dispatch, H_vt52_IDENT);
+      // allow "reset" command to escape VT52
+      set (S::Escape_VT52, 'c', A::Dispatch, H_esc_RIS);
+
+      set (S::Escape, ' ', A::Enter, (uint8_t) S::Esc_SPC);
+      set (S::Escape, '#', A::Enter, (uint8_t) S::Esc_Hash);
+      set (S::Escape, '%', A::Enter, (uint8_t) S::Esc_Pct);
+      set (S::Escape, '[', A::Enter, (uint8_t) S::CSI);
+      set (S::Escape, ']', A::StrStart, (uint8_t) S::OSC);
+      set (S::Escape, 'P', A::StrStart, (uint8_t) S::DCS);
+      // ',' and '$' are from ISO/IEC 2022 (absorbed, treat as no-op)
+      set (S::Escape, "()*+-./,$", A::ScsStart);
+      set (S::Escape, 'D', A::Dispatch, H_inp_IND);
+      set (S::Escape, 'M', A::Dispatch, H_esc_RI);
+      set (S::Escape, 'E', A::Dispatch, H_esc_NEL);
+      set (S::Escape, 'H', A::Dispatch, H_esc_HTS);
+      set (S::Escape, 'N', A::Dispatch, H_esc_SS2);
+      set (S::Escape, 'O', A::Dispatch, H_esc_SS3);
+      set (S::Escape, 'c', A::Dispatch, H_esc_RIS);
+      set (S::Escape, '6', A::Dispatch, H_esc_BI);
+      set (S::Escape, '7', A::Dispatch, H_esc_DECSC);
+      set (S::Escape, '8', A::Dispatch, H_esc_DECRC);
+      set (S::Escape, '9', A::Dispatch, H_esc_FI);
+      set (S::Escape, '=', A::Dispatch, H_esc_DECKPAM);
+      set (S::Escape, '>', A::Dispatch, H_esc_DECKPNM);
+      set (S::Escape, '<', A::Dispatch, H_esc_ANSI);
+      set (S::Escape, '~', A::Dispatch, H_esc_LS1R);
+      set (S::Escape, 'n', A::Dispatch, H_esc_LS2);
+      set (S::Escape, '}', A::Dispatch, H_esc_LS2R);
+      set (S::Escape, 'o', A::Dispatch, H_esc_LS3);
+      set (S::Escape, '|', A::Dispatch, H_esc_LS3R);
+      set (S::Escape, '\\', A::Enter, (uint8_t) S::Normal); // ignore lone ST
+
+      set (S::Esc_SPC, 'F', A::Unimplemented, U_S7C1T);
+      set (S::Esc_SPC, 'G', A::Unimplemented, U_S8C1T);
+      set (S::Esc_SPC, 'L', A::Unimplemented, U_ANSI1);
+      set (S::Esc_SPC, 'M', A::Unimplemented, U_ANSI2);
+      set (S::Esc_SPC, 'N', A::Unimplemented, U_ANSI3);
+
+      set (S::Esc_Hash, '3', A::Unimplemented, U_DECDHL_Top);
+      set (S::Esc_Hash, '4', A::Unimplemented, U_DECDHL_Bottom);
+      set (S::Esc_Hash, '5', A::Unimplemented, U_DECSWL);
+      set (S::Esc_Hash, '6', A::Unimplemented, U_DECDWL);
+      set (S::Esc_Hash, '8', A::Dispatch, H_esch_DECALN);
+
+      set (S::Esc_Pct, '@', A::Dispatch, H_escp_ISO8859);
+      set (S::Esc_Pct, 'G', A::Dispatch, H_escp_UTF8);
+
+      for (S state: {S::CSI, S::CSI_priv, S::CSI_GT})
+         set (state, "0123456789;", A::Param);
+
+      set (S::CSI, 'A', A::Dispatch, H_csi_CUU);
+      set (S::CSI, 'B', A::Dispatch, H_csi_CUD);
+      set (S::CSI, 'C', A::Dispatch, H_csi_CUF);
+      set (S::CSI, 'D', A::Dispatch, H_csi_CUB);
+      set (S::CSI, 'E', A::Dispatch, H_csi_CNL);
+      set (S::CSI, 'F', A::Dispatch, H_csi_CPL);
+      set (S::CSI, 'G', A::Dispatch, H_csi_CHA);
+      set (S::CSI, "Hf", A::Dispatch, H_csi_CUP);
+      set (S::CSI, 'I', A::Dispatch, H_csi_CHT);
+      set (S::CSI, 'J', A::Dispatch, H_csi_ED);
+      set (S::CSI, 'K', A::Dispatch, H_csi_EL);
+      set (S::CSI, 'L', A::Dispatch, H_csi_IL);
+      set (S::CSI, 'M', A::Dispatch, H_csi_DL);
+      set (S::CSI, 'P', A::Dispatch, H_csi_DCH);
+      set (S::CSI, 'S', A::Dispatch, H_csi_SU);
+      set (S::CSI, 'T', A::Dispatch, H_csi_SD);
+      set (S::CSI, 'X', A::Dispatch, H_csi_ECH);
+      set (S::CSI, 'Z', A::Dispatch, H_csi_CBT);
+      set (S::CSI, '@', A::Dispatch, H_csi_ICH);
+      set (S::CSI, '`', A::Dispatch, H_csi_HPA);
+      set (S::CSI, 'a', A::Dispatch, H_csi_HPR);
+      set (S::CSI, 'b', A::Dispatch, H_csi_REP);
+      set (S::CSI, 'c', A::Dispatch, H_csi_priDA);
+      set (S::CSI, 'd', A::Dispatch, H_csi_VPA);
+      set (S::CSI, 'e', A::Dispatch, H_csi_VPR);
+      set (S::CSI, 'g', A::Dispatch, H_csi_TBC);
+      set (S::CSI, 'h', A::Dispatch, H_csi_SM);
+      set (S::CSI, 'l', A::Dispatch, H_csi_RM);
+      set (S::CSI, 'm', A::Dispatch, H_csi_SGR);
+      set (S::CSI, 'n', A::Dispatch, H_csi_DSR);
+      set (S::CSI, 'r', A::Dispatch, H_csi_STBM);
+      set (S::CSI, 's', A::Dispatch, H_csi_SCOSC_SLRM);
+      set (S::CSI, 't', A::Dispatch, H_csi_XTWINOPS);
+      set (S::CSI, 'u', A::Dispatch, H_csi_SCORC);
+      set (S::CSI, '\'', A::Enter, (uint8_t) S::CSI_Quote);
+      set (S::CSI, '\"', A::Enter, (uint8_t) S::CSI_DblQuote);
+      set (S::CSI, '!', A::Enter, (uint8_t) S::CSI_Bang);
+      set (S::CSI, '?', A::Enter, (uint8_t) S::CSI_priv);
+      set (S::CSI, ' ', A::Enter, (uint8_t) S::CSI_SPC);
+      set (S::CSI, '>', A::Enter, (uint8_t) S::CSI_GT);
+      set (S::CSI, '\a', A::Ignore);
+      set (S::CSI, '\b', A::ParamUndo);
+      set (S::CSI, '\t', A::ExecuteInSeq, H_inp_HT);
+      set (S::CSI, '\r', A::ExecuteInSeq, H_inp_CR);
+      set (S::CSI, "\n\v\f", A::ExecuteInSeq, H_inp_IND);
+
+      set (S::CSI_Bang, 'p', A::Dispatch, H_csi_DECSTR);
+      set (S::CSI_Quote, '}', A::Dispatch, H_csi_DECIC);
+      set (S::CSI_Quote, '~', A::Dispatch, H_csi_DECDC);
+      set (S::CSI_DblQuote, 'p', A::Dispatch, H_csiq_DECSCL);
+      set (S::CSI_SPC, '@', A::Dispatch, H_csi_ecma48_SL);
+      set (S::CSI_SPC, 'A', A::Dispatch, H_csi_ecma48_SR);
+      set (S::CSI_GT, 'c', A::Dispatch, H_csi_secDA);
+      set (S::CSI_priv, 'h', A::Dispatch, H_csi_privSM);
+      set (S::CSI_priv, 'l', A::Dispatch, H_csi_privRM);
+
+      set (S::DCS, '\e', A::Enter, (uint8_t) S::DCS_Esc);
+      set (S::DCS_Esc, '\\', A::Execute, H_handle_DCS);
+      set (S::OSC, '\a', A::Execute, H_handle_OSC);
+      set (S::OSC, '\e', A::Enter, (uint8_t) S::OSC_Esc);
+      set (S::OSC_Esc, '\\', A::Execute, H_handle_OSC);
    }
 
-#define COLLECT_NUMERIC_PARAMS                                        \
-   case '0': case '1': case '2': case '3': case '4':                  \
-   case '5': case '6': case '7': case '8': case '9':                  \
-      if (inputOps [nInputOps - 1] < 429496704)                       \
-      {                                                               \
-         inputOps [nInputOps - 1] *= 10;                              \
-         inputOps [nInputOps - 1] += ch - '0';                        \
-      }                                                               \
-      else                                                            \
-      {                                                               \
-         logE << "inputOp overflow!" << std::endl;                    \
-         setState (InputState::Normal);                               \
-      }                                                               \
-      break;                                                          \
-   case ';':                                                          \
-      if (nInputOps < maxEscOps)                                      \
-         inputOps [nInputOps ++] = 0;                                 \
-      else                                                            \
-      {                                                               \
-         logE << "inputOps full, increase maxEscOps (currently: "     \
-              << maxEscOps << ")!" << std::endl;                      \
-         setState (InputState::Normal);                               \
-      }                                                               \
-      break
+   constexpr const Vterm::ParseTable Vterm::parseTable {};
+
+   void (Vterm::* const Vterm::parseHandlers [nHandlers]) () =
+   {
+   #define H(fn) &Vterm::fn,
+      PARSE_HANDLERS (H)
+   #undef H
+   };
+
+   inline void
+   Vterm::dispatch (uint8_t handler)
+   {
+      // The most frequent sequences are called directly, to be inlined
+      switch (handler)
+      {
+      case H_csi_SGR: csi_SGR (); break;
+      case H_csi_CUP: csi_CUP (); break;
+      default: (this->*parseHandlers [handler]) (); break;
+      }
+   }
 
    void
    Vterm::processInput (const std::string& str)
    {
+      // local echo, as it were output by the shell
+      if (capture)
+         capture->output ((const unsigned char*)str.c_str (), str.length ());
       processInput ((unsigned char*)str.c_str (), str.length ());
    }
 
    void
    Vterm::processInput (const unsigned char *const input, int inputSize)
    {
+      using Action = ParseTable::Action;
+
+      Stats::Probe probe (Stats::Parse);
+      if (opts.stats)
+         stats.addInput (inputSize);
+
+      if (astralUse.isStale ())
+         scanAstralGlyphs (false);
+
       lastEscBegin = 0;
       lastNormalBegin = 0;
       lastStopPos = 0;
       hideCursor ();
       for (readPos = 0; readPos < inputSize; ++readPos)
       {
-         const unsigned char& ch = input [readPos];
-         switch (inputState)
+         const unsigned char ch = input [readPos];
+         if (inputState == InputState::Normal)
          {
-         case InputState::Normal:
-            switch (ch)
+            // Fast paths for runs of graphic characters
+            if (ch >= 0x20 && ch < 0x7f && canPlaceGraphicRun ())
             {
-            case '\x00': // ignore NUL
-               break;
-            case '\e':
-               setState (compatLevel == CompatibilityLevel::VT52
-                         ? InputState::Escape_VT52
-                         : InputState::Escape);
-               inputOps [0] = 0;
-               nInputOps = 1;
-               lastEscBegin = readPos;
-               break;
-            case '\r': traceNormalInput (); inp_CR (); break;
-            case '\f': // fall through, treat as LineFeed ('\n')
-            case '\v': // fall through, treat as LineFeed ('\n')
-            case '\n': traceNormalInput (); esc_IND (); break;
-            case '\t': traceNormalInput (); inp_HT (); break;
-            case '\b': traceNormalInput (); csi_CUB (); break;
-            case '\a':
-               traceNormalInput ();
-               logI << "* Bell *" << std::endl;
-               break;
-            case '\x0e': traceNormalInput (); charsetState.gl = 1; break;
-            case '\x0f': traceNormalInput (); charsetState.gl = 0; break;
-            case '\x05': // ENQ - Enquiry
-               traceNormalInput ();
-               writePty ("This is Zutty.\r\n");
-               break;
-            default: inputGraphicChar (ch);
+               const int len = Utf8Decoder::scanPrintableAscii (
+                  input + readPos, inputSize - readPos);
+               placeGraphicRun (input + readPos, len);
+               readPos += len - 1;
+               continue;
             }
-            break;
-         case InputState::Escape_VT52:
-            switch (ch)
+            if (ch >= 0xc2 && canPlaceGraphicRun () && utf8dec.idle () &&
+                charsetState.g [charsetState.gr] == Charset::UTF8)
             {
-            case '\x18': case '\x1a': // CAN and SUB interrupts ESC sequence
-               setState (InputState::Normal); break;
-            case '\e': // ESC restarts ESC sequence
-               inputOps [0] = 0;
-               nInputOps = 1;
-               lastEscBegin = readPos;
-               break;
-            case '=':
-               keypadMode = KeypadMode::Application;
-               setState (InputState::Normal);
-               break;
-            case '>':
-               keypadMode = KeypadMode::Normal;
-               setState (InputState::Normal);
-               break;
-            case '<':
-               compatLevel = CompatibilityLevel::VT100;
-               setState (InputState::Normal);
-               break;
-            case 'A': csi_CUU (); break;
-            case 'B': csi_CUD (); break;
-            case 'C': csi_CUF (); break;
-            case 'D': csi_CUB (); break;
-            case 'F':
-               charsetState = CharsetState {};
-               charsetState.g [charsetState.gl] = Charset::DecSpec;
-               setState (InputState::Normal);
-               break;
-            case 'G':
-               charsetState = CharsetState {};
-               setState (InputState::Normal);
-               break;
-            case 'H': csi_CUP (); break;
-            case 'I': esc_RI (); break;
-            case 'J': csi_ED (); break;
-            case 'K': csi_EL (); break;
-            case 'Y': setState (InputState::VT52_CUP_Arg1); break;
-            case 'Z': writePty ("\e/Z"); break;
-            case 'c': esc_RIS (); break; // allow "reset" command to escape VT52
-            default: unhandledInput (ch); break;
+               uint32_t cps [256];
+               int nCps;
+               const int len = Utf8Decoder::decodeRun (
+                  input + readPos, inputSize - readPos, cps, 256, nCps);
+               if (len)
+               {
+                  placeGraphicRun (cps, nCps);
+                  readPos += len - 1;
+                  continue;
+               }
             }
+         }
+
+         const ParseTable::Entry& entry =
+            parseTable.entries [(int) inputState][ch];
+         switch (entry.action)
+         {
+         case Action::Unhandled:
+            unhandledInput (ch);
             break;
-         case InputState::VT52_CUP_Arg1:
-            inputOps [0] = input [readPos] - 31;
-            setState (InputState::VT52_CUP_Arg2);
+         case Action::Ignore:
             break;
-         case InputState::VT52_CUP_Arg2:
-            inputOps [1] = input [readPos] - 31;
-            nInputOps = 2;
-            csi_CUP ();
+         case Action::Print:
+            inputGraphicChar (ch);
             break;
-         case InputState::Escape:
-            switch (ch)
-            {
-            case '\x18': case '\x1a': // CAN and SUB interrupts ESC sequence
-               setState (InputState::Normal);
-               break;
-            case '\e': // ESC restarts ESC sequence
-               inputOps [0] = 0;
-               nInputOps = 1;
-               lastEscBegin = readPos;
-               break;
-            case ' ': setState (InputState::Esc_SPC); break;
-            case '#': setState (InputState::Esc_Hash); break;
-            case '%': setState (InputState::Esc_Pct); break;
-            case '[': setState (InputState::CSI); break;
-            case ']': argBuf.clear (); setState (InputState::OSC); break;
-            case '(': case ')': case '*': case '+':
-            case '-': case '.': case '/':
-            case ',': case '$': // from ISO/IEC 2022 (absorbed, treat as no-op)
-               scsDst = ch;
-               scsMod = '\0';
-               setState (InputState::SelectCharset);
-               break;
-            case 'D': esc_IND (); break;
-            case 'M': esc_RI (); break;
-            case 'E': esc_NEL (); break;
-            case 'H': esc_HTS (); break;
-            case 'N': charsetState.ss = 2; setState (InputState::Normal); break;
-            case 'O': charsetState.ss = 3; setState (InputState::Normal); break;
-            case 'P': argBuf.clear (); setState (InputState::DCS); break;
-            case 'c': esc_RIS (); break;
-            case '6': esc_BI (); break;
-            case '7': esc_DECSC (); break;
-            case '8': esc_DECRC (); break;
-            case '9': esc_FI (); break;
-            case '=':
-               keypadMode = KeypadMode::Application;
-               setState (InputState::Normal);
-               break;
-            case '>':
-               keypadMode = KeypadMode::Normal;
-               setState (InputState::Normal);
-               break;
-            case '<':
-               compatLevel = CompatibilityLevel::VT400;
-               setState (InputState::Normal);
-               break;
-            case '~': charsetState.gr = 1; setState (InputState::Normal); break;
-            case 'n': charsetState.gl = 2; setState (InputState::Normal); break;
-            case '}': charsetState.gr = 2; setState (InputState::Normal); break;
-            case 'o': charsetState.gl = 3; setState (InputState::Normal); break;
-            case '|': charsetState.gr = 3; setState (InputState::Normal); break;
-            case '\\': setState (InputState::Normal); break; // ignore lone ST
-            default: unhandledInput (ch); break;
-            }
+         case Action::Enter:
+            setState ((InputState) entry.arg);
             break;
-         case InputState::Esc_SPC:
-            switch (ch)
-            {
-            case 'F':
-               logU << "S7C1T: Send 7-bit controls" << std::endl;
-               setState (InputState::Normal);
-               break;
-            case 'G':
-               logU << "S8C1T: Send 8-bit controls" << std::endl;
-               setState (InputState::Normal);
-               break;
-            case 'L':
-               logU << "Set ANSI conformance level 1" << std::endl;
-               setState (InputState::Normal);
-               break;
-            case 'M':
-               logU << "Set ANSI conformance level 2" << std::endl;
-               setState (InputState::Normal);
-               break;
-            case 'N':
-               logU << "Set ANSI conformance level 3" << std::endl;
-               setState (InputState::Normal);
-               break;
-            default: unhandledInput (ch); break;
-            }
+         case Action::EscStart:
+            setState (compatLevel == CompatibilityLevel::VT52
+                      ? InputState::Escape_VT52
+                      : InputState::Escape);
+            inputOps [0] = 0;
+            nInputOps = 1;
+            lastEscBegin = readPos;
             break;
-         case InputState::Esc_Hash:
-            switch (ch)
+         case Action::Param:
+            // Consume the whole run of parameter bytes at once
+            while (1)
             {
-            case '3':
-               logU << "DECDHL: Double-height, top half" << std::endl;
-               setState (InputState::Normal);
-               break;
-            case '4':
-               logU << "DECDHL: Double-height, bottom half" << std::endl;
-               setState (InputState::Normal);
-               break;
-            case '5':
-               logU << "DECSWL: Single-width line" << std::endl;
-               setState (InputState::Normal);
-               break;
-            case '6':
-               logU << "DECDWL: Double-width line" << std::endl;
-               setState (InputState::Normal);
-               break;
-            case '8': esch_DECALN (); break;
-            default: unhandledInput (ch); break;
+               const unsigned char pch = input [readPos];
+               if (pch == ';')
+               {
+                  if (nInputOps == maxEscOps)
+                  {
+                     logE << "inputOps full, increase maxEscOps (currently: "
+                          << maxEscOps << ")!" << std::endl;
+                     setState (InputState::Normal);
+                     break;
+                  }
+                  inputOps [nInputOps ++] = 0;
+               }
+               else if (inputOps [nInputOps - 1] < 429496704)
+               {
+                  inputOps [nInputOps - 1] *= 10;
+                  inputOps [nInputOps - 1] += pch - '0';
+               }
+               else
+               {
+                  logE << "inputOp overflow!" << std::endl;
+                  setState (InputState::Normal);
+                  break;
+               }
+               if (readPos + 1 == inputSize ||
+                   !isParamByte (input [readPos + 1]))
+                  break;
+               ++readPos;
             }
             break;
-         case InputState::Esc_Pct:
-            switch (ch)
+         case Action::ParamUndo:
+            if (readPos && input [readPos - 1] == ';')
             {
-            case '@':
-               logT << "Select charset: default (ISO-8859-1)" << std::endl;
-               charsetState = CharsetState {};
-               charsetState.g [charsetState.gr] = Charset::IsoLatin1;
-               setState (InputState::Normal);
-               break;
-            case 'G':
-               logT << "Select charset: UTF-8" << std::endl;
-               charsetState = CharsetState {};
-               setState (InputState::Normal);
-               break;
-            default: unhandledInput (ch); break;
+               if (nInputOps > 1)
+                  --nInputOps;
             }
-            break;
-         case InputState::SelectCharset:
-            if (ch < 0x30) // intermediate
-               scsMod = ch;
             else
-               esc_DCS (ch);
+               inputOps [nInputOps - 1] /= 10;
             break;
-         case InputState::CSI:
-            switch (ch)
-            {
-            COLLECT_NUMERIC_PARAMS;
-            case '\e': setState (InputState::Normal); break;
-            case 'A': csi_CUU (); break;
-            case 'B': csi_CUD (); break;
-            case 'C': csi_CUF (); break;
-            case 'D': csi_CUB (); break;
-            case 'E': csi_CNL (); break;
-            case 'F': csi_CPL (); break;
-            case 'G': csi_CHA (); break;
-            case 'H': case 'f': csi_CUP (); break;
-            case 'I': csi_CHT (); break;
-            case 'J': csi_ED (); break;
-            case 'K': csi_EL (); break;
-            case 'L': csi_IL (); break;
-            case 'M': csi_DL (); break;
-            case 'P': csi_DCH (); break;
-            case 'S': csi_SU (); break;
-            case 'T': csi_SD (); break;
-            case 'X': csi_ECH (); break;
-            case 'Z': csi_CBT (); break;
-            case '@': csi_ICH (); break;
-            case '`': csi_HPA (); break;
-            case 'a': csi_HPR (); break;
-            case 'b': csi_REP (); break;
-            case 'c': csi_priDA (); break;
-            case 'd': csi_VPA (); break;
-            case 'e': csi_VPR (); break;
-            case 'g': csi_TBC (); break;
-            case 'h': csi_SM (); break;
-            case 'l': csi_RM (); break;
-            case 'm': csi_SGR (); break;
-            case 'n': csi_DSR (); break;
-            case 'r': csi_STBM (); break;
-            case 's': csi_SCOSC_SLRM (); break;
-            case 't': csi_XTWINOPS (); break;
-            case 'u': csi_SCORC (); break;
-            case '\'': setState (InputState::CSI_Quote); break;
-            case '\"': setState (InputState::CSI_DblQuote); break;
-            case '!': setState (InputState::CSI_Bang); break;
-            case '?': setState (InputState::CSI_priv); break;
-            case ' ': setState (InputState::CSI_SPC); break;
-            case '>': setState (InputState::CSI_GT); break;
-            case '\a': break; // ignore
-            case '\b': // undo last character in CSI sequence:
-               if (readPos && input [readPos - 1] == ';')
-                  --nInputOps;
-               else
-                  inputOps [nInputOps - 1] /= 10;
-               break;
-            case '\t': inp_HT (); setState (InputState::CSI); break;
-            case '\r': inp_CR (); setState (InputState::CSI); break;
-            case '\f': // fall through
-            case '\v': esc_IND (); setState (InputState::CSI); break;
-            default: unhandledInput (ch); break;
-            }
+         case Action::Execute:
+            traceNormalInput ();
+            dispatch (entry.arg);
             break;
-         case InputState::CSI_Bang:
-            switch (ch)
-            {
-            case 'p': csi_DECSTR (); break;
-            default: unhandledInput (ch); break;
-            }
+         case Action::ExecuteInSeq:
+         {
+            // The handler may clobber the parameters and end the sequence
+            const InputState state = inputState;
+            const size_t nOps = nInputOps;
+            uint32_t ops [maxEscOps];
+            std::copy (inputOps, inputOps + nOps, ops);
+            dispatch (entry.arg);
+            setState (state);
+            std::copy (ops, ops + nOps, inputOps);
+            nInputOps = nOps;
             break;
-         case InputState::CSI_Quote:
-            switch (ch)
-            {
-            case '}': csi_DECIC (); break;
-            case '~': csi_DECDC (); break;
-            default: unhandledInput (ch); break;
-            }
+         }
+         case Action::Dispatch:
+            dispatch (entry.arg);
             break;
-         case InputState::CSI_DblQuote:
-            switch (ch)
-            {
-            case 'p': csiq_DECSCL (); break;
-            default: unhandledInput (ch); break;
-            }
+         case Action::Unimplemented:
+            logU << unimplementedNames [entry.arg] << std::endl;
+            setState (InputState::Normal);
             break;
-         case InputState::CSI_SPC:
-            switch (ch)
-            {
-            case '@': csi_ecma48_SL (); break;
-            case 'A': csi_ecma48_SR (); break;
-            default: unhandledInput (ch); break;
-            }
+         case Action::ScsStart:
+            scsDst = ch;
+            scsMod = '\0';
+            setState (InputState::SelectCharset);
             break;
-         case InputState::CSI_GT:
-            switch (ch)
-            {
-            COLLECT_NUMERIC_PARAMS;
-            case 'c': csi_secDA (); break;
-            default: unhandledInput (ch); break;
-            }
+         case Action::ScsMod:
+            scsMod = ch;
             break;
-         case InputState::CSI_priv:
-            switch (ch)
-            {
-            COLLECT_NUMERIC_PARAMS;
-            case '\e': setState (InputState::Normal); break;
-            case 'h': csi_privSM (); break;
-            case 'l': csi_privRM (); break;
-            default: unhandledInput (ch); break;
-            }
+         case Action::ScsFinal:
+            esc_DCS (ch);
             break;
-         case InputState::DCS:
-            switch (ch)
-            {
-            case '\e': setState (InputState::DCS_Esc); break;
-            default:
-               if (argBuf.size () < 4095)
-                  argBuf.push_back (ch);
-               else
-               {
-                  logE << "DCS argument string overflow" << std::endl;
-                  setState (InputState::Normal);
-               }
-               break;
-            }
+         case Action::StrStart:
+            argBuf.clear ();
+            setState ((InputState) entry.arg);
             break;
-         case InputState::DCS_Esc:
-            switch (ch)
-            {
-            case '\\': traceNormalInput (); handle_DCS (); break;
-            default:
-               argBuf.push_back ('\e');
+         case Action::StrPut:
+            if (argBuf.size () < 4095)
                argBuf.push_back (ch);
-               setState (InputState::DCS);
-               break;
-            }
-            break;
-         case InputState::OSC:
-            switch (ch)
+            else
             {
-            case '\a': traceNormalInput (); handle_OSC (); break;
-            case '\e': setState (InputState::OSC_Esc); break;
-            default:
-               if (argBuf.size () < 4095)
-                  argBuf.push_back (ch);
-               else
-               {
-                  logE << "OSC argument string overflow" << std::endl;
-                  setState (InputState::Normal);
-               }
-               break;
+               logE << (inputState == InputState::DCS ? "DCS" : "OSC")
+                    << " argument string overflow" << std::endl;
+               setState (InputState::Normal);
             }
             break;
-         case InputState::OSC_Esc:
-            switch (ch)
+         case Action::StrEsc:
+            argBuf.push_back ('\e');
+            argBuf.push_back (ch);
+            setState ((InputState) entry.arg);
+            break;
+         case Action::Vt52CupArg:
+            inputOps [entry.arg] = ch - 31;
+            if (entry.arg == 0)
+               setState (InputState::VT52_CUP_Arg2);
+            else
             {
-            case '\\': traceNormalInput (); handle_OSC (); break;
-            default:
-               argBuf.push_back ('\e');
-               argBuf.push_back (ch);
-               setState (InputState::OSC);
-               break;
+               nInputOps = 2;
+               csi_CUP ();
             }
             break;
          }
@@ -1307,43 +1492,33 @@ namespace zutty {
    }
 
    bool
-   Vterm::selectFinish (std::string& utf8_selection)
+   Vterm::selectFinish (SelectedText::Ptr& text)
    {
       logT << "selectFinish ()" << std::endl;
 
       showCursor ();
       redraw ();
 
-      Rect& sel = cf->selection;
-      if (sel.empty ())
+      Frame& df = displayFrame ();
+      Rect& sel = df.selection;
+      if (sel.empty () || sel.tl.y >= nRows) // nothing below the last row
          return false;
 
-      using utf16str = std::vector <uint16_t>;
-      std::vector <utf16str> lines;
-      bool wrap = false;
+      // A new one each time, handed over to the SelectionManager (on the
+      // main thread), which is all that refers to it from then on.
+      auto selected = std::make_shared <SelectedText> ();
 
       // save lines from the selected range of the frame cell buffer
       auto addLine =
          [&] (uint16_t y, uint16_t x1, uint16_t x2)
          {
-            utf16str line;
-            bool wrapBack = wrap;
-            wrap = false;
-            for (uint16_t x = x1; x < x2; ++x)
-            {
-               line.push_back (cf->getCell (y, x).uc_pt);
-               if (x == nColsEff - 1 || x == nCols - 1)
-                  wrap = cf->getCell (y, x).wrap;
-            }
-
-            while (!wrap && line.size () && line.back () == ' ')
-               line.pop_back (); // discard trailing whitespace
-
-            if (wrapBack && lines.size ())
-               lines.back ().insert (lines.back ().end (),
-                                     line.begin (), line.end ());
-            else
-               lines.push_back (line);
+            const Cell* row = &df.getCell (y, 0);
+            bool wrap = false;
+            if (x1 < nCols && x2 >= nCols)
+               wrap = row [nCols - 1].wrap;
+            else if (x1 < nColsEff && x2 >= nColsEff)
+               wrap = row [nColsEff - 1].wrap;
+            selected->addRow (row, x1, x2, wrap);
          };
 
       if (sel.br.y == nRows)
@@ -1369,21 +1544,7 @@ namespace zutty {
          addLine (sel.br.y, 0, sel.br.x);
       }
 
-      // convert to UTF-8
-      std::vector <char> utf8_out;
-      for (const auto& u16s: lines)
-      {
-         for (uint16_t cp: u16s)
-            Utf8Encoder::pushUnicode (cp, [&] (char ch)
-                                          {
-                                             utf8_out.push_back (ch);
-                                          });
-         utf8_out.push_back ('\n');
-      }
-      while (utf8_out.size () && utf8_out.back () == '\n')
-         utf8_out.pop_back (); // discard trailing empty lines
-
-      utf8_selection = std::string (utf8_out.data (), utf8_out.size ());
+      text = std::move (selected);
       return true;
    }
 
@@ -1404,21 +1565,104 @@ namespace zutty {
    }
 
    void
-   Vterm::pasteSelection (const std::string& utf8_selection)
+   Vterm::pasteSelection (const PasteChunk& chunk, bool last)
    {
-      std::ostringstream oss;
+      static const PasteChunk bracketStart =
+         std::make_shared <const std::string> ("\e[200~");
+      static const PasteChunk bracketEnd =
+         std::make_shared <const std::string> ("\e[201~");
+
+      if (!pasteOngoing)
+      {
+         resetView ();
+         // the markers go around the whole paste, not each chunk
+         pasteBracketed = bracketedPasteMode;
+         if (pasteBracketed)
+            pasteQueue.push_back (bracketStart);
+         pasteOngoing = true;
+      }
+
+      if (chunk && chunk->size ())
+         pasteQueue.push_back (chunk);
 
-      if (bracketedPasteMode)
-         oss << "\e[200~";
+      if (last)
+      {
+         if (pasteBracketed)
+            pasteQueue.push_back (bracketEnd);
+         pasteOngoing = false;
+      }
+   }
+
+   void
+   Vterm::flushPty ()
+   {
+      // Refill the queue from the paste for as long as the pty drains it
+      do
+      {
+         if (!ptyOut.flush (ptyFd))
+         {
+            logW << "Write to pty failed: " << strerror (errno)
+                 << std::endl;
+            pasteQueue.clear ();
+            pastePos = 0;
+            return;
+         }
+         if (pasteQueue.empty () || ptyOut.space () < pasteSliceSize)
+            return;
+         queuePasteSlice ();
+      }
+      while (true);
+   }
 
-      for (const auto ch: utf8_selection)
-         oss << (ch == '\n' ? '\r' : ch);
+   void
+   Vterm::queueOutput (const char* data, size_t len)
+   {
+      if (capture)
+         capture->input (data, len);
+      const size_t taken = ptyOut.push (data, len);
+      if (taken < len)
+      {
+         logW << "Pty output queue full, dropped " << len - taken
+              << " bytes" << std::endl;
+      }
+      // the paste (if any) is left for flushPty () to go on with
+      if (!ptyOut.flush (ptyFd))
+      {
+         logW << "Write to pty failed: " << strerror (errno) << std::endl;
+      }
+   }
 
-      if (bracketedPasteMode)
-         oss << "\e[201~";
+   // Move the next slice of the paste, with line breaks as typed, to ptyOut
+   void
+   Vterm::queuePasteSlice ()
+   {
+      char buf [pasteSliceSize];
+      size_t len = 0;
+      while (len < sizeof (buf) && !pasteQueue.empty ())
+      {
+         const std::string& text = *pasteQueue.front ();
+         const size_t n = std::min (sizeof (buf) - len,
+                                    text.size () - pastePos);
+         std::replace_copy (text.begin () + pastePos,
+                            text.begin () + pastePos + n,
+                            buf + len, '\n', '\r');
+         len += n;
+         pastePos += n;
+         if (pastePos == text.size ())
+         {
+            pasteQueue.pop_front ();
+            pastePos = 0;
+         }
+      }
 
-      if (oss.str ().size ())
-         writePty (oss.str ().c_str (), true);
+      ptyOut.push (buf, len);
+      if (capture)
+         capture->input (buf, len);
+      if (localEcho)
+      {
+         auto ubuf = (unsigned char*)buf;
+         processInput (getLocalEcho (ubuf, ubuf + len));
+      }
    }
 
 } // namespace zutty
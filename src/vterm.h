@@ -11,12 +11,19 @@
 
 #pragma once
 
+#include "capture.h"
 #include "frame.h"
+#include "outqueue.h"
+#include "scrollback.h"
+#include "seltext.h"
 #include "utf8.h"
 
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace zutty {
 
@@ -101,55 +108,78 @@ namespace zutty {
          const char * input;
       };
 
-      int writePty (uint8_t ch, VtModifier modifiers = VtModifier::none,
-                    bool userInput = false);
-      int writePty (const char* cstr, bool userInput = false);
-      int writePty (VtKey key, VtModifier modifiers = VtModifier::none);
+      /* Output to the shell is queued (up to ptyOutCapacity bytes, beyond
+       * which it is dropped) and written out as far as the pty takes it
+       * without blocking; flushPty () writes the rest once it is writable.
+       */
+      void writePty (uint8_t ch, VtModifier modifiers = VtModifier::none,
+                     bool userInput = false);
+      void writePty (const char* cstr, bool userInput = false);
+      void writePty (VtKey key, VtModifier modifiers = VtModifier::none);
+      bool isOutputPending () const;
+      void flushPty (); // call on POLLOUT
 
       void readPty ();
+      // process a chunk of output from the shell, as read by readPty ()
+      void processInput (const unsigned char *const input, int size);
 
       const MouseTrackingState& getMouseTrackingState () const;
 
       void setHasFocus (bool);
       void mouseWheelUp ();
       void mouseWheelDown ();
+      bool scrollbackPageUp ();
+      bool scrollbackPageDown ();
 
       void selectStart (int pX, int pY, bool cycleSnapTo);
       void selectExtend (int pX, int pY, bool cycleSnapTo);
       void selectUpdate (int pX, int pY);
-      bool selectFinish (std::string& utf8_selection);
+      bool selectFinish (SelectedText::Ptr& text);
       void selectClear ();
       void selectRectangularModeToggle ();
 
-      void pasteSelection (const std::string& utf8_selection);
+      /* Paste text handed over in one or more chunks, the last one flagged
+       * as such. It is queued by reference and fed to the output queue a
+       * slice at a time as the pty takes it, so that a large paste does
+       * not hold up reading the output of the shell in the meantime.
+       */
+      using PasteChunk = std::shared_ptr <const std::string>;
+      void pasteSelection (const PasteChunk& chunk, bool last);
+
+      /* Record the session from here on into a capture file at path (see
+       * CaptureWriter), up to the end of this Vterm. Throws if the file
+       * cannot be created.
+       */
+      void startCapture (const std::string& path);
 
    private:
+      void queueOutput (const char* data, size_t len);
+      void queuePasteSlice ();
+
       std::string getLocalEcho (const unsigned char *const begin,
                                 const unsigned char *const end);
-      void processInput (const unsigned char *const input, int size);
       void processInput (const std::string& str);
 
-      // table entry for deciding which set of InputSpecs to use
-      struct InputSpecTable
-      {
-         std::function <bool ()> predicate;
-         const InputSpec * specs = nullptr;
-         bool visited = false;
-      };
-
-      InputSpecTable * getInputSpecTable ();
-      void resetInputSpecTable ();
-      const InputSpec * selectInputSpecs ();
-      const InputSpec & getInputSpec (VtKey key);
+      // the InputSpec of key in the current input mode (see vterm.cc)
+      const InputSpec & getInputSpec (VtKey key) const;
 
       void unhandledInput (unsigned char ch);
       void traceNormalInput ();
       void resetTerminal ();
       void resetAttrs ();
+      void syncAttrs ();
+      void compactAttrs ();
+      void scanAstralGlyphs (bool full);
+      template <typename Fn> void forEachCell (Fn fn);
       void resetScreen ();
       void clearScreen ();
       void fillScreen (uint16_t ch);
 
+      void scrollView (int nLines);
+      void resetView ();
+      void composeView ();
+      Frame& displayFrame ();
+
       enum class InputState: uint8_t
       {
          Normal,
@@ -203,6 +233,20 @@ namespace zutty {
 
       void setState (InputState inputState);
 
+      /* The input is parsed by a state machine in the style of the DEC
+       * parser of Paul Williams (https://vt100.net/emu/dec_ansi_parser):
+       * the action to take on a byte (along with the state to enter or
+       * the handler to run) is looked up in a table indexed by the input
+       * state and the byte itself. The table is generated at compile
+       * time; handlers are called through parseHandlers.
+       */
+      constexpr const static int nInputStates =
+         (int) InputState::VT52_CUP_Arg2 + 1;
+      struct ParseTable;
+      static const ParseTable parseTable;
+      static void (Vterm::* const parseHandlers []) ();
+      void dispatch (uint8_t handler);
+
       uint32_t setCur ();
       void normalizeCursorPos ();
       uint32_t startOfThisLine ();
@@ -210,6 +254,7 @@ namespace zutty {
       bool isCursorInsideMargins ();
       void eraseRange (uint32_t start, uint32_t end);
       void eraseRow (uint16_t pY);
+      void eraseRows (uint16_t startY, uint16_t endY);
       void copyRow (uint16_t dstY, uint16_t srcY);
       void insertRows (uint16_t startY, uint16_t count);
       void deleteRows (uint16_t startY, uint16_t count);
@@ -220,6 +265,8 @@ namespace zutty {
       void hideCursor ();
       void inputGraphicChar (unsigned char ch);
       void placeGraphicChar ();
+      bool canPlaceGraphicRun () const;
+      template <typename T> void placeGraphicRun (const T* run, int len);
       void jumpToNextTabStop ();
       void setFgFromPalIx ();
       void setBgFromPalIx ();
@@ -228,6 +275,11 @@ namespace zutty {
       void inp_LF ();        // Line Feed
       void inp_CR ();        // Carriage Return
       void inp_HT ();        // Horizontal Tab
+      void inp_IND ();       // Index (LF, VT and FF)
+      void inp_BEL ();       // Bell
+      void inp_SO ();        // Shift Out (invoke G1 into GL)
+      void inp_SI ();        // Shift In (invoke G0 into GL)
+      void inp_ENQ ();       // Enquiry
 
       void esc_DCS (unsigned char fin); // Designate Character Set
       bool esc_IND ();       // Index
@@ -236,6 +288,22 @@ namespace zutty {
       void esc_BI ();        // Back Index
       void esc_FI ();        // Forward Index
       void esc_HTS ();       // Horizontal Tab Set
+      void esc_SS2 ();       // Single Shift 2
+      void esc_SS3 ();       // Single Shift 3
+      void esc_LS2 ();       // Locking Shift 2 (invoke G2 into GL)
+      void esc_LS3 ();       // Locking Shift 3 (invoke G3 into GL)
+      void esc_LS1R ();      // Locking Shift 1 Right (invoke G1 into GR)
+      void esc_LS2R ();      // Locking Shift 2 Right (invoke G2 into GR)
+      void esc_LS3R ();      // Locking Shift 3 Right (invoke G3 into GR)
+      void esc_DECKPAM ();   // Keypad Application Mode
+      void esc_DECKPNM ();   // Keypad Numeric Mode
+      void esc_ANSI ();      // Set VT400 compatibility level
+      void escp_ISO8859 ();  // Select charset: default (ISO-8859-1)
+      void escp_UTF8 ();     // Select charset: UTF-8
+      void vt52_ANSI ();     // Exit VT52 mode (to VT100)
+      void vt52_EGM ();      // Enter Graphics Mode
+      void vt52_XGM ();      // Exit Graphics Mode
+      void vt52_IDENT ();    // Identify
       void csi_SCOSC_SLRM (); // disambiguation
       void csi_SCOSC ();     // Save Cursor Position
       void csi_SCORC ();     // Restore Cursor Position
@@ -305,20 +373,33 @@ namespace zutty {
       RefreshHandlerFn onRefresh;
       OscHandlerFn onOsc;
       bool haveOscHandler = false;
+      std::unique_ptr <CaptureWriter> capture; // of -record, if any
 
       // Cell storage, display and input state
 
+      AttrTable::Ptr attrTable; // shared by the frames and the scrollback
+      AstralGlyphUse astralUse; // astral glyph IDs held by the cells
       Frame frame_pri;
       Frame frame_alt;
       Frame* cf;              // current frame (primary or alternative)
+      Frame frame_view;       // composed view while scrolled back
+      Scrollback scrollback;  // lines scrolled off the primary screen
+      uint32_t viewOffset = 0; // number of scrollback lines shown on top
+      bool viewStale = false;  // frame_view needs composing for viewOffset
+      bool composingView = false;  // compactAttrs () is held off meanwhile
+      bool compactPending = false; // the table filled up while held off
+      bool astralScanPending = false; // ... or the astral glyph IDs ran out
+      constexpr const static int wheelScrollLines = 5;
       uint32_t cur = 0;       // current screen position (abs. offset in cells)
       uint16_t posX = 0;      // current cursor horizontal position (on-screen)
       uint16_t posY = 0;      // current cursor vertical position (on-screen)
       bool curPosViaCharPlacement = false;
 
-      CharVdev::Cell attrs;   // prototype cell with current attributes
-      Color* fg = &attrs.fg;
-      Color* bg = &attrs.bg;
+      Cell attrs;   // prototype cell with current attributes
+      Attrs sgrAttrs; // the current attributes, interned into attrs.attr
+      bool sgrChanged = false; // ... by syncAttrs () before the next use
+      Color* fg = &sgrAttrs.fg;
+      Color* bg = &sgrAttrs.bg;
       Color palette256 [256];
       int defaultFgPalIx; // if -1, set from opts.fg, else idx into palette256
       int defaultBgPalIx; // if -1, set from opts.bg, else idx into palette256
@@ -327,7 +408,7 @@ namespace zutty {
       bool reverseVideo = false;
       bool hasFocus = false;
 
-      unsigned char inputBuf [32 * 1024];
+      std::vector <unsigned char> inputBuf; // opts.readSize bytes
       int readPos = 0;
       int lastEscBegin = 0;
       int lastNormalBegin = 0;
@@ -344,6 +425,16 @@ namespace zutty {
 
       VtModifier modifiers = VtModifier::none;
 
+      constexpr const static size_t ptyOutCapacity = 1 << 16;
+      OutputQueue ptyOut;
+
+      // Paste text not yet queued, including bracketed paste markers
+      std::deque <PasteChunk> pasteQueue;
+      size_t pastePos = 0; // queued of pasteQueue.front ()
+      bool pasteOngoing = false; // more chunks of it are to come
+      bool pasteBracketed = false;
+      constexpr const static size_t pasteSliceSize = 4096;
+
       // Terminal state - N.B.: keep resetTerminal () in sync with this!
 
       bool showCursorMode = true;
@@ -385,6 +476,8 @@ namespace zutty {
 
       void switchColMode (ColMode colMode);
       void switchScreenBufferMode (bool altScreenBufferMode);
+      void resizePrimary (uint16_t nCols_, uint16_t nRows_,
+                          uint16_t& pY, uint16_t& pX);
 
       enum class Charset: uint8_t // sync w/charCodes definition!
       { UTF8, DecSpec, DecSuppl, DecUserPref, DecTechn, IsoLatin1, IsoUK };
@@ -415,7 +508,7 @@ namespace zutty {
       };
       struct SavedCursor_DEC: SavedCursor_SCO
       {
-         CharVdev::Cell attrs;
+         Attrs attrs;
          bool autoWrapMode = true;
          OriginMode originMode = OriginMode::Absolute;
          CharsetState charsetState = CharsetState {};
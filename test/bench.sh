@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# Run the built-in benchmark mode (see -bench in USAGE.org) on recorded
+# terminal output, printing one line of JSON results per input. Any
+# arguments are passed on to Zutty, e.g.: -geometry 132x50
+
+cd $(dirname $0)
+
+ZUTTY=../build/src/zutty
+if [ ! -x ${ZUTTY} ] ; then
+    echo "Missing ${ZUTTY} - please build Zutty first!"
+    exit 1
+fi
+
+VTSCRIPT=$(mktemp --suffix=-vtscript)
+trap "rm -f ${VTSCRIPT}" EXIT
+zcat vtscript.gz > ${VTSCRIPT}
+
+for INPUT in ${VTSCRIPT} UTF-8-test.txt ; do
+    ${ZUTTY} -bench ${INPUT} "$@" || exit 1
+done